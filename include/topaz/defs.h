@@ -35,11 +35,27 @@
  */
 
 #include <stdint.h>
+#include <pthread.h>
 #include <topaz/errno.h>
 
-/* Maximum number of bytes for an I/O operation */
+/* Initial number of bytes for an I/O operation */
 #define MAX_IO_BLOCK (64 * 1024)
 
+/* Largest ComPacket the host will propose (grown into after handshake) */
+#define MAX_COM_PKT_SIZE (1024 * 1024)
+
+/* Longest controller name remembered per drive */
+#define MAX_HBA_PATH 128
+
+/* Methods with a remembered response latency, per drive */
+#define MAX_LATENCY_METHODS 16
+
+/* Sessions kept open for reuse, per drive */
+#define MAX_POOL_SESSIONS 4
+
+/* Longest password remembered to reopen a pooled session */
+#define MAX_PIN_SIZE 32
+
 /** SSCs (Messaging sets) supported by drive */
 typedef enum
 {
@@ -54,18 +70,217 @@ typedef enum
 
 } tp_ssc_type_t;
 
+/** Transports (command sets) used to reach TPer */
+typedef enum
+{
+  /** No transport attached */
+  TP_TRANS_UNKNOWN  = 0,
+  
+  /** ATA Trusted Send / Receive via ATA12 pass through */
+  TP_TRANS_ATA      = 1,
+  
+  /** NVMe Security Send / Receive admin commands */
+  TP_TRANS_NVME     = 2,
+  
+  /** SCSI Security Protocol In / Out */
+  TP_TRANS_SCSI     = 3,
+  
+  /** Playback of previously recorded traffic */
+  TP_TRANS_REPLAY   = 4,
+  
+  /** In-process software TPer */
+  TP_TRANS_EMU      = 5
+
+} tp_trans_type_t;
+
+/** Progress of transaction on session */
+typedef enum
+{
+  /** No transaction */
+  TP_TXN_NONE    = 0,
+  
+  /** Started, waiting to go out with next method call */
+  TP_TXN_PENDING = 1,
+  
+  /** Start sent, waiting for TPer to acknowledge */
+  TP_TXN_SENT    = 2,
+  
+  /** Open on TPer */
+  TP_TXN_OPEN    = 3
+  
+} tp_txn_state_t;
+
+/** Learned response latency of a method */
+typedef struct
+{
+  /** Method UID (TP_SWG_NULL for session end, etc) */
+  uint64_t method_uid;
+  
+  /** Smoothed time from request sent to response ready (ns) */
+  uint64_t est_ns;
+  
+} tp_latency_t;
+
+/** Communication properties (of TPer, or host), zero if not reported */
+typedef struct
+{
+  /** Most method calls in one ComPacket */
+  uint64_t max_methods;
+  
+  /** Most subpackets in one packet */
+  uint64_t max_subpackets;
+  
+  /** Largest packet (bytes) */
+  uint64_t max_packet_size;
+  
+  /** Most packets in one ComPacket */
+  uint64_t max_packets;
+  
+  /** Largest ComPacket (bytes) */
+  uint64_t max_com_pkt_size;
+  
+  /** Largest ComPacket sent in response (bytes) */
+  uint64_t max_resp_com_pkt_size;
+  
+  /** Most concurrent sessions (TPer only) */
+  uint64_t max_sessions;
+  
+  /** Most concurrent read only sessions (TPer only) */
+  uint64_t max_read_sessions;
+  
+  /** Largest individual token (bytes) */
+  uint64_t max_ind_token_size;
+  
+  /** Largest total of tokens in one subpacket (bytes) */
+  uint64_t max_agg_token_size;
+  
+  /** Most authentications in one session (TPer only) */
+  uint64_t max_authentications;
+  
+  /** Most nested transactions (TPer only) */
+  uint64_t max_transaction_limit;
+  
+  /** Idle time before TPer aborts session, in ms (TPer only) */
+  uint64_t def_session_timeout;
+  
+  /** Longest session timeout host may ask for, in ms (TPer only) */
+  uint64_t max_session_timeout;
+  
+  /** Shortest session timeout host may ask for, in ms (TPer only) */
+  uint64_t min_session_timeout;
+  
+  /** Time before TPer aborts transaction, in ms (TPer only) */
+  uint64_t def_trans_timeout;
+  
+  /** Longest transaction timeout host may ask for, in ms (TPer only) */
+  uint64_t max_trans_timeout;
+  
+  /** Shortest transaction timeout host may ask for, in ms (TPer only) */
+  uint64_t min_trans_timeout;
+  
+  /** Longest an issued dynamic ComID stays valid unused (TPer only) */
+  uint64_t max_comid_time;
+  
+  /** Supports continued tokens */
+  uint64_t continued_tokens;
+  
+  /** Supports packet sequence numbers */
+  uint64_t sequence_numbers;
+  
+  /** Supports packet ACK / NAK */
+  uint64_t ack_nak;
+  
+  /** Supports asynchronous protocol */
+  uint64_t asynchronous;
+  
+} tp_props_t;
+
+/** Authenticated session kept open for reuse */
+typedef struct
+{
+  /** Slot holds an open session */
+  int active;
+  
+  /** Lent out as current session of drive */
+  int in_use;
+  
+  /** SP session is attached to */
+  uint64_t sp_uid;
+  
+  /** Authority session was opened with, or 0 if anonymous */
+  uint64_t auth_uid;
+  
+  /** Password of authority, to reopen session */
+  unsigned char pin[MAX_PIN_SIZE];
+  
+  /** Length of password */
+  size_t pin_len;
+  
+  /** Read / write session */
+  int write;
+  
+  /** Session ID data for Trusted Peripheral (Drive) */
+  uint32_t tper_session_id;
+  
+  /** Session ID data for Host */
+  uint32_t host_session_id;
+  
+  /** When session was last handed back to pool (monotonic ns) */
+  uint64_t idle_since;
+  
+} tp_pool_session_t;
+
 /** Trusted Peripheral (TPer) handle */
 typedef struct
 {
-  /** Raw OS device handle */
+  /** Transport selected for device */
+  tp_trans_type_t trans_type;
+  
+  /** Raw OS device handle (ATA) */
   struct tp_ata_handle *ata;
   
+  /** Raw OS device handle (NVMe) */
+  struct tp_nvme_handle *nvme;
+  
+  /** Raw OS device handle (SCSI) */
+  struct tp_scsi_handle *scsi;
+  
+  /** Recorded trace being played back */
+  struct tp_replay_handle *replay;
+  
+  /** Emulated TPer */
+  struct tp_emu *emu;
+  
+  /** Trace of transport traffic being recorded (or NULL) */
+  struct tp_trace *trace;
+  
+  /** Serializes use of transport by drive and its channels */
+  pthread_mutex_t *trans_lock;
+  
+  /** Controller / expander drive is attached via (empty if unknown) */
+  char hba[MAX_HBA_PATH];
+  
   /** Supports security protocol 2 (com & prog resets) */
   int has_reset;
   
+  /** Supports dynamic ComID management (GET_COMID, etc) */
+  int has_comid_mgmt;
+  
   /** ComID to use for TCG SWG messaging */
   uint32_t com_id;
   
+  /** First statically allocated ComID of SSC */
+  uint32_t comid_base;
+  
+  /** Number of statically allocated ComIDs */
+  unsigned int comid_count;
+  
+  /** ComID was issued to handle by TPer, and is released on close */
+  int comid_dynamic;
+  
+  /** Transport borrowed from another handle, on another ComID */
+  int is_channel;
+  
   /** Supported messaging set */
   tp_ssc_type_t ssc_type;
   
@@ -77,15 +292,69 @@ typedef struct
   
   /** Largest valid ComPacketSize for session */
   size_t max_token_size;
+  
+  /** Most method calls TPer accepts in one ComPacket */
+  unsigned int max_methods;
+  
+  /** Communication properties reported by TPer */
+  tp_props_t tper_props;
+  
+  /** Host communication properties, as accepted by TPer */
+  tp_props_t host_props;
 
+  /** Default time budget for a method call (ms), or 0 for library default */
+  unsigned int timeout_ms;
+  
+  /** Deadline of method call in progress (monotonic ns), or 0 if none */
+  uint64_t deadline;
+  
+  /** Object of method call being built in I/O space */
+  uint64_t call_obj_uid;
+  
+  /** Method of method call being built in I/O space */
+  uint64_t call_method_uid;
+  
+  /** Method call sent, response not yet collected */
+  int call_posted;
+  
+  /** When posted method call was sent (monotonic ns) */
+  uint64_t call_sent;
+  
+  /** When posted method call was last polled without response */
+  uint64_t call_polled;
+  
   /** Session ID data for Trusted Peripheral (Drive) */
   uint32_t tper_session_id;
   
   /** Session ID data for Host */
   uint32_t host_session_id;
   
+  /** Transaction on current session */
+  tp_txn_state_t txn_state;
+  
+  /** Last host session ID handed out */
+  uint32_t last_host_session_id;
+  
+  /** Sessions kept open for reuse, one of which may be current */
+  tp_pool_session_t pool[MAX_POOL_SESSIONS];
+  
+  /** Idle time before pooled session is closed (ms), or 0 for library default */
+  unsigned int pool_ttl_ms;
+  
   /** Space for doing I/O (non-reentrant) */
-  char io_block[MAX_IO_BLOCK];
+  char *io_block;
+  
+  /** Size of I/O space */
+  size_t io_block_size;
+  
+  /** I/O space is owned (mapped) by transport, rather than heap */
+  int io_block_mapped;
+  
+  /** Response latencies seen from TPer, to pace polling */
+  tp_latency_t latency[MAX_LATENCY_METHODS];
+  
+  /** Next latency slot to reuse once table is full */
+  unsigned int latency_next;
   
 } tp_handle_t;
 
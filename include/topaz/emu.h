@@ -0,0 +1,140 @@
+#ifndef TOPAZ_EMU_H
+#define TOPAZ_EMU_H
+
+/*
+ * Topaz - TPer Emulator
+ *
+ * This file implements a software Trusted Peripheral (TPer), answering
+ * IF-SEND / IF-RECV in process so the SWG stack can be exercised without
+ * a self encrypting drive attached. Modelled are Level 0 Discovery,
+ * protocol 2 ComID resets, session manager Properties / StartSession,
+ * Get / Set on a small Admin SP and Locking SP (Opal SSC), and a single
+ * transaction at a time.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <topaz/errno.h>
+
+/** Path prefix selecting emulated TPer in tp_open() */
+#define TP_EMU_PREFIX "emu:"
+
+/** First ComID of emulated TPer */
+#define TP_EMU_COMID_BASE 0x1000
+
+/** Number of ComIDs on emulated TPer */
+#define TP_EMU_COMID_COUNT 4
+
+/** First ComID handed out by GET_COMID on emulated TPer */
+#define TP_EMU_DYN_COMID_BASE 0x2000
+
+/** Number of ComIDs handed out by GET_COMID on emulated TPer */
+#define TP_EMU_DYN_COMID_COUNT 8
+
+/** Most concurrent sessions on emulated TPer */
+#define TP_EMU_MAX_SESSIONS 8
+
+/** Default MaxComPacketSize of emulated TPer */
+#define TP_EMU_MAX_PKT_SIZE (256 * 1024)
+
+/** PIN of emulated C_PIN_MSID (and initial value of other PINs) */
+#define TP_EMU_MSID "TOPAZ-EMULATED-MSID"
+
+/** Opaque emulated TPer */
+struct tp_emu;
+
+/**
+ * \brief Create Emulated TPer
+ *
+ * Bring up a new TPer, in manufactured state
+ *
+ * \return Pointer to new TPer, or NULL on error
+ */
+struct tp_emu *tp_emu_create(void);
+
+/**
+ * \brief Destroy Emulated TPer
+ *
+ * \param[in] emu Emulated TPer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_destroy(struct tp_emu *emu);
+
+/**
+ * \brief Set Method Latency
+ *
+ * Set how long the TPer takes to answer a method, during which IF-RECV
+ * returns empty ComPackets (as a busy drive would).
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] method_uid UID of method, or TP_SWG_NULL to set the default
+ * \param[in] ns Latency in nanoseconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_set_latency(struct tp_emu *emu, uint64_t method_uid,
+			      uint64_t ns);
+
+/**
+ * \brief Set TPer Property
+ *
+ * Change (or add) a communication property reported by the TPer in
+ * response to the Properties method.
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] name Property name (e.g. "MaxComPacketSize")
+ * \param[in] value Property value
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_set_property(struct tp_emu *emu, char const *name,
+			       uint64_t value);
+
+/**
+ * \brief Emulated IF-SEND
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_if_send(struct tp_emu *emu, uint8_t proto, uint16_t comid,
+			  void const *data, size_t len);
+
+/**
+ * \brief Emulated IF-RECV
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_if_recv(struct tp_emu *emu, uint8_t proto, uint16_t comid,
+			  void *data, size_t len);
+
+#endif
@@ -99,6 +99,12 @@ typedef enum
   /** Bad / Malformed response from TPM */
   TP_ERR_MALFORMED       = 0x00020007,
 
+  /** TPM has no ComID available */
+  TP_ERR_NO_COMID        = 0x00020008,
+
+  /** TPM closed session unexpectedly */
+  TP_ERR_SESSION_ABORTED = 0x00020009,
+
 /* SWG Method Call Statuses */
 
   /** Call Failure - Success */
@@ -166,6 +172,27 @@ typedef enum
   /** Packet too large for drive */
   TP_ERR_PACKET_SIZE     = 0x00040002,
 
+  /** Bad NVMe completion status */
+  TP_ERR_NVME_STATUS     = 0x00040003,
+
+  /** Failed to set up or enter io_uring */
+  TP_ERR_URING           = 0x00040004,
+
+  /** Failed to queue or collect sg request */
+  TP_ERR_SG_QUEUE        = 0x00040005,
+
+  /** Bad trace file, or traffic does not match trace */
+  TP_ERR_TRACE           = 0x00040006,
+
+  /** Device (or SAT layer) rejected ATA command */
+  TP_ERR_ATA_ABORT       = 0x00040007,
+
+  /** Device reported ATA error */
+  TP_ERR_ATA_ERROR       = 0x00040008,
+
+  /** Transient transport failure, retries exhausted */
+  TP_ERR_TRANSIENT       = 0x00040009,
+
 /* Linux Specific Errors */
 
   /** Error reading from sysfs */
@@ -174,12 +201,15 @@ typedef enum
   /** Libata blocking TPM calls (add kernel argument 'libata.allow_tpm=1') */
   TP_ERR_LIBATA          = 0x00050001,
 
+  /** Kernel sed-opal request rejected (or CONFIG_BLK_SED_OPAL missing) */
+  TP_ERR_SED_OPAL        = 0x00050002,
+
 
 /* === END AUTOGENERATED CONTENT === */
 } tp_errno_t;
 
-/** Last topaz error number */
-tp_errno_t tp_errno;
+/** Last topaz error number (per thread) */
+extern __thread tp_errno_t tp_errno;
 
 /**
  * \brief Error Number String Lookup (Current)
@@ -53,6 +53,33 @@ typedef struct
   uint32_t failed;
 } tp_comid_resp_t;
 
+/** VERIFY_COMID_VALID Response */
+typedef struct
+{
+  uint16_t com_id;
+  uint16_t com_id_ext;
+  uint32_t req_code;
+  uint32_t avail_data;
+  uint32_t state;
+} tp_comid_verify_resp_t;
+
+/** ComID states, per VERIFY_COMID_VALID */
+typedef enum
+{
+  /** Not issued, or no longer valid */
+  TP_COMID_INVALID    = 0,
+  
+  /** Valid, but not yet issued */
+  TP_COMID_INACTIVE   = 1,
+  
+  /** Issued to host, no session yet */
+  TP_COMID_ISSUED     = 2,
+  
+  /** Issued, and session(s) opened on it */
+  TP_COMID_ASSOCIATED = 3
+  
+} tp_comid_state_t;
+
 /**
  * \brief Probe TPM Security Protocols
  *
@@ -84,4 +111,39 @@ char const *tp_security_proto_lookup(unsigned char proto);
  */
 tp_errno_t tp_security_comid_reset(tp_handle_t *handle, uint32_t com_id);
 
+/**
+ * \brief Get Dynamic ComID
+ *
+ * Ask TPer to issue a ComID (GET_COMID) for exclusive use of the caller
+ *
+ * \param[in] handle Target drive
+ * \param[out] com_id Issued Communication ID
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_get_comid(tp_handle_t *handle, uint32_t *com_id);
+
+/**
+ * \brief Verify ComID
+ *
+ * Query state of a communication ID (VERIFY_COMID_VALID)
+ *
+ * \param[in] handle Target drive
+ * \param[in] com_id Communication ID to check
+ * \param[out] state State of ComID
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_verify_comid(tp_handle_t *handle, uint32_t com_id,
+				    tp_comid_state_t *state);
+
+/**
+ * \brief Release Dynamic ComID
+ *
+ * Hand an issued ComID back to TPer, ending any sessions still on it
+ *
+ * \param[in] handle Target drive
+ * \param[in] com_id Communication ID to release
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_comid_release(tp_handle_t *handle, uint32_t com_id);
+
 #endif
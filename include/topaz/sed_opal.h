@@ -0,0 +1,140 @@
+#ifndef TOPAZ_SED_OPAL_H
+#define TOPAZ_SED_OPAL_H
+
+/*
+ * Topaz - Kernel SED Support
+ *
+ * This file implements OS abstracted API to hand Opal locking range
+ * credentials to an in-kernel Opal implementation, so ranges can be
+ * locked / unlocked by the kernel itself (e.g. on resume from suspend)
+ * without another user space session handshake.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <topaz/errno.h>
+
+/** Longest key accepted by kernel */
+#define TP_SED_KEY_MAX 256
+
+/** Locking range state */
+typedef enum
+{
+  /** Read only (write locked) */
+  TP_SED_LOCK_RO = 0x01,
+  
+  /** Read / write (unlocked) */
+  TP_SED_LOCK_RW = 0x02,
+  
+  /** Read and write locked */
+  TP_SED_LOCK_LK = 0x04
+  
+} tp_sed_lock_state_t;
+
+/** Locking range credentials */
+typedef struct
+{
+  /** Locking SP user (0 = Admin1, 1 = User1, etc) */
+  uint8_t user;
+  
+  /** Locking range (0 = Global Range) */
+  uint8_t range;
+  
+  /** Single User Mode */
+  int sum;
+  
+  /** Length of key */
+  size_t key_len;
+  
+  /** Key (password) of user */
+  uint8_t key[TP_SED_KEY_MAX];
+  
+} tp_sed_key_t;
+
+/** Opaque kernel SED handle (OS-Agnostic) */
+struct tp_sed_handle;
+
+/**
+ * \brief Open Kernel SED Device (OS Specific)
+ *
+ * OS-agnostic API to provide a handle for the kernel's Opal support
+ * of a block device. Fails if the kernel does not manage the device.
+ *
+ * \param[in] path Path to block device
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_sed_handle *tp_sed_open(char const *path);
+
+/**
+ * \brief Close Kernel SED Device (OS Specific)
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_close(struct tp_sed_handle *handle);
+
+/**
+ * \brief Query Kernel SED Status (OS Specific)
+ *
+ * Fetch the kernel's view of Level 0 Discovery, as flags in the order
+ * supported, locking supported, locking enabled, locked, MBR enabled and
+ * MBR done (bit 0 upward).
+ *
+ * \param[in] handle Device handle
+ * \param[out] flags Status flags
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_get_status(struct tp_sed_handle *handle, uint32_t *flags);
+
+/**
+ * \brief Save Locking Range Key (OS Specific)
+ *
+ * Hand a locking range key to the kernel, which replays it to restore
+ * the range to the given state whenever the drive resumes from suspend.
+ *
+ * \param[in] handle Device handle
+ * \param[in] key Locking range credentials
+ * \param[in] state State to restore range to on resume
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_save(struct tp_sed_handle *handle, tp_sed_key_t const *key,
+		       tp_sed_lock_state_t state);
+
+/**
+ * \brief Lock / Unlock Locking Range (OS Specific)
+ *
+ * Have the kernel open its own session and set the range state
+ *
+ * \param[in] handle Device handle
+ * \param[in] key Locking range credentials
+ * \param[in] state New state of range
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_lock_unlock(struct tp_sed_handle *handle,
+			      tp_sed_key_t const *key,
+			      tp_sed_lock_state_t state);
+
+#endif
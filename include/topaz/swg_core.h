@@ -79,6 +79,26 @@ typedef struct
   tp_swg_sub_packet_header_t sub;
 } tp_swg_header_t;
 
+/** One method call within a batch */
+typedef struct
+{
+  /** UID of object for method call */
+  uint64_t obj_uid;
+  
+  /** UID of method to call */
+  uint64_t method_uid;
+  
+  /** Encoded arguments to pass to method (or NULL for none) */
+  tp_buffer_t const *args;
+  
+  /** Encoded return, filled in on success */
+  tp_buffer_t result;
+  
+  /** Outcome of this call */
+  tp_errno_t status;
+  
+} tp_swg_batch_t;
+
 /**
  * \brief Send payload via SWG comms
  *
@@ -103,6 +123,55 @@ tp_errno_t tp_swg_send(tp_handle_t *dev, tp_buffer_t const *payload,
  */
 tp_errno_t tp_swg_recv(tp_buffer_t *payload, tp_handle_t *dev);
 
+/**
+ * \brief Post Method Call
+ *
+ * Close out method call begun with tp_swg_call_begin(), and send it
+ * without waiting for the response. Collect it later with
+ * tp_swg_call_reap() or tp_swg_call_wait_any(). Only one call may be
+ * outstanding per drive handle (ComID), so to have several in flight at
+ * once, post them on separate channels or handles. Any other I/O to the
+ * drive before the response is collected discards the call.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] args Arguments encoded in place, from tp_swg_call_begin()
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_post(tp_handle_t *dev, tp_buffer_t const *args,
+			    uint64_t deadline);
+
+/**
+ * \brief Reap Method Call
+ *
+ * Check once, without waiting, for the response to a call posted with
+ * tp_swg_call_post(). The drive is not even asked until most of the
+ * latency seen before from the method has passed.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[out] done Set non-zero once call is finished (either way)
+ * \return 0 on success (or still in flight), error code indicating failure
+ */
+tp_errno_t tp_swg_call_reap(tp_handle_t *dev, tp_buffer_t *response,
+			    int *done);
+
+/**
+ * \brief Wait for Any Method Call
+ *
+ * Wait for the first of the calls posted on several drive handles to
+ * finish, and collect it, so slow methods on one handle do not hold up
+ * calls on the others. Handles with nothing posted are skipped.
+ *
+ * \param[in,out] devs Drive handles (e.g. channels of one drive)
+ * \param[in] count Number of drive handles
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[out] which Index of drive handle whose call finished
+ * \return Status of finished call, or error code indicating failure
+ */
+tp_errno_t tp_swg_call_wait_any(tp_handle_t **devs, unsigned int count,
+				tp_buffer_t *response, unsigned int *which);
+
 /**
  * \brief Invoke Method
  *
@@ -120,20 +189,122 @@ tp_errno_t tp_swg_invoke(tp_handle_t *dev, tp_buffer_t *response,
 			 tp_buffer_t const *args);
 
 /**
- * \brief Host Properties
+ * \brief Begin Method Call
  *
- * Establish level 1 communications by exchanging communication properties
- * with TPM on drive.
+ * Start building a method call directly in the I/O block of the drive,
+ * behind space reserved for the ComPacket headers. On return, args is
+ * positioned where the method arguments go, so they can be encoded in
+ * place. Finish with tp_swg_call_commit(). Any other I/O to the drive in
+ * between discards the call.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] args Buffer to encode method arguments into
+ * \param[in] obj_uid UID of object for method call
+ * \param[in] method_uid UID of method to call
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_begin(tp_handle_t *dev, tp_buffer_t *args,
+			     uint64_t obj_uid, uint64_t method_uid);
+
+/**
+ * \brief Commit Method Call
+ *
+ * Close out method call begun with tp_swg_call_begin(), send it, and wait
+ * for the response, failing with TP_ERR_TIMEOUT if it has not arrived by
+ * deadline.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] args Arguments encoded in place, from tp_swg_call_begin()
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_commit(tp_handle_t *dev, tp_buffer_t *response,
+			      tp_buffer_t const *args, uint64_t deadline);
+
+/**
+ * \brief Invoke Method, with Deadline
+ *
+ * Invoke method in SWG communication stream upon object, failing with
+ * TP_ERR_TIMEOUT if the response has not arrived by deadline. Deadline
+ * also bounds the OS timeout of each transfer to the drive.
  *
  * \param[in,out] dev Target drive
  * \param[out] response Buffer to catch encoded return (or NULL to ignore)
  * \param[in] obj_uid UID of object for method call
  * \param[in] method_uid UID of method to call
  * \param[in] args Encoded arguments to pass to method (or NULL for none)
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_invoke_ex(tp_handle_t *dev, tp_buffer_t *response,
+			    uint64_t obj_uid, uint64_t method_uid,
+			    tp_buffer_t const *args, uint64_t deadline);
+
+/**
+ * \brief Compute Deadline
+ *
+ * \param[in] timeout_ms Time budget from now, in milliseconds
+ * \return Absolute deadline, for use with tp_swg_invoke_ex()
+ */
+uint64_t tp_swg_deadline(unsigned int timeout_ms);
+
+/**
+ * \brief Set Default Timeout
+ *
+ * Set time budget of method calls on drive not given an explicit deadline
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] timeout_ms Time budget in milliseconds, or 0 for library default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_set_timeout(tp_handle_t *dev, unsigned int timeout_ms);
+
+/**
+ * \brief Invoke Batch of Methods
+ *
+ * Send several independent method calls within the current session in a
+ * single ComPacket, and sort out the results of each from the response.
+ * As many calls are sent as the drive allows in one go (MaxMethods, and
+ * MaxComPacketSize), which may be fewer than requested. Results point
+ * within the I/O block of the drive, and are valid until its next I/O.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] batch Method calls, results and statuses filled in
+ * \param[in] count Number of method calls in batch
+ * \param[out] sent Number of leading method calls actually invoked
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_invoke_batch(tp_handle_t *dev, tp_swg_batch_t *batch,
+			       unsigned int count, unsigned int *sent);
+
+/**
+ * \brief Host Properties
+ *
+ * Establish level 1 communications by exchanging communication properties
+ * with TPM on drive.
+ *
+ * \param[in,out] dev Target drive
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_swg_do_properties(tp_handle_t *dev);
 
+/**
+ * \brief Host Properties, as Proposed by Caller
+ *
+ * Establish level 1 communications by exchanging communication properties
+ * with TPM on drive. Non-zero properties given by caller are proposed in
+ * place of library defaults, and properties only a TPer reports (session
+ * limits, timeouts, etc) are refused. The full property set reported by
+ * the TPer, and the host properties it accepted, are kept in the drive
+ * handle.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] host Host properties to propose (or NULL for defaults)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_do_properties_ex(tp_handle_t *dev, tp_props_t const *host);
+
 /**
  * \brief Start Session
  *
@@ -145,6 +316,23 @@ tp_errno_t tp_swg_do_properties(tp_handle_t *dev);
  */
 tp_errno_t tp_swg_session_start(tp_handle_t *dev, uint64_t sp_uid);
 
+/**
+ * \brief Start Authenticated Session
+ *
+ * Begin session with target Security Provider (SP), as given authority
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] sp_uid UID of SP object
+ * \param[in] auth_uid UID of authority, or 0 for anonymous session
+ * \param[in] pin Password of authority
+ * \param[in] pin_len Length of password
+ * \param[in] write Non-zero for read / write session
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_session_start_auth(tp_handle_t *dev, uint64_t sp_uid,
+				     uint64_t auth_uid, void const *pin,
+				     size_t pin_len, int write);
+
 /**
  * \brief End Session
  *
@@ -165,6 +353,105 @@ tp_errno_t tp_swg_session_end(tp_handle_t *dev);
  */
 tp_errno_t tp_swg_session_forget(tp_handle_t *dev);
 
+/**
+ * \brief Acquire Pooled Session
+ *
+ * Make a session with SP, as authority, the current session of drive.
+ * An idle session already open with the same SP, authority, password and
+ * mode is reused if there is one, saving the StartSession round trip.
+ * Hand session back with tp_swg_pool_release() rather than ending it.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] sp_uid UID of SP object
+ * \param[in] auth_uid UID of authority, or 0 for anonymous session
+ * \param[in] pin Password of authority
+ * \param[in] pin_len Length of password
+ * \param[in] write Non-zero for read / write session
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_acquire(tp_handle_t *dev, uint64_t sp_uid,
+			       uint64_t auth_uid, void const *pin,
+			       size_t pin_len, int write);
+
+/**
+ * \brief Release Pooled Session
+ *
+ * Hand current session back to pool, to be reused by a later
+ * tp_swg_pool_acquire(). Sessions with a transaction still open are ended
+ * instead (aborting the transaction), as are sessions not from the pool.
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_release(tp_handle_t *dev);
+
+/**
+ * \brief Invoke Method on Pooled Session
+ *
+ * As tp_swg_invoke(), but should the TPer have closed the current pooled
+ * session (e.g. timed out while idle), a new one is opened with the same
+ * credentials, and the method tried again. Nothing is retried within a
+ * transaction, as the TPer has rolled it back.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] obj_uid UID of object for method call
+ * \param[in] method_uid UID of method to call
+ * \param[in] args Encoded arguments to pass to method (or NULL for none)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_invoke(tp_handle_t *dev, tp_buffer_t *response,
+			      uint64_t obj_uid, uint64_t method_uid,
+			      tp_buffer_t const *args);
+
+/**
+ * \brief Flush Session Pool
+ *
+ * End all pooled sessions, including the current one if it came from pool
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_flush(tp_handle_t *dev);
+
+/**
+ * \brief Set Pooled Session Lifetime
+ *
+ * Set how long a session may sit idle in pool before it is closed
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] ttl_ms Idle time in milliseconds, or 0 for library default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_set_ttl(tp_handle_t *dev, unsigned int ttl_ms);
+
+/**
+ * \brief Start Transaction
+ *
+ * Start transaction on current session. Nothing is sent until the next
+ * method call (or batch), which then carries StartTransaction with it.
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_start(tp_handle_t *dev);
+
+/**
+ * \brief Commit Transaction
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_commit(tp_handle_t *dev);
+
+/**
+ * \brief Abort Transaction
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_abort(tp_handle_t *dev);
+
 /**
  * \brief Get Column By String (Obsolete)
  *
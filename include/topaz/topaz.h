@@ -40,7 +40,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <topaz/transport_ata.h>
+#include <topaz/transport.h>
 #include <topaz/defs.h>
 
 /**
@@ -53,6 +53,21 @@
  */
 tp_handle_t *tp_open(char const *path);
 
+/**
+ * \brief Open Channel on Drive
+ *
+ * Opens another handle on an already open drive, using one of the other
+ * statically allocated ComIDs of its SSC. Each channel keeps its own
+ * session, transaction, and I/O space, so work on one need not wait on
+ * another (e.g. when driven from separate threads). Channels share the
+ * drive's transport, and must be closed before the drive handle.
+ *
+ * \param[in] dev Open drive
+ * \param[in] index Which ComID, counting from SSC base (drive uses 0)
+ * \return Pointer to allocated handle, or NULL on error
+ */
+tp_handle_t *tp_channel_open(tp_handle_t *dev, unsigned int index);
+
 /**
  * \brief Close Drive / Trusted Peripheral (TPer)
  *
@@ -0,0 +1,52 @@
+#ifndef TOPAZ_TOPOLOGY_H
+#define TOPAZ_TOPOLOGY_H
+
+/*
+ * Topaz - Storage Topology
+ *
+ * This file implements OS abstracted API to find which host controller
+ * (or SAS expander) a drive sits behind, so work spread over many drives
+ * can avoid piling up on one shared path.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <topaz/errno.h>
+
+/**
+ * \brief Look Up Drive Controller (OS Specific)
+ *
+ * Find the shared path a drive is reached through, as a string naming the
+ * topmost SAS expander above it, or failing that its host controller. Drives
+ * returning the same string contend for the same link.
+ *
+ * \param[in] path Path to device
+ * \param[out] hba Buffer for controller name
+ * \param[in] len Size of buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_topo_lookup(char const *path, char *hba, size_t len);
+
+#endif
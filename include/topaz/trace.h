@@ -0,0 +1,196 @@
+#ifndef TOPAZ_TRACE_H
+#define TOPAZ_TRACE_H
+
+/*
+ * Topaz - Transport Traces
+ *
+ * This file implements recording of IF-SEND / IF-RECV traffic to a compact
+ * binary trace, and a transport which plays such a trace back in place of
+ * a real drive.
+ *
+ * Trace files are a tp_trace_file_t header followed by records, each a
+ * tp_trace_rec_t and its payload padded to 8 bytes, all in host byte
+ * order so the file can be walked directly from an mmap.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <topaz/errno.h>
+
+/** Trace file magic number */
+#define TP_TRACE_MAGIC "TPTRACE"
+
+/** Trace file format version */
+#define TP_TRACE_VERSION 1
+
+/** Path prefix selecting replay transport in tp_open() */
+#define TP_TRACE_REPLAY_PREFIX "replay:"
+
+/** Direction of recorded transfer */
+typedef enum
+{
+  TP_TRACE_SEND = 1,
+  TP_TRACE_RECV
+} tp_trace_dir_t;
+
+/** Trace file header */
+typedef struct
+{
+  char magic[8];    /** TP_TRACE_MAGIC */
+  uint32_t version; /** TP_TRACE_VERSION */
+  uint32_t flags;   /** Reserved, zero */
+} tp_trace_file_t;
+
+/** Trace record header */
+typedef struct
+{
+  uint64_t timestamp; /** Nanoseconds since trace started */
+  uint64_t duration;  /** Nanoseconds spent in transport */
+  uint32_t length;    /** Bytes transferred */
+  uint32_t stored;    /** Bytes of payload recorded (trailing zeros trimmed) */
+  int32_t status;     /** Result of transfer */
+  uint16_t comid;     /** Communication ID */
+  uint8_t proto;      /** Security protocol */
+  uint8_t dir;        /** Direction (tp_trace_dir_t) */
+} tp_trace_rec_t;
+
+/** Record traffic of subsequently opened drives to this file (or NULL).
+ *  Drives after the first get a count appended (.1, .2, etc) */
+extern char const *tp_trace_record;
+
+/** Replay speedup, 1 for real time, N for N times faster, 0 for no delay */
+extern unsigned int tp_trace_speedup;
+
+/** Opaque trace recorder */
+struct tp_trace;
+
+/** Opaque trace replay handle */
+struct tp_replay_handle;
+
+/**
+ * \brief Start Trace
+ *
+ * Create a new trace file for recording transport traffic
+ *
+ * \param[in] path Path to trace file
+ * \return Pointer to new recorder, or NULL on error
+ */
+struct tp_trace *tp_trace_open(char const *path);
+
+/**
+ * \brief Stop Trace
+ *
+ * Flush and close a trace file
+ *
+ * \param[in] trace Trace recorder
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trace_close(struct tp_trace *trace);
+
+/**
+ * \brief Get Time
+ *
+ * Library wide clock, for timing recorded transfers, method call
+ * deadlines, pooled sessions, and the emulated TPer
+ *
+ * \return Nanoseconds on a monotonic clock
+ */
+uint64_t tp_trace_now(void);
+
+/**
+ * \brief Record Transfer
+ *
+ * Append one IF-SEND / IF-RECV to trace
+ *
+ * \param[in] trace Trace recorder
+ * \param[in] dir Direction of transfer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes transferred
+ * \param[in] status Result of transfer
+ * \param[in] start Time transfer started, from tp_trace_now()
+ * \param[in] end Time transfer ended, from tp_trace_now()
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trace_write(struct tp_trace *trace, tp_trace_dir_t dir,
+			  uint8_t proto, uint16_t comid, void const *data,
+			  size_t len, tp_errno_t status,
+			  uint64_t start, uint64_t end);
+
+/**
+ * \brief Open Replay Transport
+ *
+ * Map a recorded trace for playback
+ *
+ * \param[in] path Path to trace file
+ * \return Pointer to new replay handle, or NULL on error
+ */
+struct tp_replay_handle *tp_replay_open(char const *path);
+
+/**
+ * \brief Close Replay Transport
+ *
+ * \param[in] handle Replay handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_close(struct tp_replay_handle *handle);
+
+/**
+ * \brief Replay IF-SEND
+ *
+ * Check outbound data against next recorded IF-SEND, and return its
+ * recorded status after its recorded (scaled) latency.
+ *
+ * \param[in] handle Replay handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_if_send(struct tp_replay_handle *handle, uint8_t proto,
+			     uint16_t comid, void const *data, size_t len);
+
+/**
+ * \brief Replay IF-RECV
+ *
+ * Return data of next recorded IF-RECV after its recorded (scaled)
+ * latency. Runs of empty ComPackets (a drive answering "no data yet") are
+ * played back by elapsed time rather than count, so hosts polling at a
+ * different rate than when recorded still line up.
+ *
+ * \param[in] handle Replay handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_if_recv(struct tp_replay_handle *handle, uint8_t proto,
+			     uint16_t comid, void *data, size_t len);
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef TOPAZ_TRANSPORT_H
+#define TOPAZ_TRANSPORT_H
+
+/*
+ * Topaz - Transport
+ *
+ * This file implements a transport agnostic API for TCG IF-SEND and IF-RECV
+ * calls, dispatching to whichever device transport (ATA, NVMe, etc) was
+ * selected when the drive was opened.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <topaz/defs.h>
+
+/** Default most batched commands in flight behind one controller */
+#define TP_HBA_DEPTH 8
+
+/** Most batched commands in flight behind one controller, 0 for no limit */
+extern unsigned int tp_trans_hba_depth;
+
+/** One IF-RECV in a batch across drives */
+typedef struct
+{
+  tp_handle_t *handle; /** Target drive */
+  uint8_t proto;       /** Security protocol */
+  uint16_t comid;      /** Communication ID */
+  void *data;          /** I/O data buffer */
+  size_t len;          /** Count of bytes to transfer */
+  tp_errno_t status;   /** Outcome of this IF-RECV */
+} tp_if_batch_t;
+
+/**
+ * \brief Open Transport
+ *
+ * Probe target device for a supported transport, and attach the first one
+ * found (and confirmed to contain a TPM) to the drive handle. Paths with
+ * the replay prefix attach a recorded trace instead, and traffic is
+ * recorded if tp_trace_record is set.
+ *
+ * \param[in,out] handle Target drive
+ * \param[in] path Path to device
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_open(tp_handle_t *handle, char const *path);
+
+/**
+ * \brief Close Transport
+ *
+ * Release any transport attached to drive handle
+ *
+ * \param[in,out] handle Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_close(tp_handle_t *handle);
+
+/**
+ * \brief Size I/O Block
+ *
+ * Make sure the drive handle's I/O block holds at least the given number
+ * of bytes. Where the transport can hand out a buffer it transfers without
+ * copying (e.g. an sg reserved buffer), that is used in place of the heap.
+ * Contents are not preserved.
+ *
+ * \param[in,out] handle Target drive
+ * \param[in] len Minimum size of I/O block
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_alloc_io(tp_handle_t *handle, size_t len);
+
+/**
+ * \brief IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send data to a particular
+ * Communication ID via a specified security protocol, using the transport
+ * attached to the drive handle.
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_send(tp_handle_t *handle, uint8_t proto,
+		      uint16_t comid, void *data, size_t len);
+
+/**
+ * \brief IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive data from a particular
+ * Communication ID via a specified security protocol, using the transport
+ * attached to the drive handle.
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_recv(tp_handle_t *handle, uint8_t proto,
+		      uint16_t comid, void *data, size_t len);
+
+/**
+ * \brief Batched IF-RECV
+ *
+ * Issue IF-RECV on many drives at once. ATA drives have their commands
+ * queued together and are then serviced by a shared wait, rather than one
+ * blocking ioctl per drive; other transports are handled one at a time.
+ * No more than tp_trans_hba_depth commands are kept in flight behind any
+ * one controller, and controllers are fed in turn so none is starved.
+ * Outcome of each request is in its status field.
+ *
+ * \param[in,out] batch Array of requests
+ * \param[in] count Number of requests
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_recv_batch(tp_if_batch_t *batch, unsigned count);
+
+#endif
@@ -31,19 +31,85 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <topaz/errno.h>
 
 /** Single ATA block (Note sector size may still be 4k) */
 #define TP_ATA_BLOCK_SIZE 512
 
+/** Most commands queued on one device at once (sg driver limit) */
+#define TP_ATA_QUEUE_DEPTH 16
+
 /** ATA operation direction */
 typedef enum
 {
   TP_ATA_OPER_READ = 1,
-  TP_ATA_OPER_WRITE
+  TP_ATA_OPER_WRITE,
+  TP_ATA_OPER_READ_DMA,
+  TP_ATA_OPER_WRITE_DMA
 } tp_ata_oper_type_t;
 
+/** Data transfer protocol for Trusted Send / Receive */
+typedef enum
+{
+  /** PIO commands (0x5e / 0x5c) */
+  TP_ATA_TRUSTED_PIO = 0,
+  
+  /** DMA commands (0x5f / 0x5d) advertised, but not yet seen to work */
+  TP_ATA_TRUSTED_DMA_PROBE,
+  
+  /** DMA commands known to work with device */
+  TP_ATA_TRUSTED_DMA
+} tp_ata_trusted_mode_t;
+
+/** Outcome of an ATA pass through command */
+typedef enum
+{
+  /** Completed without error */
+  TP_ATA_CLASS_OK = 0,
+  
+  /** Transport or device briefly unavailable, worth another try */
+  TP_ATA_CLASS_TRANSIENT,
+  
+  /** Command rejected (ABRT / ILLEGAL REQUEST), retry won't help */
+  TP_ATA_CLASS_REJECTED,
+  
+  /** Device fault, or status not understood */
+  TP_ATA_CLASS_FATAL
+} tp_ata_class_t;
+
+/** Decoded pass through sense data */
+typedef struct
+{
+  uint8_t sense_key;  /** SCSI sense key */
+  uint8_t asc;        /** Additional sense code */
+  uint8_t ascq;       /** Additional sense code qualifier */
+  int has_ata;        /** ATA status return data present */
+  uint8_t error;      /** ATA Error register */
+  uint8_t status;     /** ATA Status register */
+  tp_ata_class_t cls; /** Classification of outcome */
+} tp_ata_sense_t;
+
+/** What to do when a command fails transiently */
+typedef enum
+{
+  /** Report failure straight away */
+  TP_ATA_RETRY_FAIL_FAST = 0,
+  
+  /** Reissue command at once */
+  TP_ATA_RETRY_IMMEDIATE,
+  
+  /** Reissue command after a delay, doubling each time */
+  TP_ATA_RETRY_BACKOFF
+} tp_ata_retry_mode_t;
+
+/** Default attempts (including the first) at a transiently failing command */
+#define TP_ATA_RETRY_TRIES 3
+
+/** Default first backoff delay, in microseconds */
+#define TP_ATA_RETRY_DELAY_US 1000
+
 /** ATA12 Command */
 typedef struct
 {
@@ -56,6 +122,30 @@ typedef struct
   uint8_t command;
 } tp_ata_cmd12_t;
 
+/** ATA16 Command */
+typedef struct
+{
+  uint8_t feature_ext;
+  uint8_t feature;
+  uint8_t count_ext;
+  uint8_t count;
+  uint8_t lba_low_ext;
+  uint8_t lba_low;
+  uint8_t lba_mid_ext;
+  uint8_t lba_mid;
+  uint8_t lba_high_ext;
+  uint8_t lba_high;
+  uint8_t device;
+  uint8_t command;
+} tp_ata_cmd16_t;
+
+/** Completion of queued ATA command */
+typedef struct
+{
+  void *user;        /** Caller context given at submission */
+  tp_errno_t status; /** Outcome of command */
+} tp_ata_event_t;
+
 /** Opaque ATA device data handle (OS-Agnostic) */
 struct tp_ata_handle;
 
@@ -79,6 +169,81 @@ struct tp_ata_handle *tp_ata_open(char const *path);
  */
 tp_errno_t tp_ata_close(struct tp_ata_handle *handle);
 
+/**
+ * \brief Get Trusted Transfer Mode (OS Specific)
+ *
+ * Query which Trusted Send / Receive protocol is in use for device
+ *
+ * \param[in] handle Device handle
+ * \return Current transfer mode
+ */
+tp_ata_trusted_mode_t tp_ata_get_trusted_mode(struct tp_ata_handle *handle);
+
+/**
+ * \brief Set Trusted Transfer Mode (OS Specific)
+ *
+ * Remember which Trusted Send / Receive protocol to use for device
+ *
+ * \param[in] handle Device handle
+ * \param[in] mode New transfer mode
+ */
+void tp_ata_set_trusted_mode(struct tp_ata_handle *handle,
+			     tp_ata_trusted_mode_t mode);
+
+/**
+ * \brief Set Retry Policy (OS Specific)
+ *
+ * Choose how synchronous commands failing with a transient error (bus
+ * busy, unit attention, interface CRC, etc) are retried. Queued commands
+ * are never retried, their transient failures report TP_ERR_TRANSIENT.
+ * Nor is a Trusted Send after a bus reset or host adapter soft error, as
+ * the device may already have acted on it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] mode Retry policy
+ * \param[in] tries Attempts at command, including the first
+ * \param[in] delay_us First backoff delay in microseconds (backoff only)
+ */
+void tp_ata_set_retry(struct tp_ata_handle *handle, tp_ata_retry_mode_t mode,
+		      unsigned int tries, unsigned int delay_us);
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_ata_set_timeout(struct tp_ata_handle *handle, unsigned int timeout_ms);
+
+/**
+ * \brief Get Last Sense Data (OS Specific)
+ *
+ * Fetch decoded status of last synchronous command on device
+ *
+ * \param[in] handle Device handle
+ * \param[out] info Decoded sense data
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_get_sense(struct tp_ata_handle *handle,
+			    tp_ata_sense_t *info);
+
+/**
+ * \brief Decode SAT Sense Data
+ *
+ * Pull sense key and ATA Error / Status registers out of fixed or
+ * descriptor format sense data, and classify the outcome.
+ *
+ * \param[out] info Decoded sense data
+ * \param[in] sense Raw sense data
+ * \param[in] len Size of sense data
+ * \return Classification of outcome
+ */
+tp_ata_class_t tp_ata_decode_sense(tp_ata_sense_t *info, void const *sense,
+				   size_t len);
+
 /**
  * \brief Execute ATA12 Command (OS Specific)
  *
@@ -95,6 +260,132 @@ tp_errno_t tp_ata_close(struct tp_ata_handle *handle);
 tp_errno_t tp_ata_exec12(struct tp_ata_handle *handle, tp_ata_cmd12_t const *cmd,
 			 tp_ata_oper_type_t optype, void *data,
 			 uint8_t bcount, int wait);
+
+/**
+ * \brief Execute ATA16 Command (OS Specific)
+ *
+ * OS-agnostic API to execute an ATA16 command. The extended (16 bit)
+ * sector count is used whenever more than 255 blocks are transferred.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA16 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_exec16(struct tp_ata_handle *handle, tp_ata_cmd16_t const *cmd,
+			 tp_ata_oper_type_t optype, void *data,
+			 uint16_t bcount, int wait);
+
+/**
+ * \brief Get Queued Command Descriptor (OS Specific)
+ *
+ * Expose the descriptor which becomes readable when queued commands
+ * complete, for use in an external poll() / select() loop.
+ *
+ * \param[in] handle Device handle
+ * \return File descriptor, or -1 on error
+ */
+int tp_ata_get_queue_fd(struct tp_ata_handle *handle);
+
+/**
+ * \brief Map Zero Copy Buffer (OS Specific)
+ *
+ * Provide a buffer the kernel transfers to / from directly, without
+ * bounce copies. Commands whose data pointer is the start of this buffer
+ * use it automatically. Buffer is owned by the device handle, and remains
+ * valid until it is remapped or the handle is closed. If remapping fails,
+ * any previous buffer is left in place.
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] len Minimum size wanted, actual size on return
+ * \return Pointer to buffer, or NULL on error
+ */
+void *tp_ata_map_buffer(struct tp_ata_handle *handle, size_t *len);
+
+/**
+ * \brief Queue ATA12 Command (OS Specific)
+ *
+ * OS-agnostic API to queue an ATA12 command without waiting for it.
+ * Data buffer must remain valid until the command is reaped.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA12 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_submit12(struct tp_ata_handle *handle,
+			   tp_ata_cmd12_t const *cmd,
+			   tp_ata_oper_type_t optype, void *data,
+			   uint8_t bcount, int wait, void *user);
+
+/**
+ * \brief Queue ATA16 Command (OS Specific)
+ *
+ * OS-agnostic API to queue an ATA16 command without waiting for it.
+ * Data buffer must remain valid until the command is reaped.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA16 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_submit16(struct tp_ata_handle *handle,
+			   tp_ata_cmd16_t const *cmd,
+			   tp_ata_oper_type_t optype, void *data,
+			   uint16_t bcount, int wait, void *user);
+
+/**
+ * \brief Reap Queued Commands (OS Specific)
+ *
+ * Collect whatever queued commands have completed, without blocking.
+ * Status of each command is reported in its event.
+ *
+ * \param[in] handle Device handle
+ * \param[out] events Array to receive completions
+ * \param[in] max Size of events array
+ * \param[out] count Number of completions returned
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_reap(struct tp_ata_handle *handle, tp_ata_event_t *events,
+		       unsigned max, unsigned *count);
+
+/**
+ * \brief Abandon Queued Commands (OS Specific)
+ *
+ * Give up on every command still queued, for when a device stops
+ * answering. Their results are discarded, and caller buffers are no longer
+ * touched once this returns.
+ *
+ * \param[in] handle Device handle
+ */
+void tp_ata_abandon(struct tp_ata_handle *handle);
+
+/**
+ * \brief Wait on Queued Commands (OS Specific)
+ *
+ * Block until at least one of several devices has queued commands ready
+ * to reap, so one thread can service many devices with a single wait.
+ *
+ * \param[in] handles Array of device handles
+ * \param[out] ready Set nonzero for each device with completions waiting
+ * \param[in] count Number of devices
+ * \param[in] timeout_ms Longest time to wait, in milliseconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_poll(struct tp_ata_handle **handles, int *ready,
+		       unsigned count, int timeout_ms);
+
 /**
  * \brief ATA Identify
  *
@@ -132,7 +423,7 @@ tp_errno_t tp_ata_probe_tpm(struct tp_ata_handle *handle);
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_ata_if_send(struct tp_ata_handle *handle, uint8_t proto,
-			  uint16_t comid, void *data, uint8_t bcount);
+			  uint16_t comid, void *data, uint16_t bcount);
 
 /**
  * \brief ATA IF-RECV
@@ -149,6 +440,44 @@ tp_errno_t tp_ata_if_send(struct tp_ata_handle *handle, uint8_t proto,
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_ata_if_recv(struct tp_ata_handle *handle, uint8_t proto,
-			  uint16_t comid, void *data, uint8_t bcount);
+			  uint16_t comid, void *data, uint16_t bcount);
+
+/**
+ * \brief ATA IF-SEND (Queued)
+ *
+ * Queue a TCG SWG IF-SEND without waiting for it to complete. Completion
+ * is collected with tp_ata_reap(). Uses Trusted DMA only once the device
+ * has been seen to accept it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_if_send_async(struct tp_ata_handle *handle, uint8_t proto,
+				uint16_t comid, void *data, uint16_t bcount,
+				void *user);
+
+/**
+ * \brief ATA IF-RECV (Queued)
+ *
+ * Queue a TCG SWG IF-RECV without waiting for it to complete. Completion
+ * is collected with tp_ata_reap(). Uses Trusted DMA only once the device
+ * has been seen to accept it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_if_recv_async(struct tp_ata_handle *handle, uint8_t proto,
+				uint16_t comid, void *data, uint16_t bcount,
+				void *user);
 
 #endif
@@ -0,0 +1,205 @@
+#ifndef TOPAZ_TRANSPORT_NVME_H
+#define TOPAZ_TRANSPORT_NVME_H
+
+/*
+ * Topaz - NVMe Transport
+ *
+ * This file implements OS abstracted API to implement TCG IF-SEND and IF-RECV
+ * calls via NVMe Security Send / Security Receive admin commands.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <topaz/errno.h>
+
+/** Size of NVMe Identify data structures */
+#define TP_NVME_IDENTIFY_SIZE 4096
+
+/** NVMe operation direction */
+typedef enum
+{
+  TP_NVME_OPER_READ = 1,
+  TP_NVME_OPER_WRITE
+} tp_nvme_oper_type_t;
+
+/** NVMe Admin Command (fields used by topaz) */
+typedef struct
+{
+  uint8_t  opcode;
+  uint32_t nsid;
+  uint32_t cdw10;
+  uint32_t cdw11;
+} tp_nvme_cmd_t;
+
+/** Opaque NVMe device data handle (OS-Agnostic) */
+struct tp_nvme_handle;
+
+/**
+ * \brief Open NVMe Device (OS Specific)
+ *
+ * OS-agnostic API to provide an NVMe device handle. Fails if the
+ * target device does not accept NVMe admin commands.
+ *
+ * \param[in] path Path to device (controller or namespace)
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_nvme_handle *tp_nvme_open(char const *path);
+
+/**
+ * \brief Close NVMe Device (OS Specific)
+ *
+ * OS-agnostic API to close a NVMe device handle
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_close(struct tp_nvme_handle *handle);
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_nvme_set_timeout(struct tp_nvme_handle *handle, unsigned int timeout_ms);
+
+/**
+ * \brief Get NVMe Device Descriptor (OS Specific)
+ *
+ * Expose the underlying OS descriptor, for use by asynchronous engines
+ *
+ * \param[in] handle Device handle
+ * \return File descriptor, or -1 on error
+ */
+int tp_nvme_get_fd(struct tp_nvme_handle *handle);
+
+/**
+ * \brief Get Timeout Override (OS Specific)
+ *
+ * \param[in] handle Device handle
+ * \return Timeout in milliseconds, or 0 for per-command default
+ */
+unsigned int tp_nvme_get_timeout(struct tp_nvme_handle *handle);
+
+/**
+ * \brief Check for Character Device (OS Specific)
+ *
+ * Asynchronous engines can only pass commands through to the controller
+ * or generic namespace character devices, not block devices
+ *
+ * \param[in] handle Device handle
+ * \return Nonzero if device is a character device
+ */
+int tp_nvme_is_char(struct tp_nvme_handle *handle);
+
+/**
+ * \brief Get Optional Admin Command Support (OS Specific)
+ *
+ * OACS field of the Identify Controller data read when device was opened
+ *
+ * \param[in] handle Device handle
+ * \return OACS bits
+ */
+uint16_t tp_nvme_get_oacs(struct tp_nvme_handle *handle);
+
+/**
+ * \brief Execute NVMe Admin Command (OS Specific)
+ *
+ * OS-agnostic API to execute an NVMe admin command
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to NVMe command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] len Count of bytes to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_exec_admin(struct tp_nvme_handle *handle,
+			      tp_nvme_cmd_t const *cmd,
+			      tp_nvme_oper_type_t optype, void *data,
+			      uint32_t len, int wait);
+
+/**
+ * \brief NVMe Identify Controller
+ *
+ * Implementation of NVMe Identify command to query
+ * controller self-identification data.
+ *
+ * \param[in] handle Device handle
+ * \param[out] data Pointer to 4096 byte buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_get_identify(struct tp_nvme_handle *handle, void *data);
+
+/**
+ * \brief Probe NVMe Device for TPM
+ *
+ * Check Identify Controller data read at open for Security Send / Receive
+ * support
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_probe_tpm(struct tp_nvme_handle *handle);
+
+/**
+ * \brief NVMe IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send
+ * data to a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_if_send(struct tp_nvme_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len);
+
+/**
+ * \brief NVMe IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive
+ * data from a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_if_recv(struct tp_nvme_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len);
+
+#endif
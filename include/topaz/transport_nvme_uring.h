@@ -0,0 +1,148 @@
+#ifndef TOPAZ_TRANSPORT_NVME_URING_H
+#define TOPAZ_TRANSPORT_NVME_URING_H
+
+/*
+ * Topaz - NVMe Transport (Linux io_uring)
+ *
+ * This file implements an asynchronous engine for NVMe Security Send /
+ * Security Receive, allowing a single thread to keep commands in flight on
+ * many drives at once, and to collect their completions in batches.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <topaz/defs.h>
+
+/** Default number of submission queue entries */
+#define TP_URING_DEPTH 64
+
+/** Completed asynchronous IF-SEND / IF-RECV */
+typedef struct
+{
+  /** Drive command was issued to */
+  tp_handle_t *dev;
+  
+  /** Caller supplied cookie */
+  void *user;
+  
+  /** Result of the command */
+  tp_errno_t status;
+  
+} tp_uring_event_t;
+
+/** Opaque io_uring engine */
+struct tp_uring;
+
+/**
+ * \brief Open io_uring Engine
+ *
+ * Set up a submission / completion ring for NVMe pass through commands.
+ * Drives attached via their NVMe character device (/dev/nvmeX or
+ * /dev/ngXnY) are driven asynchronously. Block devices do not accept
+ * uring commands, so theirs run synchronously when queued, and complete
+ * like any other. No options are defined yet, as polled (IOPOLL) rings
+ * don't take admin pass through commands.
+ *
+ * \param[in] depth Number of submission queue entries
+ * \param[in] flags Engine options (must be zero)
+ * \return Pointer to new engine, or NULL on error
+ */
+struct tp_uring *tp_uring_open(unsigned int depth, unsigned int flags);
+
+/**
+ * \brief Close io_uring Engine
+ *
+ * Tear down ring. Any commands still in flight are abandoned.
+ *
+ * \param[in] ring Target engine
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_close(struct tp_uring *ring);
+
+/**
+ * \brief Queue Asynchronous IF-SEND
+ *
+ * Queue a Security Send to target drive. The command is not issued until
+ * tp_uring_submit() is called, and data must remain valid until reaped.
+ *
+ * \param[in] ring Target engine
+ * \param[in] dev Target drive (NVMe transport)
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \param[in] user Caller cookie returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_if_send(struct tp_uring *ring, tp_handle_t *dev,
+			    uint8_t proto, uint16_t comid, void *data,
+			    uint32_t len, void *user);
+
+/**
+ * \brief Queue Asynchronous IF-RECV
+ *
+ * Queue a Security Receive from target drive. The command is not issued
+ * until tp_uring_submit() is called, and data must remain valid until reaped.
+ *
+ * \param[in] ring Target engine
+ * \param[in] dev Target drive (NVMe transport)
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \param[in] user Caller cookie returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_if_recv(struct tp_uring *ring, tp_handle_t *dev,
+			    uint8_t proto, uint16_t comid, void *data,
+			    uint32_t len, void *user);
+
+/**
+ * \brief Submit Queued Commands
+ *
+ * Issue all queued commands with a single system call, optionally
+ * waiting until a number of completions are available.
+ *
+ * \param[in] ring Target engine
+ * \param[in] wait_nr Completions to wait for (0 to return immediately)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_submit(struct tp_uring *ring, unsigned int wait_nr);
+
+/**
+ * \brief Reap Completions
+ *
+ * Collect any finished commands, without blocking.
+ *
+ * \param[in] ring Target engine
+ * \param[out] events Array to receive completions
+ * \param[in] max Size of events array
+ * \param[out] count Number of completions returned
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_reap(struct tp_uring *ring, tp_uring_event_t *events,
+			 unsigned int max, unsigned int *count);
+
+#endif
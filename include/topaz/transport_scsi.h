@@ -0,0 +1,168 @@
+#ifndef TOPAZ_TRANSPORT_SCSI_H
+#define TOPAZ_TRANSPORT_SCSI_H
+
+/*
+ * Topaz - SCSI Transport
+ *
+ * This file implements OS abstracted API to implement TCG IF-SEND and IF-RECV
+ * calls via SCSI SECURITY PROTOCOL IN / OUT, as used by SAS and other native
+ * SCSI drives.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <topaz/errno.h>
+
+/** SCSI operation direction */
+typedef enum
+{
+  TP_SCSI_OPER_READ = 1,
+  TP_SCSI_OPER_WRITE
+} tp_scsi_oper_type_t;
+
+/** Opaque SCSI device data handle (OS-Agnostic) */
+struct tp_scsi_handle;
+
+/**
+ * \brief Open SCSI Device (OS Specific)
+ *
+ * OS-agnostic API to provide a SCSI device handle
+ *
+ * \param[in] path Path to device
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_scsi_handle *tp_scsi_open(char const *path);
+
+/**
+ * \brief Close SCSI Device (OS Specific)
+ *
+ * OS-agnostic API to close a SCSI device handle
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_close(struct tp_scsi_handle *handle);
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_scsi_set_timeout(struct tp_scsi_handle *handle, unsigned int timeout_ms);
+
+/**
+ * \brief Execute SCSI Command (OS Specific)
+ *
+ * OS-agnostic API to execute a SCSI command descriptor block
+ *
+ * \param[in] handle Device handle
+ * \param[in] cdb Command descriptor block
+ * \param[in] cdb_len Size of command descriptor block
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] len Count of bytes to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_exec(struct tp_scsi_handle *handle, uint8_t const *cdb,
+			uint8_t cdb_len, tp_scsi_oper_type_t optype,
+			void *data, uint32_t len, int wait);
+
+/**
+ * \brief SCSI Inquiry
+ *
+ * Implementation of SCSI INQUIRY command, for either standard
+ * inquiry data or a vital product data (VPD) page.
+ *
+ * \param[in] handle Device handle
+ * \param[in] evpd Non-zero to request a VPD page
+ * \param[in] page VPD page code
+ * \param[out] data Inquiry data buffer
+ * \param[in] len Size of inquiry data buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_get_inquiry(struct tp_scsi_handle *handle, int evpd,
+			       uint8_t page, void *data, uint16_t len);
+
+/**
+ * \brief Check for ATA Device
+ *
+ * Determine whether SCSI device is really an ATA device behind a SCSI /
+ * ATA Translation (SAT) layer, by looking for the ATA Information VPD page
+ *
+ * \param[in] handle Device handle
+ * \return Non-zero if ATA device (or type unknown), 0 otherwise
+ */
+int tp_scsi_is_ata(struct tp_scsi_handle *handle);
+
+/**
+ * \brief Probe SCSI Device for TPM
+ *
+ * Check that device accepts SECURITY PROTOCOL IN
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_probe_tpm(struct tp_scsi_handle *handle);
+
+/**
+ * \brief SCSI IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send
+ * data to a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_if_send(struct tp_scsi_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len);
+
+/**
+ * \brief SCSI IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive
+ * data from a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_if_recv(struct tp_scsi_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len);
+
+#endif
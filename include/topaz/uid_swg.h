@@ -61,6 +61,24 @@ enum
   /* Admin SP (Lifecycle managment) */
   TP_SWG_SP_ADMIN = TP_UID(0x205, 0x1),
   
+  /* Locking SP (Ranges, MBR shadowing) */
+  TP_SWG_SP_LOCKING = TP_UID(0x205, 0x2),
+  
+  /* Anybody Authority (No credentials) */
+  TP_SWG_ANYBODY = TP_UID(0x9, 0x1),
+  
+  /* Locking SP Administrator */
+  TP_SWG_ADMIN1 = TP_UID(0x9, 0x10001),
+  
+  /* PIN / Password of Locking SP Administrator */
+  TP_SWG_C_PIN_ADMIN1 = TP_UID(0xb, 0x10001),
+  
+  /* Global Locking Range (Whole drive) */
+  TP_SWG_LOCKING_GLOBAL = TP_UID(0x802, 0x1),
+  
+  /* MBR Shadowing Control */
+  TP_SWG_MBR_CONTROL = TP_UID(0x803, 0x1),
+  
   /* ========= METHODS ========= */
   
   /** SMUID - Communication Properties */
@@ -72,6 +90,9 @@ enum
   /** SMUID -  ACK / Response to Session Startup */
   TP_SWG_SYNC_SESSION  = TP_UID(0, 0xff03),
   
+  /** SMUID - TPer Closing Session on Host */
+  TP_SWG_CLOSE_SESSION = TP_UID(0, 0xff06),
+  
   /** Get Data (Obsolete, used in Enterprise) */
   TP_SWG_GET_OBS = TP_UID(0x6, 0x6),
   
@@ -3,10 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include <check.h>
 #include <topaz/topaz.h>
 #include <topaz/buffer.h>
 #include <topaz/syntax.h>
+#include <topaz/emu.h>
+#include <topaz/trace.h>
+#include <topaz/uid_swg.h>
+#include <topaz/swg_core.h>
 
 /* Helper macro for tests */
 #define CHECKME(x) if (x)                  \
@@ -21,6 +26,12 @@ void dump_buf(tp_buffer_t *buf);
 int run_uint(uint64_t value, size_t enc_size);
 int run_sint(int64_t value, size_t enc_size);
 int run_bin(size_t bin_size, size_t enc_size);
+tp_handle_t *emu_open(void);
+void enc_get(tp_buffer_t *args, void *raw, size_t len, uint64_t col);
+void check_msid(tp_buffer_t *ret);
+void run_get_batch(tp_handle_t *dev, unsigned int count);
+uint64_t get_read_locked(tp_handle_t *dev);
+tp_errno_t set_read_locked(tp_handle_t *dev, uint64_t value);
 
 /* Unit Tests for errno data type */
 
@@ -181,6 +192,263 @@ START_TEST(t_syn_bin)
 }
 END_TEST
 
+/* Unit Tests for SWG stack, against emulated TPer */
+
+START_TEST(t_emu_session)
+{
+  tp_handle_t *dev = emu_open();
+  tp_buffer_t ret;
+  
+  /* anonymous session, read a public PIN */
+  ck_assert_int_eq(tp_swg_session_start(dev, TP_SWG_SP_ADMIN), 0);
+  ck_assert_int_ne(dev->tper_session_id, 0);
+  ck_assert_int_eq(tp_swg_get_by_num(&ret, dev, TP_SWG_C_PIN_MSID, 3), 0);
+  check_msid(&ret);
+  ck_assert_int_eq(tp_swg_session_end(dev), 0);
+  ck_assert_int_eq(dev->tper_session_id, 0);
+  
+  /* authenticate, with right and wrong password */
+  ck_assert_int_ne(tp_swg_session_start_auth(dev, TP_SWG_SP_LOCKING,
+					     TP_SWG_ADMIN1, "x", 1, 1), 0);
+  ck_assert_int_eq(tp_swg_session_start_auth(dev, TP_SWG_SP_LOCKING,
+					     TP_SWG_ADMIN1, TP_EMU_MSID,
+					     strlen(TP_EMU_MSID), 1), 0);
+  ck_assert_int_eq(tp_swg_session_end(dev), 0);
+  
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_props)
+{
+  tp_handle_t *dev = emu_open();
+  tp_props_t host;
+  
+  /* done as part of open, TPer limits are kept */
+  ck_assert_int_eq(dev->tper_props.max_com_pkt_size, TP_EMU_MAX_PKT_SIZE);
+  ck_assert_int_eq(dev->tper_props.max_methods, 1);
+  ck_assert_int_eq(dev->tper_props.max_sessions, TP_EMU_MAX_SESSIONS);
+  ck_assert_int_ne(dev->host_props.max_com_pkt_size, 0);
+  ck_assert_uint_le(dev->max_com_pkt_size, TP_EMU_MAX_PKT_SIZE);
+  ck_assert_int_eq(dev->max_methods, 1);
+  
+  /* propose smaller ComPacket, the rest filled in */
+  memset(&host, 0, sizeof(host));
+  host.max_com_pkt_size = 4096;
+  ck_assert_int_eq(tp_swg_do_properties_ex(dev, &host), 0);
+  ck_assert_int_eq(dev->host_props.max_com_pkt_size, 4096);
+  ck_assert_int_eq(dev->host_props.max_packet_size, 4096 - 20);
+  ck_assert_uint_le(dev->max_com_pkt_size, 4096);
+  
+  /* not the host's to propose */
+  host.max_sessions = 2;
+  ck_assert_int_eq(tp_swg_do_properties_ex(dev, &host), TP_ERR_INVALID);
+  
+  /* TPer changes its mind */
+  ck_assert_int_eq(tp_emu_set_property(dev->emu, "MaxMethods", 4), 0);
+  ck_assert_int_eq(tp_swg_do_properties(dev), 0);
+  ck_assert_int_eq(dev->max_methods, 4);
+  
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_call)
+{
+  tp_handle_t *dev = emu_open();
+  tp_buffer_t args, ret;
+  int done = 0;
+  
+  ck_assert_int_eq(tp_swg_session_start(dev, TP_SWG_SP_ADMIN), 0);
+  
+  /* encoded in place, and waited for */
+  ck_assert_int_eq(tp_swg_call_begin(dev, &args, TP_SWG_C_PIN_MSID,
+				     TP_SWG_GET), 0);
+  enc_get(&args, NULL, 0, 3);
+  ck_assert_int_eq(tp_swg_call_commit(dev, &ret, &args,
+				      tp_swg_deadline(1000)), 0);
+  check_msid(&ret);
+  
+  /* posted, and reaped later */
+  ck_assert_int_eq(tp_swg_call_begin(dev, &args, TP_SWG_C_PIN_MSID,
+				     TP_SWG_GET), 0);
+  enc_get(&args, NULL, 0, 3);
+  ck_assert_int_eq(tp_swg_call_post(dev, &args, 0), 0);
+  
+  /* only one call in flight per handle */
+  ck_assert_int_eq(tp_swg_call_begin(dev, &args, TP_SWG_C_PIN_MSID,
+				     TP_SWG_GET), TP_ERR_INVALID);
+  
+  while (!done)
+  {
+    ck_assert_int_eq(tp_swg_call_reap(dev, &ret, &done), 0);
+  }
+  check_msid(&ret);
+  
+  /* missed deadline */
+  ck_assert_int_eq(tp_emu_set_latency(dev->emu, TP_SWG_GET, 50000000), 0);
+  ck_assert_int_eq(tp_swg_invoke_ex(dev, NULL, TP_SWG_C_PIN_MSID, TP_SWG_GET,
+				    NULL, tp_swg_deadline(5)), TP_ERR_TIMEOUT);
+  
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_batch)
+{
+  tp_handle_t *dev = emu_open();
+  tp_swg_batch_t batch[3];
+  tp_buffer_t args[3];
+  char raw[3][32];
+  unsigned int i, sent;
+  
+  /* TPer takes two at a time */
+  ck_assert_int_eq(tp_emu_set_property(dev->emu, "MaxMethods", 2), 0);
+  ck_assert_int_eq(tp_swg_do_properties(dev), 0);
+  ck_assert_int_eq(tp_swg_session_start(dev, TP_SWG_SP_ADMIN), 0);
+  
+  memset(batch, 0, sizeof(batch));
+  for (i = 0; i < 3; i++)
+  {
+    enc_get(&args[i], raw[i], sizeof(raw[i]), 3);
+    batch[i].obj_uid = TP_SWG_C_PIN_MSID;
+    batch[i].method_uid = TP_SWG_GET;
+    batch[i].args = &args[i];
+  }
+  
+  /* first two go out together */
+  ck_assert_int_eq(tp_swg_invoke_batch(dev, batch, 3, &sent), 0);
+  ck_assert_int_eq(sent, 2);
+  for (i = 0; i < sent; i++)
+  {
+    ck_assert_int_eq(batch[i].status, 0);
+    check_msid(&batch[i].result);
+  }
+  
+  /* then the rest */
+  ck_assert_int_eq(tp_swg_invoke_batch(dev, batch + 2, 1, &sent), 0);
+  ck_assert_int_eq(sent, 1);
+  ck_assert_int_eq(batch[2].status, 0);
+  check_msid(&batch[2].result);
+  
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_trans)
+{
+  tp_handle_t *dev = emu_open();
+  
+  ck_assert_int_eq(tp_swg_session_start_auth(dev, TP_SWG_SP_LOCKING,
+					     TP_SWG_ADMIN1, TP_EMU_MSID,
+					     strlen(TP_EMU_MSID), 1), 0);
+  ck_assert_int_eq(get_read_locked(dev), 0);
+  
+  /* nothing goes out until the next method call */
+  ck_assert_int_eq(tp_swg_trans_start(dev), 0);
+  ck_assert_int_eq(dev->txn_state, TP_TXN_PENDING);
+  ck_assert_int_eq(tp_swg_trans_start(dev), TP_ERR_INVALID);
+  
+  /* rolled back */
+  ck_assert_int_eq(set_read_locked(dev, 1), 0);
+  ck_assert_int_eq(dev->txn_state, TP_TXN_OPEN);
+  ck_assert_int_eq(tp_swg_trans_abort(dev), 0);
+  ck_assert_int_eq(dev->txn_state, TP_TXN_NONE);
+  ck_assert_int_eq(get_read_locked(dev), 0);
+  
+  /* kept */
+  ck_assert_int_eq(tp_swg_trans_start(dev), 0);
+  ck_assert_int_eq(set_read_locked(dev, 1), 0);
+  ck_assert_int_eq(tp_swg_trans_commit(dev), 0);
+  ck_assert_int_eq(get_read_locked(dev), 1);
+  
+  /* empty transaction never reaches TPer */
+  ck_assert_int_eq(tp_swg_trans_start(dev), 0);
+  ck_assert_int_eq(tp_swg_trans_commit(dev), 0);
+  ck_assert_int_eq(dev->txn_state, TP_TXN_NONE);
+  
+  ck_assert_int_eq(tp_swg_session_end(dev), 0);
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_pool)
+{
+  tp_handle_t *dev = emu_open();
+  tp_buffer_t args;
+  char raw[32];
+  uint32_t tsn;
+  
+  /* released session is reused */
+  ck_assert_int_eq(tp_swg_pool_acquire(dev, TP_SWG_SP_LOCKING, TP_SWG_ADMIN1,
+				       TP_EMU_MSID, strlen(TP_EMU_MSID),
+				       1), 0);
+  tsn = dev->tper_session_id;
+  ck_assert_int_eq(tp_swg_pool_release(dev), 0);
+  ck_assert_int_eq(tp_swg_pool_acquire(dev, TP_SWG_SP_LOCKING, TP_SWG_ADMIN1,
+				       TP_EMU_MSID, strlen(TP_EMU_MSID),
+				       1), 0);
+  ck_assert_int_eq(dev->tper_session_id, tsn);
+  ck_assert_int_eq(tp_swg_pool_release(dev), 0);
+  
+  /* different credentials get a session of their own */
+  ck_assert_int_eq(tp_swg_pool_acquire(dev, TP_SWG_SP_ADMIN, 0, NULL, 0, 0),
+		   0);
+  ck_assert_int_ne(dev->tper_session_id, tsn);
+  ck_assert_int_eq(tp_swg_pool_release(dev), 0);
+  
+  /* TPer times out idle session, reopened behind our back */
+  ck_assert_int_eq(tp_emu_set_property(dev->emu, "DefSessionTimeout", 20), 0);
+  usleep(40000);
+  ck_assert_int_eq(tp_swg_pool_acquire(dev, TP_SWG_SP_LOCKING, TP_SWG_ADMIN1,
+				       TP_EMU_MSID, strlen(TP_EMU_MSID),
+				       1), 0);
+  enc_get(&args, raw, sizeof(raw), 7);
+  ck_assert_int_eq(tp_swg_pool_invoke(dev, NULL, TP_SWG_LOCKING_GLOBAL,
+				      TP_SWG_GET, &args), 0);
+  ck_assert_int_ne(dev->tper_session_id, tsn);
+  ck_assert_int_eq(tp_swg_pool_flush(dev), 0);
+  
+  tp_close(dev);
+}
+END_TEST
+
+START_TEST(t_emu_replay)
+{
+  char path[] = "/tmp/topaz_trace_XXXXXX";
+  char replay[64];
+  tp_handle_t *dev;
+  int fd;
+  
+  /* first traced drive in process records to the path as given */
+  fd = mkstemp(path);
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+  tp_trace_record = path;
+  dev = emu_open();
+  tp_trace_record = NULL;
+  
+  /* slow responses, too large for one block, so polls come back empty
+   * and then ask for more */
+  ck_assert_int_eq(tp_emu_set_property(dev->emu, "MaxMethods", 16), 0);
+  ck_assert_int_eq(tp_swg_do_properties(dev), 0);
+  ck_assert_int_eq(tp_emu_set_latency(dev->emu, TP_SWG_GET, 3000000), 0);
+  run_get_batch(dev, 16);
+  tp_close(dev);
+  
+  /* same traffic again, played back */
+  snprintf(replay, sizeof(replay), "%s%s", TP_TRACE_REPLAY_PREFIX, path);
+  dev = tp_open(replay);
+  ck_assert_msg(dev != NULL, "Failed to open trace (%s)",
+		tp_errno_lookup_cur());
+  ck_assert_int_eq(tp_swg_do_properties(dev), 0);
+  run_get_batch(dev, 16);
+  tp_close(dev);
+  
+  unlink(path);
+}
+END_TEST
+
 /* Unit Test Automation */
 
 Suite *cc_suite(void)
@@ -205,6 +473,17 @@ Suite *cc_suite(void)
   tcase_add_test(tc_syn, t_syn_bin);
   suite_add_tcase(s, tc_syn);
   
+  /* SWG Stack (Emulated TPer) */
+  TCase *tc_emu = tcase_create("Emulated TPer");
+  tcase_add_test(tc_emu, t_emu_session);
+  tcase_add_test(tc_emu, t_emu_props);
+  tcase_add_test(tc_emu, t_emu_call);
+  tcase_add_test(tc_emu, t_emu_batch);
+  tcase_add_test(tc_emu, t_emu_trans);
+  tcase_add_test(tc_emu, t_emu_pool);
+  tcase_add_test(tc_emu, t_emu_replay);
+  suite_add_tcase(s, tc_emu);
+  
   return s;
 }
 
@@ -378,3 +657,113 @@ int run_bin(size_t bin_size, size_t enc_size)
   
   return 0;
 }
+
+tp_handle_t *emu_open(void)
+{
+  tp_handle_t *dev = tp_open(TP_EMU_PREFIX);
+  
+  ck_assert_msg(dev != NULL, "Failed to open emulated TPer (%s)",
+		tp_errno_lookup_cur());
+  return dev;
+}
+
+void enc_get(tp_buffer_t *args, void *raw, size_t len, uint64_t col)
+{
+  /* own buffer, or encoding in place */
+  if (raw != NULL)
+  {
+    memset(args, 0, sizeof(*args));
+    args->ptr = raw;
+    args->max_len = len;
+  }
+  
+  /* Get of a single column */
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_START_LIST), 0);
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_START_NAME), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(args, 3), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(args, col), 0);
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_END_NAME), 0);
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_START_NAME), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(args, 4), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(args, col), 0);
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_END_NAME), 0);
+  ck_assert_int_eq(tp_buf_add_byte(args, TP_SWG_END_LIST), 0);
+}
+
+void check_msid(tp_buffer_t *ret)
+{
+  tp_buffer_t pin;
+  uint64_t col;
+  
+  /* raw Get returns the row, get_by_num just the value */
+  if (((uint8_t*)ret->ptr)[ret->parse_idx] == TP_SWG_START_LIST)
+  {
+    ck_assert_int_eq(tp_syn_dec_byte(ret, TP_SWG_START_LIST), 0);
+    ck_assert_int_eq(tp_syn_dec_byte(ret, TP_SWG_START_NAME), 0);
+    ck_assert_int_eq(tp_syn_dec_uint(&col, ret), 0);
+    ck_assert_int_eq(col, 3);
+  }
+  ck_assert_int_eq(tp_syn_dec_bin(&pin, ret), 0);
+  ck_assert_int_eq(pin.cur_len, strlen(TP_EMU_MSID));
+  ck_assert_int_eq(memcmp(pin.ptr, TP_EMU_MSID, pin.cur_len), 0);
+}
+
+uint64_t get_read_locked(tp_handle_t *dev)
+{
+  tp_buffer_t ret;
+  uint64_t value;
+  
+  ck_assert_int_eq(tp_swg_get_by_num(&ret, dev, TP_SWG_LOCKING_GLOBAL, 7), 0);
+  ck_assert_int_eq(tp_syn_dec_uint(&value, &ret), 0);
+  return value;
+}
+
+tp_errno_t set_read_locked(tp_handle_t *dev, uint64_t value)
+{
+  tp_buffer_t args;
+  
+  /* Set of ReadLocked column, encoded in place */
+  ck_assert_int_eq(tp_swg_call_begin(dev, &args, TP_SWG_LOCKING_GLOBAL,
+				     TP_SWG_SET), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_START_NAME), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(&args, 1), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_START_LIST), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_START_NAME), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(&args, 7), 0);
+  ck_assert_int_eq(tp_syn_enc_uint(&args, value), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_END_NAME), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_END_LIST), 0);
+  ck_assert_int_eq(tp_buf_add_byte(&args, TP_SWG_END_NAME), 0);
+  return tp_swg_call_commit(dev, NULL, &args, 0);
+}
+
+void run_get_batch(tp_handle_t *dev, unsigned int count)
+{
+  tp_swg_batch_t batch[16];
+  tp_buffer_t args[16];
+  char raw[16][32];
+  unsigned int i, sent;
+  
+  ck_assert_uint_le(count, 16);
+  ck_assert_int_eq(tp_swg_session_start(dev, TP_SWG_SP_ADMIN), 0);
+  
+  /* Get of the MSID PIN, over and over */
+  memset(batch, 0, sizeof(batch));
+  for (i = 0; i < count; i++)
+  {
+    enc_get(&args[i], raw[i], sizeof(raw[i]), 3);
+    batch[i].obj_uid = TP_SWG_C_PIN_MSID;
+    batch[i].method_uid = TP_SWG_GET;
+    batch[i].args = &args[i];
+  }
+  
+  ck_assert_int_eq(tp_swg_invoke_batch(dev, batch, count, &sent), 0);
+  ck_assert_int_eq(sent, count);
+  for (i = 0; i < sent; i++)
+  {
+    ck_assert_int_eq(batch[i].status, 0);
+    check_msid(&batch[i].result);
+  }
+  
+  ck_assert_int_eq(tp_swg_session_end(dev), 0);
+}
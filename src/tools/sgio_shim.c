@@ -0,0 +1,757 @@
+/*
+ * Topaz - SG_IO Shim
+ *
+ * LD_PRELOAD library which stands an emulated TPer in for an ATA drive,
+ * so the real ATA pass through transport (CDB building, sense checking,
+ * queued commands and poll loops) can be exercised and timed without
+ * hardware. Intercepts open() of a fake device node and of the libata
+ * allow_tpm setting, and answers SG_IO requests against it. A second fake
+ * node answers NVMe admin commands from the same TPer, and both take the
+ * kernel sed-opal ioctls, which are recorded for shim_test to check.
+ *
+ *   LD_PRELOAD=libtopaz_shim.so TOPAZ_SHIM_SERVICE_NS=200000 bench /dev/tpshim
+ *
+ * Environment:
+ *   TOPAZ_SHIM_DEVICE      Fake device path (default /dev/tpshim)
+ *   TOPAZ_SHIM_NVME_DEVICE Fake NVMe device path (default /dev/tpshim-nvme)
+ *   TOPAZ_SHIM_SERVICE_NS  Service time of every ATA command
+ *   TOPAZ_SHIM_METHOD_NS   Time the TPer takes to answer each method
+ *   TOPAZ_SHIM_FAULT_EVERY Fail every Nth ATA command with UNIT ATTENTION
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+#include <linux/nvme_ioctl.h>
+#include <linux/sed-opal.h>
+#include <topaz/emu.h>
+#include <topaz/trace.h>
+#include <topaz/uid_swg.h>
+
+/** Default fake device node */
+#define SHIM_DEVICE "/dev/tpshim"
+
+/** Default fake NVMe device node */
+#define SHIM_NVME_DEVICE "/dev/tpshim-nvme"
+
+/** NVMe Identify data size */
+#define SHIM_IDENTIFY_SIZE 4096
+
+/** Highest descriptor tracked */
+#define SHIM_MAX_FD 1024
+
+/** Requests held for read() per descriptor (as sg) */
+#define SHIM_QUEUE_DEPTH 16
+
+/** ATA block size */
+#define SHIM_BLOCK_SIZE 512
+
+/** Completed request waiting for read() */
+typedef struct
+{
+  struct sg_io_hdr hdr; /** Header as written, with results filled in */
+  uint64_t ready;       /** Time it may be collected */
+} shim_req_t;
+
+/** Fake descriptor */
+typedef struct
+{
+  int nvme;                             /** NVMe rather than ATA device */
+  int nonblock;                         /** Opened O_NONBLOCK */
+  shim_req_t queue[SHIM_QUEUE_DEPTH];   /** Requests in flight */
+  unsigned head;                        /** Oldest request */
+  unsigned count;                       /** Requests in flight */
+} shim_fd_t;
+
+/* Underlying C library calls */
+static int (*real_open)(char const *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, void const *, size_t);
+
+/* Shared state */
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static shim_fd_t *shim_fds[SHIM_MAX_FD];
+static struct tp_emu *shim_emu;
+static char const *shim_device = SHIM_DEVICE;
+static char const *shim_nvme_device = SHIM_NVME_DEVICE;
+static uint64_t shim_service_ns;
+static unsigned long shim_fault_every;
+static unsigned long shim_commands;
+static struct opal_lock_unlock shim_opal_save;
+static struct opal_lock_unlock shim_opal_lock;
+static unsigned long shim_opal_count;
+
+/**
+ * \brief Wait Until
+ *
+ * \param[in] when Time to wait for
+ */
+static void shim_sleep_until(uint64_t when)
+{
+  struct timespec ts;
+  
+  ts.tv_sec = when / 1000000000;
+  ts.tv_nsec = when % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/**
+ * \brief One Time Setup
+ *
+ * Find the real calls, read configuration, and manufacture a TPer
+ */
+static void shim_init(void)
+{
+  char const *env;
+  
+  real_open = dlsym(RTLD_NEXT, "open");
+  real_close = dlsym(RTLD_NEXT, "close");
+  real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+  real_read = dlsym(RTLD_NEXT, "read");
+  real_write = dlsym(RTLD_NEXT, "write");
+  
+  if ((env = getenv("TOPAZ_SHIM_DEVICE")) != NULL)
+  {
+    shim_device = env;
+  }
+  if ((env = getenv("TOPAZ_SHIM_NVME_DEVICE")) != NULL)
+  {
+    shim_nvme_device = env;
+  }
+  if ((env = getenv("TOPAZ_SHIM_SERVICE_NS")) != NULL)
+  {
+    shim_service_ns = strtoull(env, NULL, 0);
+  }
+  
+  if ((env = getenv("TOPAZ_SHIM_FAULT_EVERY")) != NULL)
+  {
+    shim_fault_every = strtoul(env, NULL, 0);
+  }
+  
+  if ((shim_emu = tp_emu_create()) == NULL)
+  {
+    fprintf(stderr, "topaz shim: cannot create emulated TPer\n");
+    abort();
+  }
+  if ((env = getenv("TOPAZ_SHIM_METHOD_NS")) != NULL)
+  {
+    tp_emu_set_latency(shim_emu, TP_SWG_NULL, strtoull(env, NULL, 0));
+  }
+}
+
+/**
+ * \brief Look Up Fake Descriptor
+ *
+ * \param[in] fd Descriptor
+ * \return Fake descriptor state, or NULL if a real one
+ */
+static shim_fd_t *shim_lookup(int fd)
+{
+  pthread_once(&shim_once, shim_init);
+  return ((fd >= 0) && (fd < SHIM_MAX_FD) ? shim_fds[fd] : NULL);
+}
+
+/**
+ * \brief Check for Fake Path
+ *
+ * The device node itself, or (as sg queueing reopens it) its
+ * /proc/self/fd entry.
+ *
+ * \param[in] path Path given to open()
+ * \param[out] nvme Set nonzero for the NVMe node
+ * \return Nonzero if open() should be faked
+ */
+static int shim_is_device(char const *path, int *nvme)
+{
+  shim_fd_t *state;
+  char *end;
+  long fd;
+  
+  *nvme = (strcmp(path, shim_nvme_device) == 0);
+  if ((*nvme) || (strcmp(path, shim_device) == 0))
+  {
+    return 1;
+  }
+  if (strncmp(path, "/proc/self/fd/", 14) == 0)
+  {
+    fd = strtol(path + 14, &end, 10);
+    if ((*end == '\0') && ((state = shim_lookup(fd)) != NULL))
+    {
+      *nvme = state->nvme;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * \brief Fill Sense Data
+ *
+ * Descriptor format sense, with ATA Status Return descriptor as a SAT
+ * layer gives when the check condition bit is set.
+ *
+ * \param[in,out] hdr Request
+ * \param[in] ok Command completed without error
+ */
+static void shim_sense(struct sg_io_hdr *hdr, int ok)
+{
+  unsigned char sense[22];
+  
+  memset(sense, 0, sizeof(sense));
+  sense[0] = 0x72;
+  sense[1] = (ok ? 0x01 : 0x0b); /* recovered error / aborted command */
+  sense[3] = (ok ? 0x1d : 0x00); /* ATA pass through information available */
+  sense[7] = 0x0e;
+  sense[8] = 0x09;
+  sense[9] = 0x0c;
+  sense[11] = (ok ? 0x00 : 0x04); /* error - abort */
+  sense[21] = (ok ? 0x50 : 0x51); /* status - ready (error) */
+  
+  hdr->status = 0x02; /* CHECK CONDITION */
+  hdr->masked_status = 0x01;
+  hdr->info |= SG_INFO_CHECK;
+  hdr->sb_len_wr = (hdr->mx_sb_len < sizeof(sense) ?
+		    hdr->mx_sb_len : sizeof(sense));
+  memcpy(hdr->sbp, sense, hdr->sb_len_wr);
+}
+
+/**
+ * \brief Inject Transient Fault
+ *
+ * Fixed format UNIT ATTENTION (power on / reset), as after a bus reset.
+ * The command never reaches the TPer.
+ *
+ * \param[in,out] hdr Request
+ */
+static void shim_fault(struct sg_io_hdr *hdr)
+{
+  unsigned char sense[18];
+  
+  memset(sense, 0, sizeof(sense));
+  sense[0] = 0x70;
+  sense[2] = 0x06;
+  sense[7] = 0x0a;
+  sense[12] = 0x29;
+  
+  hdr->status = 0x02; /* CHECK CONDITION */
+  hdr->masked_status = 0x01;
+  hdr->info |= SG_INFO_CHECK;
+  hdr->sb_len_wr = (hdr->mx_sb_len < sizeof(sense) ?
+		    hdr->mx_sb_len : sizeof(sense));
+  memcpy(hdr->sbp, sense, hdr->sb_len_wr);
+}
+
+/**
+ * \brief Answer INQUIRY
+ *
+ * Only the supported VPD page list is needed, and it names the ATA
+ * Information page so the SCSI probe steps aside for ATA pass through.
+ *
+ * \param[in,out] hdr Request
+ */
+static void shim_inquiry(struct sg_io_hdr *hdr)
+{
+  unsigned char pages[6] = { 0, 0, 0, 2, 0x00, 0x89 };
+  unsigned char *cdb = hdr->cmdp;
+  
+  if (((cdb[1] & 1) == 0) || (cdb[2] != 0x00))
+  {
+    shim_sense(hdr, 0);
+    return;
+  }
+  memset(hdr->dxferp, 0, hdr->dxfer_len);
+  memcpy(hdr->dxferp, pages,
+	 (hdr->dxfer_len < sizeof(pages) ? hdr->dxfer_len : sizeof(pages)));
+}
+
+/**
+ * \brief Answer ATA Pass Through
+ *
+ * \param[in,out] hdr Request
+ */
+static void shim_ata(struct sg_io_hdr *hdr)
+{
+  unsigned char *cdb = hdr->cmdp;
+  uint16_t id[256];
+  uint8_t command, feature, count, lba_low, lba_mid, lba_high;
+  size_t len;
+  int rc;
+  
+  /* pull out registers, ATA12 or ATA16 */
+  if (cdb[0] == 0xa1)
+  {
+    feature  = cdb[3];
+    count    = cdb[4];
+    lba_low  = cdb[5];
+    lba_mid  = cdb[6];
+    lba_high = cdb[7];
+    command  = cdb[9];
+  }
+  else
+  {
+    feature  = cdb[4];
+    count    = cdb[6];
+    lba_low  = cdb[8];
+    lba_mid  = cdb[10];
+    lba_high = cdb[12];
+    command  = cdb[14];
+  }
+  
+  /* Trusted Send / Receive size is in Count (7:0) and LBA Low (15:8) */
+  len = ((lba_low << 8) | count) * SHIM_BLOCK_SIZE;
+  
+  switch (command)
+  {
+    case 0xec: /* Identify - ACS, TPM present, DMA */
+      memset(id, 0, sizeof(id));
+      id[48] = 0x4001;
+      id[49] = 0x0300;
+      id[80] = 0x01f0;
+      memset(hdr->dxferp, 0, hdr->dxfer_len);
+      memcpy(hdr->dxferp, id,
+	     (hdr->dxfer_len < sizeof(id) ? hdr->dxfer_len : sizeof(id)));
+      rc = 0;
+      break;
+      
+    case 0x5c: /* Trusted Receive */
+    case 0x5d: /* Trusted Receive DMA */
+      rc = ((len > hdr->dxfer_len) ||
+	    (tp_emu_if_recv(shim_emu, feature, (lba_high << 8) | lba_mid,
+			    hdr->dxferp, len)));
+      break;
+      
+    case 0x5e: /* Trusted Send */
+    case 0x5f: /* Trusted Send DMA */
+      rc = ((len > hdr->dxfer_len) ||
+	    (tp_emu_if_send(shim_emu, feature, (lba_high << 8) | lba_mid,
+			    hdr->dxferp, len)));
+      break;
+      
+    default:
+      rc = 1;
+      break;
+  }
+  
+  /* check condition bit is set, so status comes back either way */
+  shim_sense(hdr, rc == 0);
+}
+
+/**
+ * \brief Answer NVMe Admin Command
+ *
+ * Identify Controller (Security Send / Receive in OACS), and Security
+ * Send / Receive against the emulated TPer.
+ *
+ * \param[in,out] admin Request
+ * \return NVMe status, 0 on success
+ */
+static int shim_nvme(struct nvme_admin_cmd *admin)
+{
+  uint8_t *data = (uint8_t*)(uintptr_t)admin->addr;
+  uint8_t proto = admin->cdw10 >> 24;
+  uint16_t comid = (admin->cdw10 >> 8) & 0xffff;
+  int rc;
+  
+  pthread_mutex_lock(&shim_lock);
+  switch (admin->opcode)
+  {
+    case 0x06: /* Identify - Controller */
+      if (((admin->cdw10 & 0xff) != 1) ||
+	  (admin->data_len < SHIM_IDENTIFY_SIZE))
+      {
+	rc = 0x02; /* Invalid Field in Command */
+	break;
+      }
+      memset(data, 0, SHIM_IDENTIFY_SIZE);
+      data[256] = 0x01;
+      rc = 0;
+      break;
+      
+    case 0x81: /* Security Send */
+      rc = ((admin->cdw11 > admin->data_len) ||
+	    (tp_emu_if_send(shim_emu, proto, comid, data, admin->cdw11)) ?
+	    0x02 : 0);
+      break;
+      
+    case 0x82: /* Security Receive */
+      rc = ((admin->cdw11 > admin->data_len) ||
+	    (tp_emu_if_recv(shim_emu, proto, comid, data, admin->cdw11)) ?
+	    0x02 : 0);
+      break;
+      
+    default:
+      rc = 0x01; /* Invalid Command Opcode */
+      break;
+  }
+  pthread_mutex_unlock(&shim_lock);
+  
+  return rc;
+}
+
+/**
+ * \brief Answer Kernel sed-opal Request
+ *
+ * Reports an Opal drive, and keeps the last key saved and the last
+ * lock / unlock request, as the kernel would be handed them.
+ *
+ * \param[in] request ioctl request code
+ * \param[in,out] arg Request
+ * \return 0 on success, -1 with errno set on failure
+ */
+static int shim_opal(unsigned long request, void *arg)
+{
+  struct opal_status *status = arg;
+  int rc = 0;
+  
+  pthread_mutex_lock(&shim_lock);
+  switch (request)
+  {
+    case IOC_OPAL_GET_STATUS:
+      memset(status, 0, sizeof(*status));
+      status->flags = OPAL_FL_SUPPORTED | OPAL_FL_LOCKING_SUPPORTED;
+      break;
+      
+    case IOC_OPAL_SAVE:
+      memcpy(&shim_opal_save, arg, sizeof(shim_opal_save));
+      shim_opal_count++;
+      break;
+      
+    case IOC_OPAL_LOCK_UNLOCK:
+      memcpy(&shim_opal_lock, arg, sizeof(shim_opal_lock));
+      shim_opal_count++;
+      break;
+      
+    default:
+      errno = ENOTTY;
+      rc = -1;
+      break;
+  }
+  pthread_mutex_unlock(&shim_lock);
+  
+  return rc;
+}
+
+/**
+ * \brief Last Kernel sed-opal Request
+ *
+ * For shim_test, which finds it with dlsym()
+ *
+ * \param[in] request IOC_OPAL_SAVE or IOC_OPAL_LOCK_UNLOCK
+ * \param[out] req Last request of that kind (zero if none)
+ * \return Count of lock requests (of either kind) seen so far
+ */
+unsigned long shim_opal_last(unsigned long request,
+			     struct opal_lock_unlock *req)
+{
+  pthread_mutex_lock(&shim_lock);
+  memcpy(req, (request == IOC_OPAL_SAVE ? &shim_opal_save : &shim_opal_lock),
+	 sizeof(*req));
+  pthread_mutex_unlock(&shim_lock);
+  
+  return shim_opal_count;
+}
+
+/**
+ * \brief Run Request
+ *
+ * \param[in,out] hdr Request
+ * \return 0 on success, -1 with errno set on failure
+ */
+static int shim_exec(struct sg_io_hdr *hdr)
+{
+  unsigned char *cdb = hdr->cmdp;
+  
+  if ((hdr->interface_id != 'S') || (cdb == NULL) || (hdr->cmd_len < 1))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  /* pretend the transfer all happened */
+  hdr->status = 0;
+  hdr->masked_status = 0;
+  hdr->host_status = 0;
+  hdr->driver_status = 0;
+  hdr->sb_len_wr = 0;
+  hdr->resid = 0;
+  hdr->info = SG_INFO_OK;
+  hdr->duration = shim_service_ns / 1000000;
+  
+  pthread_mutex_lock(&shim_lock);
+  if (cdb[0] == 0x12)
+  {
+    shim_inquiry(hdr);
+  }
+  else if (((cdb[0] == 0xa1) && (hdr->cmd_len >= 12)) ||
+	   ((cdb[0] == 0x85) && (hdr->cmd_len >= 16)))
+  {
+    if ((shim_fault_every) && ((++shim_commands % shim_fault_every) == 0))
+    {
+      shim_fault(hdr);
+    }
+    else
+    {
+      shim_ata(hdr);
+    }
+  }
+  else
+  {
+    shim_sense(hdr, 0);
+  }
+  pthread_mutex_unlock(&shim_lock);
+  
+  return 0;
+}
+
+/**
+ * \brief Intercepted open()
+ */
+int open(char const *path, int flags, ...)
+{
+  shim_fd_t *state;
+  mode_t mode = 0;
+  va_list ap;
+  int fd, nvme, pipe_fd[2];
+  
+  pthread_once(&shim_once, shim_init);
+  if (flags & (O_CREAT | O_TMPFILE))
+  {
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  
+  /* libata always allows TPM commands */
+  if (strcmp(path, "/sys/module/libata/parameters/allow_tpm") == 0)
+  {
+    if (pipe(pipe_fd) != 0)
+    {
+      return -1;
+    }
+    real_write(pipe_fd[1], "1\n", 2);
+    real_close(pipe_fd[1]);
+    return pipe_fd[0];
+  }
+  
+  if (!shim_is_device(path, &nvme))
+  {
+    return real_open(path, flags, mode);
+  }
+  
+  /* character node stands in, so fstat() looks like an sg device */
+  if ((state = calloc(1, sizeof(shim_fd_t))) == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+  state->nvme = nvme;
+  state->nonblock = ((flags & O_NONBLOCK) != 0);
+  if ((fd = real_open("/dev/null", O_RDWR)) == -1)
+  {
+    free(state);
+    return -1;
+  }
+  if (fd >= SHIM_MAX_FD)
+  {
+    real_close(fd);
+    free(state);
+    errno = EMFILE;
+    return -1;
+  }
+  shim_fds[fd] = state;
+  return fd;
+}
+
+/**
+ * \brief Intercepted open64()
+ */
+int open64(char const *path, int flags, ...)
+{
+  mode_t mode = 0;
+  va_list ap;
+  
+  if (flags & (O_CREAT | O_TMPFILE))
+  {
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  return open(path, flags, mode);
+}
+
+/**
+ * \brief Intercepted close()
+ */
+int close(int fd)
+{
+  shim_fd_t *state = shim_lookup(fd);
+  
+  if (state != NULL)
+  {
+    shim_fds[fd] = NULL;
+    free(state);
+  }
+  return real_close(fd);
+}
+
+/**
+ * \brief Intercepted ioctl()
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+  shim_fd_t *state = shim_lookup(fd);
+  uint64_t start = tp_trace_now();
+  va_list ap;
+  void *arg;
+  int rc;
+  
+  va_start(ap, request);
+  arg = va_arg(ap, void*);
+  va_end(ap);
+  
+  if (state == NULL)
+  {
+    return real_ioctl(fd, request, arg);
+  }
+  
+  /* kernel Opal support sits above either kind of device */
+  if (_IOC_TYPE(request) == 'p')
+  {
+    return shim_opal(request, arg);
+  }
+  
+  /* NVMe returns completion status */
+  if (state->nvme)
+  {
+    if (request != NVME_IOCTL_ADMIN_CMD)
+    {
+      errno = ENOTTY;
+      return -1;
+    }
+    rc = shim_nvme(arg);
+    shim_sleep_until(start + shim_service_ns);
+    return rc;
+  }
+  
+  /* only synchronous requests, no reserved buffer to map */
+  if (request != SG_IO)
+  {
+    errno = ENOTTY;
+    return -1;
+  }
+  if (shim_exec(arg) != 0)
+  {
+    return -1;
+  }
+  shim_sleep_until(start + shim_service_ns);
+  return 0;
+}
+
+/**
+ * \brief Intercepted write()
+ *
+ * Queues a request, as on an sg node
+ */
+ssize_t write(int fd, void const *buf, size_t count)
+{
+  shim_fd_t *state = shim_lookup(fd);
+  shim_req_t *req;
+  
+  if (state == NULL)
+  {
+    return real_write(fd, buf, count);
+  }
+  if (count < sizeof(struct sg_io_hdr))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  if (state->count == SHIM_QUEUE_DEPTH)
+  {
+    errno = EDOM;
+    return -1;
+  }
+  
+  /* run it now, collectable once service time has passed */
+  req = state->queue + (state->head + state->count) % SHIM_QUEUE_DEPTH;
+  memcpy(&req->hdr, buf, sizeof(struct sg_io_hdr));
+  req->ready = tp_trace_now() + shim_service_ns;
+  if (shim_exec(&req->hdr) != 0)
+  {
+    return -1;
+  }
+  state->count++;
+  return count;
+}
+
+/**
+ * \brief Intercepted read()
+ *
+ * Collects oldest queued request, as on an sg node
+ */
+ssize_t read(int fd, void *buf, size_t count)
+{
+  shim_fd_t *state = shim_lookup(fd);
+  shim_req_t *req;
+  
+  if (state == NULL)
+  {
+    return real_read(fd, buf, count);
+  }
+  if (count < sizeof(struct sg_io_hdr))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  /* nothing ready yet? */
+  req = state->queue + state->head;
+  if ((state->count == 0) ||
+      ((state->nonblock) && (tp_trace_now() < req->ready)))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  shim_sleep_until(req->ready);
+  
+  memcpy(buf, &req->hdr, sizeof(struct sg_io_hdr));
+  state->head = (state->head + 1) % SHIM_QUEUE_DEPTH;
+  state->count--;
+  return sizeof(struct sg_io_hdr);
+}
@@ -0,0 +1,169 @@
+/*
+ * Topaz - Shim Test
+ *
+ * Runs the NVMe transport and the kernel sed-opal backend against the
+ * fake devices of the SG_IO shim, checking what reaches each ioctl.
+ *
+ *   LD_PRELOAD=libtopaz_shim.so shim_test
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sed-opal.h>
+#include <topaz/emu.h>
+#include <topaz/errno.h>
+#include <topaz/topaz.h>
+#include <topaz/syntax.h>
+#include <topaz/buffer.h>
+#include <topaz/sed_opal.h>
+#include <topaz/uid_swg.h>
+#include <topaz/swg_core.h>
+
+/* Helper macro for tests */
+#define CHECKME(x) if (x)                               \
+{                                                       \
+  printf("FAIL(%s) - %s\n", #x, tp_errno_lookup_cur()); \
+  return 1;                                             \
+}
+
+/** Fake NVMe device of shim */
+#define NVME_DEVICE "/dev/tpshim-nvme"
+
+/** Shim's record of sed-opal requests */
+typedef unsigned long (*opal_last_t)(unsigned long, struct opal_lock_unlock *);
+
+/**
+ * \brief Test NVMe Transport
+ *
+ * \param[in] path Fake NVMe device
+ * \return 0 on success, 1 on failure
+ */
+static int test_nvme(char const *path)
+{
+  tp_handle_t *handle;
+  tp_buffer_t ret, pin;
+
+  printf("NVMe transport .. ");
+  CHECKME((handle = tp_open(path)) == NULL);
+  CHECKME(handle->trans_type != TP_TRANS_NVME);
+  CHECKME(tp_swg_session_start(handle, TP_SWG_SP_ADMIN));
+  CHECKME(tp_swg_get_by_num(&ret, handle, TP_SWG_C_PIN_MSID, 3));
+  CHECKME(tp_syn_dec_bin(&pin, &ret));
+  CHECKME(pin.cur_len != strlen(TP_EMU_MSID));
+  CHECKME(memcmp(pin.ptr, TP_EMU_MSID, pin.cur_len));
+  CHECKME(tp_swg_session_end(handle));
+  CHECKME(tp_close(handle));
+  printf("OK\n");
+
+  return 0;
+}
+
+/**
+ * \brief Check Kernel Lock / Unlock Request
+ *
+ * \param[in] req Request as seen by shim
+ * \param[in] key Credentials it should carry
+ * \param[in] state State it should carry
+ * \return 0 on match, 1 on mismatch
+ */
+static int check_req(struct opal_lock_unlock const *req,
+		     tp_sed_key_t const *key, tp_sed_lock_state_t state)
+{
+  return ((req->session.who != key->user) ||
+	  (req->session.opal_key.lr != key->range) ||
+	  (req->session.sum != (key->sum != 0)) ||
+	  (req->session.opal_key.key_len != key->key_len) ||
+	  (memcmp(req->session.opal_key.key, key->key, key->key_len)) ||
+	  (req->l_state != state));
+}
+
+/**
+ * \brief Test Kernel sed-opal Backend
+ *
+ * \param[in] path Fake block device
+ * \return 0 on success, 1 on failure
+ */
+static int test_sed(char const *path)
+{
+  struct tp_sed_handle *handle;
+  struct opal_lock_unlock req;
+  opal_last_t opal_last;
+  tp_sed_key_t key;
+  unsigned long count;
+  uint32_t flags;
+
+  printf("Kernel sed-opal .. ");
+  CHECKME((opal_last = (opal_last_t)dlsym(RTLD_DEFAULT,
+					  "shim_opal_last")) == NULL);
+  CHECKME((handle = tp_sed_open(path)) == NULL);
+  CHECKME(tp_sed_get_status(handle, &flags));
+  CHECKME((flags & OPAL_FL_SUPPORTED) == 0);
+
+  /* User1, range 2 */
+  memset(&key, 0, sizeof(key));
+  key.user = 1;
+  key.range = 2;
+  key.key_len = strlen(TP_EMU_MSID);
+  memcpy(key.key, TP_EMU_MSID, key.key_len);
+
+  /* saved for resume */
+  CHECKME(tp_sed_save(handle, &key, TP_SED_LOCK_RW));
+  count = opal_last(IOC_OPAL_SAVE, &req);
+  CHECKME(check_req(&req, &key, TP_SED_LOCK_RW));
+
+  /* locked now, single user mode */
+  key.sum = 1;
+  CHECKME(tp_sed_lock_unlock(handle, &key, TP_SED_LOCK_LK));
+  CHECKME(opal_last(IOC_OPAL_LOCK_UNLOCK, &req) != count + 1);
+  CHECKME(check_req(&req, &key, TP_SED_LOCK_LK));
+
+  /* out of kernel bounds, never reaches it */
+  key.range = OPAL_MAX_LRS;
+  CHECKME(tp_sed_lock_unlock(handle, &key, TP_SED_LOCK_RW) != TP_ERR_INVALID);
+  CHECKME(opal_last(IOC_OPAL_LOCK_UNLOCK, &req) != count + 1);
+
+  CHECKME(tp_sed_close(handle));
+  printf("OK\n");
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char const *path = (argc > 1 ? argv[1] : NVME_DEVICE);
+
+  if ((test_nvme(path)) || (test_sed(path)))
+  {
+    return 1;
+  }
+
+  printf("  Completed\n");
+  return 0;
+}
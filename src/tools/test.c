@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <topaz/debug.h>
+#include <topaz/emu.h>
 #include <topaz/errno.h>
 #include <topaz/topaz.h>
 #include <topaz/syntax.h>
@@ -8,7 +9,7 @@
 #include <topaz/uid_swg.h>
 #include <topaz/swg_core.h>
 
-int main()
+int main(int argc, char *argv[])
 {
   tp_handle_t *handle = NULL;
   char raw[512] = {0};
@@ -18,7 +19,9 @@ int main()
   buf.max_len = sizeof(raw);
   
   tp_debug = 3;
-  handle = tp_open("/dev/sdc");
+  
+  /* no drive given, talk to an emulated one */
+  handle = tp_open(argc > 1 ? argv[1] : TP_EMU_PREFIX);
   if (!handle)
   {
     printf("Failure reported: %s\n", tp_errno_lookup_cur());
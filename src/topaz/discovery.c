@@ -36,6 +36,7 @@
 #include <topaz/debug.h>
 #include <topaz/discovery.h>
 #include <topaz/features.h>
+#include <topaz/transport.h>
 #include <topaz/transport_ata.h>
 
 /**
@@ -57,7 +58,7 @@ tp_errno_t tp_probe_discovery(tp_handle_t *handle)
   
   /* Level0 Discovery over IF-RECV */
   TP_DEBUG(1) printf("Establish Level 0 Comms - Discovery\n");
-  if (tp_ata_if_recv(handle->ata, 1, 1, data, 1) != 0)
+  if (tp_if_recv(handle, 1, 1, data, sizeof(data)) != 0)
   {
     return tp_errno;
   }
@@ -97,6 +98,7 @@ tp_errno_t tp_probe_discovery(tp_handle_t *handle)
 		       feat->version >> 4, feat->length);
     if (code == TP_FEAT_TPER)
     {
+      handle->has_comid_mgmt = 0x01 & (data[offset] >> 6);
       TP_DEBUG(2)
       {
 	printf("Trusted Peripheral (TPer)\n");
@@ -235,6 +237,8 @@ tp_errno_t tp_discovery_ssc1(tp_handle_t *handle, void const *feat_data)
 {
   tp_feat_ssc1_t *ssc = (tp_feat_ssc1_t*)feat_data;
   handle->com_id = be16toh(ssc->comid_base);
+  handle->comid_base = handle->com_id;
+  handle->comid_count = be16toh(ssc->comid_count);
   TP_DEBUG(2)
   {
     printf("    Base ComID: %u\n",            handle->com_id);
@@ -255,6 +259,8 @@ tp_errno_t tp_discovery_ssc2(tp_handle_t *handle, void const *feat_data)
 {
   tp_feat_ssc2_t *ssc = (tp_feat_ssc2_t*)feat_data;
   handle->com_id = be16toh(ssc->comid_base);
+  handle->comid_base = handle->com_id;
+  handle->comid_count = be16toh(ssc->comid_count);
   int admin_count = be16toh(ssc->admin_count);
   int user_count = be16toh(ssc->user_count);
   TP_DEBUG(2)
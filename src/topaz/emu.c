@@ -0,0 +1,1678 @@
+/*
+ * Topaz - TPer Emulator
+ *
+ * This file implements a software Trusted Peripheral (TPer), answering
+ * IF-SEND / IF-RECV in process so the SWG stack can be exercised without
+ * a self encrypting drive attached.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <topaz/debug.h>
+#include <topaz/emu.h>
+#include <topaz/features.h>
+#include <topaz/security.h>
+#include <topaz/swg_core.h>
+#include <topaz/syntax.h>
+#include <topaz/trace.h>
+#include <topaz/uid_swg.h>
+
+/** Most table cells modelled */
+#define TP_EMU_MAX_CELLS 32
+
+/** Largest encoded cell value */
+#define TP_EMU_MAX_ATOM 64
+
+/** Most methods with their own latency */
+#define TP_EMU_MAX_LATENCY 16
+
+/** Most TPer properties */
+#define TP_EMU_MAX_PROPS 24
+
+/** Room kept back in response for method status */
+#define TP_EMU_STATUS_ROOM 16
+
+/* ComID slots, static then dynamic */
+#define TP_EMU_COMID_SLOTS (TP_EMU_COMID_COUNT + TP_EMU_DYN_COMID_COUNT)
+
+/** Method status codes */
+enum
+{
+  TP_EMU_SUCCESS           = 0x00,
+  TP_EMU_NOT_AUTHORIZED    = 0x01,
+  TP_EMU_NO_SESSIONS       = 0x07,
+  TP_EMU_INVALID_PARAMETER = 0x0c,
+  TP_EMU_RESPONSE_OVERFLOW = 0x11
+};
+
+/** One column of one object */
+typedef struct
+{
+  uint64_t sp;     /** SP holding object */
+  uint64_t obj;    /** Object UID */
+  uint64_t col;    /** Column number */
+  uint64_t reader; /** Authority allowed to Get (or TP_SWG_NULL) */
+  uint64_t writer; /** Authority allowed to Set (or TP_SWG_NULL) */
+  size_t len;      /** Length of encoded value */
+  uint8_t atom[TP_EMU_MAX_ATOM]; /** Encoded value */
+} tp_emu_cell_t;
+
+/** Authority, and where its credentials live */
+typedef struct
+{
+  uint64_t sp;   /** SP of authority */
+  uint64_t auth; /** Authority UID */
+  uint64_t pin;  /** C_PIN object holding password */
+} tp_emu_auth_t;
+
+/** Open session */
+typedef struct
+{
+  int active;     /** Slot in use */
+  uint16_t comid; /** ComID session was opened on */
+  uint32_t tsn;   /** TPer session number */
+  uint32_t hsn;   /** Host session number */
+  uint64_t sp;    /** SP session is attached to */
+  uint64_t auth;  /** Authority session was opened with */
+  int write;      /** Read / write session */
+  uint64_t last;  /** Time of last packet on session */
+} tp_emu_session_t;
+
+/** ComID state */
+typedef struct
+{
+  uint8_t *resp;     /** Pending response ComPacket */
+  size_t resp_len;   /** Size of pending response, or zero */
+  size_t resp_sent;  /** Response data already collected by host */
+  uint64_t ready;    /** Time response may be collected */
+  int reset_pending; /** Protocol 2 response to collect */
+  uint32_t req_code; /** Protocol 2 request being answered */
+  int issued;        /** Valid for SWG traffic (static, or via GET_COMID) */
+} tp_emu_comid_t;
+
+/** Per method latency */
+typedef struct
+{
+  uint64_t method; /** Method UID */
+  uint64_t ns;     /** Time to answer */
+} tp_emu_latency_t;
+
+/** TPer communication property */
+typedef struct
+{
+  char name[32];  /** Property name */
+  uint64_t value; /** Property value */
+} tp_emu_prop_t;
+
+/** Emulated TPer */
+struct tp_emu
+{
+  tp_emu_cell_t cells[TP_EMU_MAX_CELLS];
+  unsigned cell_count;
+  tp_emu_session_t sessions[TP_EMU_MAX_SESSIONS];
+  uint32_t next_tsn;
+  tp_emu_comid_t comids[TP_EMU_COMID_SLOTS];
+  size_t resp_size;
+  tp_emu_latency_t latency[TP_EMU_MAX_LATENCY];
+  unsigned latency_count;
+  uint64_t default_latency;
+  tp_emu_prop_t props[TP_EMU_MAX_PROPS];
+  unsigned prop_count;
+  tp_emu_session_t *txn; /** Session with transaction open, or NULL */
+  tp_emu_cell_t txn_cells[TP_EMU_MAX_CELLS]; /** Table as of transaction start */
+  unsigned txn_cell_count;
+};
+
+/** Authorities which may open sessions */
+static const tp_emu_auth_t tp_emu_auths[] =
+{
+  { TP_SWG_SP_ADMIN,   TP_SWG_SID,    TP_SWG_C_PIN_SID },
+  { TP_SWG_SP_LOCKING, TP_SWG_ADMIN1, TP_SWG_C_PIN_ADMIN1 },
+};
+
+/**
+ * \brief Set Up Buffer
+ *
+ * \param[out] buf Buffer to initialize
+ * \param[in] ptr Backing memory
+ * \param[in] len Size of backing memory
+ */
+static void tp_emu_buf(tp_buffer_t *buf, void *ptr, size_t len)
+{
+  memset(buf, 0, sizeof(*buf));
+  buf->ptr = ptr;
+  buf->max_len = len;
+}
+
+/**
+ * \brief Add Table Cell
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sp SP holding object
+ * \param[in] obj Object UID
+ * \param[in] col Column number
+ * \param[in] reader Authority allowed to Get
+ * \param[in] writer Authority allowed to Set
+ * \return Pointer to new cell, with empty value
+ */
+static tp_emu_cell_t *tp_emu_add_cell(struct tp_emu *emu, uint64_t sp,
+				      uint64_t obj, uint64_t col,
+				      uint64_t reader, uint64_t writer)
+{
+  tp_emu_cell_t *cell = emu->cells + emu->cell_count++;
+  
+  cell->sp = sp;
+  cell->obj = obj;
+  cell->col = col;
+  cell->reader = reader;
+  cell->writer = writer;
+  return cell;
+}
+
+/**
+ * \brief Add Integer Cell
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sp SP holding object
+ * \param[in] obj Object UID
+ * \param[in] col Column number
+ * \param[in] reader Authority allowed to Get
+ * \param[in] writer Authority allowed to Set
+ * \param[in] value Initial value
+ */
+static void tp_emu_add_uint(struct tp_emu *emu, uint64_t sp, uint64_t obj,
+			    uint64_t col, uint64_t reader, uint64_t writer,
+			    uint64_t value)
+{
+  tp_emu_cell_t *cell = tp_emu_add_cell(emu, sp, obj, col, reader, writer);
+  tp_buffer_t buf;
+  
+  tp_emu_buf(&buf, cell->atom, sizeof(cell->atom));
+  tp_syn_enc_uint(&buf, value);
+  cell->len = buf.cur_len;
+}
+
+/**
+ * \brief Add Binary Cell
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sp SP holding object
+ * \param[in] obj Object UID
+ * \param[in] col Column number
+ * \param[in] reader Authority allowed to Get
+ * \param[in] writer Authority allowed to Set
+ * \param[in] value Initial value (string)
+ */
+static void tp_emu_add_str(struct tp_emu *emu, uint64_t sp, uint64_t obj,
+			   uint64_t col, uint64_t reader, uint64_t writer,
+			   char const *value)
+{
+  tp_emu_cell_t *cell = tp_emu_add_cell(emu, sp, obj, col, reader, writer);
+  tp_buffer_t buf;
+  
+  tp_emu_buf(&buf, cell->atom, sizeof(cell->atom));
+  tp_syn_enc_str(&buf, value);
+  cell->len = buf.cur_len;
+}
+
+/**
+ * \brief Find Table Cell
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] sp SP holding object
+ * \param[in] obj Object UID
+ * \param[in] col Column number
+ * \return Pointer to cell, or NULL if not modelled
+ */
+static tp_emu_cell_t *tp_emu_find_cell(struct tp_emu *emu, uint64_t sp,
+				       uint64_t obj, uint64_t col)
+{
+  unsigned i;
+  
+  for (i = 0; i < emu->cell_count; i++)
+  {
+    if ((emu->cells[i].sp == sp) && (emu->cells[i].obj == obj) &&
+	(emu->cells[i].col == col))
+    {
+      return emu->cells + i;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * \brief Read Integer Cell
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] sp SP holding object
+ * \param[in] obj Object UID
+ * \param[in] col Column number
+ * \return Value of cell, or zero if not an integer
+ */
+static uint64_t tp_emu_cell_uint(struct tp_emu *emu, uint64_t sp,
+				 uint64_t obj, uint64_t col)
+{
+  tp_emu_cell_t *cell = tp_emu_find_cell(emu, sp, obj, col);
+  uint64_t value = 0;
+  tp_buffer_t buf;
+  
+  if (cell != NULL)
+  {
+    tp_emu_buf(&buf, cell->atom, sizeof(cell->atom));
+    buf.cur_len = cell->len;
+    tp_syn_dec_uint(&value, &buf);
+  }
+  return value;
+}
+
+/**
+ * \brief Check Access
+ *
+ * \param[in] allowed Authority granted access
+ * \param[in] sess Session asking
+ * \return Nonzero if session has access
+ */
+static int tp_emu_allowed(uint64_t allowed, tp_emu_session_t const *sess)
+{
+  return ((allowed == TP_SWG_ANYBODY) ||
+	  ((allowed != TP_SWG_NULL) && (allowed == sess->auth)));
+}
+
+/**
+ * \brief Skip Value
+ *
+ * Step over next atom, token, or complete list / named value in stream
+ *
+ * \param[in,out] buf Input data stream
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_skip(tp_buffer_t *buf)
+{
+  tp_syn_atom_info_t info;
+  uint8_t next, end;
+  
+  if (tp_buf_peek(&next, buf))
+  {
+    return tp_errno;
+  }
+  
+  /* sequences, skip through to matching end */
+  if ((next == TP_SWG_START_LIST) || (next == TP_SWG_START_NAME))
+  {
+    end = (next == TP_SWG_START_LIST ? TP_SWG_END_LIST : TP_SWG_END_NAME);
+    buf->parse_idx++;
+    while (1)
+    {
+      if (tp_buf_peek(&next, buf))
+      {
+	return tp_errno;
+      }
+      if (next == end)
+      {
+	break;
+      }
+      if (tp_emu_skip(buf))
+      {
+	return tp_errno;
+      }
+    }
+    buf->parse_idx++;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* stray end of sequence */
+  if ((next == TP_SWG_END_LIST) || (next == TP_SWG_END_NAME))
+  {
+    return tp_errno = TP_ERR_SYNTAX;
+  }
+  
+  /* atoms */
+  if (tp_syn_dec_atom_header(&info, buf) == 0)
+  {
+    buf->parse_idx += info.header_bytes + info.data_bytes;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* anything else is a single byte token */
+  buf->parse_idx++;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Decode Named Value Header
+ *
+ * Step into a named value with an integer name, as used for Opal
+ * optional arguments and column numbers.
+ *
+ * \param[out] name Name of value
+ * \param[in,out] buf Input data stream
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_dec_name(uint64_t *name, tp_buffer_t *buf)
+{
+  if ((tp_syn_dec_byte(buf, TP_SWG_START_NAME)) ||
+      (tp_syn_dec_uint(name, buf)))
+  {
+    return tp_errno;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Find Session
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] comid Communication ID of packet
+ * \param[in] tsn TPer session number of packet
+ * \param[in] hsn Host session number of packet
+ * \return Pointer to session, or NULL if no such session
+ */
+static tp_emu_session_t *tp_emu_find_session(struct tp_emu *emu,
+					     uint16_t comid, uint32_t tsn,
+					     uint32_t hsn)
+{
+  unsigned i;
+  
+  for (i = 0; i < TP_EMU_MAX_SESSIONS; i++)
+  {
+    if ((emu->sessions[i].active) && (emu->sessions[i].comid == comid) &&
+	(emu->sessions[i].tsn == tsn) && (emu->sessions[i].hsn == hsn))
+    {
+      return emu->sessions + i;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * \brief Properties Method
+ *
+ * Report TPer properties, and echo back those proposed by host
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] args Encoded method arguments
+ * \param[out] out Response data
+ * \return Method status
+ */
+static uint8_t tp_emu_properties(struct tp_emu *emu, tp_buffer_t *args,
+				 tp_buffer_t *out)
+{
+  size_t host_start = 0, host_end = 0;
+  unsigned i;
+  
+  /* optional HostProperties is the only argument */
+  if (args->cur_len > 0)
+  {
+    host_start = args->parse_idx;
+    if (tp_emu_skip(args))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    host_end = args->parse_idx;
+  }
+  
+  /* our own properties */
+  if (tp_buf_add_byte(out, TP_SWG_START_LIST))
+  {
+    return TP_EMU_RESPONSE_OVERFLOW;
+  }
+  for (i = 0; i < emu->prop_count; i++)
+  {
+    if ((tp_buf_add_byte(out, TP_SWG_START_NAME)) ||
+	(tp_syn_enc_str(out, emu->props[i].name)) ||
+	(tp_syn_enc_uint(out, emu->props[i].value)) ||
+	(tp_buf_add_byte(out, TP_SWG_END_NAME)))
+    {
+      return TP_EMU_RESPONSE_OVERFLOW;
+    }
+  }
+  if ((tp_buf_add_byte(out, TP_SWG_END_LIST)) ||
+      
+      /* and whatever the host asked for, unchanged */
+      ((host_end > host_start) &&
+       (tp_buf_add(out, args->byte_ptr + host_start, host_end - host_start))))
+  {
+    return TP_EMU_RESPONSE_OVERFLOW;
+  }
+  
+  return TP_EMU_SUCCESS;
+}
+
+/**
+ * \brief StartSession Method
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] comid Communication ID of packet
+ * \param[in] args Encoded method arguments
+ * \param[out] out Response data
+ * \return Method status
+ */
+static uint8_t tp_emu_start_session(struct tp_emu *emu, uint16_t comid,
+				    tp_buffer_t *args, tp_buffer_t *out)
+{
+  uint64_t hsn, sp, write, name, auth = TP_SWG_ANYBODY;
+  tp_buffer_t challenge, pin;
+  tp_emu_session_t *sess = NULL;
+  tp_emu_cell_t *cell;
+  int have_challenge = 0;
+  unsigned i;
+  
+  /* required arguments */
+  if ((tp_syn_dec_uint(&hsn, args)) ||
+      (tp_syn_dec_uid(&sp, args)) ||
+      (tp_syn_dec_uint(&write, args)))
+  {
+    return TP_EMU_INVALID_PARAMETER;
+  }
+  
+  /* optional arguments */
+  while (args->parse_idx < args->cur_len)
+  {
+    if (tp_emu_dec_name(&name, args))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    if (name == 0) /* HostChallenge */
+    {
+      if (tp_syn_dec_bin(&challenge, args))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+      have_challenge = 1;
+    }
+    else if (name == 3) /* HostSigningAuthority */
+    {
+      if (tp_syn_dec_uid(&auth, args))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+    }
+    else if (tp_emu_skip(args))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    if (tp_syn_dec_byte(args, TP_SWG_END_NAME))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+  }
+  
+  /* only model a couple SPs */
+  if ((sp != TP_SWG_SP_ADMIN) && (sp != TP_SWG_SP_LOCKING))
+  {
+    return TP_EMU_INVALID_PARAMETER;
+  }
+  
+  /* check credentials */
+  if (auth != TP_SWG_ANYBODY)
+  {
+    for (i = 0; i < sizeof(tp_emu_auths) / sizeof(tp_emu_auths[0]); i++)
+    {
+      if ((tp_emu_auths[i].sp == sp) && (tp_emu_auths[i].auth == auth))
+      {
+	break;
+      }
+    }
+    if ((i == sizeof(tp_emu_auths) / sizeof(tp_emu_auths[0])) ||
+	(!have_challenge) ||
+	((cell = tp_emu_find_cell(emu, sp, tp_emu_auths[i].pin, 3)) == NULL))
+    {
+      return TP_EMU_NOT_AUTHORIZED;
+    }
+    tp_emu_buf(&pin, cell->atom, sizeof(cell->atom));
+    pin.cur_len = cell->len;
+    if ((tp_syn_dec_bin(&pin, &pin)) ||
+	(pin.cur_len != challenge.cur_len) ||
+	(memcmp(pin.ptr, challenge.ptr, pin.cur_len) != 0))
+    {
+      return TP_EMU_NOT_AUTHORIZED;
+    }
+  }
+  
+  /* find somewhere to put it */
+  for (i = 0; i < TP_EMU_MAX_SESSIONS; i++)
+  {
+    if (!emu->sessions[i].active)
+    {
+      sess = emu->sessions + i;
+      break;
+    }
+  }
+  if (sess == NULL)
+  {
+    return TP_EMU_NO_SESSIONS;
+  }
+  
+  /* SyncSession returns host and TPer session numbers */
+  if ((tp_syn_enc_uint(out, hsn)) ||
+      (tp_syn_enc_uint(out, emu->next_tsn)))
+  {
+    return TP_EMU_RESPONSE_OVERFLOW;
+  }
+  
+  memset(sess, 0, sizeof(*sess));
+  sess->active = 1;
+  sess->comid = comid;
+  sess->tsn = emu->next_tsn++;
+  sess->hsn = hsn;
+  sess->sp = sp;
+  sess->auth = auth;
+  sess->write = (write != 0);
+  sess->last = tp_trace_now();
+  TP_DEBUG(2) printf("Emulator session %x:%x started\n", sess->tsn, sess->hsn);
+  
+  return TP_EMU_SUCCESS;
+}
+
+/**
+ * \brief Get Method
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sess Current session
+ * \param[in] obj Target object
+ * \param[in] args Encoded method arguments
+ * \param[out] out Response data
+ * \return Method status
+ */
+static uint8_t tp_emu_get(struct tp_emu *emu, tp_emu_session_t *sess,
+			  uint64_t obj, tp_buffer_t *args, tp_buffer_t *out)
+{
+  uint64_t name, value, start = 0, end = UINT64_MAX;
+  tp_emu_cell_t *cell;
+  unsigned i, found = 0;
+  
+  /* Cellblock, only columns matter for objects */
+  if (tp_syn_dec_byte(args, TP_SWG_START_LIST))
+  {
+    return TP_EMU_INVALID_PARAMETER;
+  }
+  while (tp_syn_dec_byte(args, TP_SWG_END_LIST))
+  {
+    if ((tp_emu_dec_name(&name, args)) ||
+	(tp_syn_dec_uint(&value, args)) ||
+	(tp_syn_dec_byte(args, TP_SWG_END_NAME)))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    if (name == 3) /* startColumn */
+    {
+      start = value;
+    }
+    else if (name == 4) /* endColumn */
+    {
+      end = value;
+    }
+  }
+  
+  /* columns come back as list of named values */
+  if ((tp_buf_add_byte(out, TP_SWG_START_LIST)))
+  {
+    return TP_EMU_RESPONSE_OVERFLOW;
+  }
+  for (i = 0; i < emu->cell_count; i++)
+  {
+    cell = emu->cells + i;
+    if ((cell->sp != sess->sp) || (cell->obj != obj) ||
+	(cell->col < start) || (cell->col > end))
+    {
+      continue;
+    }
+    if (!tp_emu_allowed(cell->reader, sess))
+    {
+      return TP_EMU_NOT_AUTHORIZED;
+    }
+    if ((tp_buf_add_byte(out, TP_SWG_START_NAME)) ||
+	(tp_syn_enc_uint(out, cell->col)) ||
+	(tp_buf_add(out, cell->atom, cell->len)) ||
+	(tp_buf_add_byte(out, TP_SWG_END_NAME)))
+    {
+      return TP_EMU_RESPONSE_OVERFLOW;
+    }
+    found++;
+  }
+  if (tp_buf_add_byte(out, TP_SWG_END_LIST))
+  {
+    return TP_EMU_RESPONSE_OVERFLOW;
+  }
+  
+  return (found ? TP_EMU_SUCCESS : TP_EMU_INVALID_PARAMETER);
+}
+
+/**
+ * \brief Apply Set Values
+ *
+ * Walk Values argument of Set, either checking or applying each column
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sess Current session
+ * \param[in] obj Target object
+ * \param[in] args Encoded method arguments
+ * \param[in] apply Zero to only check, nonzero to write values
+ * \return Method status
+ */
+static uint8_t tp_emu_set_values(struct tp_emu *emu, tp_emu_session_t *sess,
+				 uint64_t obj, tp_buffer_t args, int apply)
+{
+  tp_syn_atom_info_t info;
+  tp_emu_cell_t *cell;
+  uint64_t name, col;
+  size_t len;
+  
+  while (args.parse_idx < args.cur_len)
+  {
+    if (tp_emu_dec_name(&name, &args))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    
+    /* Where (row) is meaningless for objects */
+    if (name != 1)
+    {
+      if ((tp_emu_skip(&args)) ||
+	  (tp_syn_dec_byte(&args, TP_SWG_END_NAME)))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+      continue;
+    }
+    
+    /* Values - list of named column values */
+    if (tp_syn_dec_byte(&args, TP_SWG_START_LIST))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+    while (tp_syn_dec_byte(&args, TP_SWG_END_LIST))
+    {
+      if ((tp_emu_dec_name(&col, &args)) ||
+	  (tp_syn_dec_atom_header(&info, &args)))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+      len = info.header_bytes + info.data_bytes;
+      if (((cell = tp_emu_find_cell(emu, sess->sp, obj, col)) == NULL) ||
+	  (len > sizeof(cell->atom)))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+      if ((!sess->write) || (!tp_emu_allowed(cell->writer, sess)))
+      {
+	return TP_EMU_NOT_AUTHORIZED;
+      }
+      if (apply)
+      {
+	memcpy(cell->atom, args.byte_ptr + args.parse_idx, len);
+	cell->len = len;
+      }
+      args.parse_idx += len;
+      if (tp_syn_dec_byte(&args, TP_SWG_END_NAME))
+      {
+	return TP_EMU_INVALID_PARAMETER;
+      }
+    }
+    if (tp_syn_dec_byte(&args, TP_SWG_END_NAME))
+    {
+      return TP_EMU_INVALID_PARAMETER;
+    }
+  }
+  
+  return TP_EMU_SUCCESS;
+}
+
+/**
+ * \brief Set Method
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sess Current session
+ * \param[in] obj Target object
+ * \param[in] args Encoded method arguments
+ * \return Method status
+ */
+static uint8_t tp_emu_set(struct tp_emu *emu, tp_emu_session_t *sess,
+			  uint64_t obj, tp_buffer_t *args)
+{
+  uint8_t status;
+  
+  /* all or nothing */
+  if ((status = tp_emu_set_values(emu, sess, obj, *args, 0)) != TP_EMU_SUCCESS)
+  {
+    return status;
+  }
+  return tp_emu_set_values(emu, sess, obj, *args, 1);
+}
+
+/**
+ * \brief Look Up Method Latency
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] method UID of method
+ * \return Time to answer method, in nanoseconds
+ */
+static uint64_t tp_emu_latency(struct tp_emu *emu, uint64_t method)
+{
+  unsigned i;
+  
+  for (i = 0; i < emu->latency_count; i++)
+  {
+    if (emu->latency[i].method == method)
+    {
+      return emu->latency[i].ns;
+    }
+  }
+  return emu->default_latency;
+}
+
+/**
+ * \brief Invoke Method
+ *
+ * Decode one method call from stream, run it, and append its results
+ * (with status) to response.
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] comid Communication ID of packet
+ * \param[in] sess Session of packet (or NULL)
+ * \param[in,out] in Input data stream
+ * \param[out] out Response data
+ * \param[in,out] latency Time needed to answer so far
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_call(struct tp_emu *emu, uint16_t comid,
+			      tp_emu_session_t *sess, tp_buffer_t *in,
+			      tp_buffer_t *out, uint64_t *latency)
+{
+  uint64_t obj, method, reply;
+  size_t args_start, mark;
+  tp_buffer_t args;
+  uint8_t next, status;
+  
+  /* CALL, invoking UID, method UID, argument list */
+  if ((tp_syn_dec_byte(in, TP_SWG_CALL)) ||
+      (tp_syn_dec_uid(&obj, in)) ||
+      (tp_syn_dec_uid(&method, in)) ||
+      (tp_syn_dec_byte(in, TP_SWG_START_LIST)))
+  {
+    return tp_errno;
+  }
+  args_start = in->parse_idx;
+  while ((tp_buf_peek(&next, in) == 0) && (next != TP_SWG_END_LIST))
+  {
+    if (tp_emu_skip(in))
+    {
+      return tp_errno;
+    }
+  }
+  tp_emu_buf(&args, in->byte_ptr + args_start, in->parse_idx - args_start);
+  args.cur_len = args.max_len;
+  
+  /* end of arguments, end of data, and host status list */
+  if ((tp_syn_dec_byte(in, TP_SWG_END_LIST)) ||
+      (tp_syn_dec_byte(in, TP_SWG_END_OF_DATA)) ||
+      (tp_emu_skip(in)))
+  {
+    return tp_errno;
+  }
+  
+  *latency += tp_emu_latency(emu, method);
+  TP_DEBUG(3) printf("Emulator call %016llx.%016llx\n",
+		     (unsigned long long)obj, (unsigned long long)method);
+  
+  /* session manager methods are themselves wrapped in a call */
+  reply = (method == TP_SWG_START_SESSION ? TP_SWG_SYNC_SESSION : method);
+  if ((obj == TP_SWG_SMUID) &&
+      ((tp_buf_add_byte(out, TP_SWG_CALL)) ||
+       (tp_syn_enc_uid(out, TP_SWG_SMUID)) ||
+       (tp_syn_enc_uid(out, reply))))
+  {
+    return tp_errno;
+  }
+  if (tp_buf_add_byte(out, TP_SWG_START_LIST))
+  {
+    return tp_errno;
+  }
+  
+  /* keep room for status, whatever happens */
+  mark = out->cur_len;
+  out->max_len -= TP_EMU_STATUS_ROOM;
+  if ((obj == TP_SWG_SMUID) && (method == TP_SWG_PROPERTIES))
+  {
+    status = tp_emu_properties(emu, &args, out);
+  }
+  else if ((obj == TP_SWG_SMUID) && (method == TP_SWG_START_SESSION))
+  {
+    status = tp_emu_start_session(emu, comid, &args, out);
+  }
+  else if ((obj == TP_SWG_SMUID) || (sess == NULL))
+  {
+    status = TP_EMU_INVALID_PARAMETER;
+  }
+  else if (method == TP_SWG_GET)
+  {
+    status = tp_emu_get(emu, sess, obj, &args, out);
+  }
+  else if (method == TP_SWG_SET)
+  {
+    status = tp_emu_set(emu, sess, obj, &args);
+  }
+  else
+  {
+    status = TP_EMU_INVALID_PARAMETER;
+  }
+  out->max_len += TP_EMU_STATUS_ROOM;
+  
+  /* failed methods return no results */
+  if (status != TP_EMU_SUCCESS)
+  {
+    out->cur_len = mark;
+  }
+  
+  /* end of results, and status */
+  if ((tp_buf_add_byte(out, TP_SWG_END_LIST)) ||
+      (tp_buf_add_byte(out, TP_SWG_END_OF_DATA)) ||
+      (tp_buf_add_byte(out, TP_SWG_START_LIST)) ||
+      (tp_syn_enc_uint(out, status)) ||
+      (tp_syn_enc_uint(out, 0)) ||
+      (tp_syn_enc_uint(out, 0)) ||
+      (tp_buf_add_byte(out, TP_SWG_END_LIST)))
+  {
+    return tp_errno;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Start Transaction
+ *
+ * Only one transaction is modelled at a time, across all sessions
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sess Session starting transaction
+ * \return Transaction status (0 if started)
+ */
+static uint8_t tp_emu_txn_start(struct tp_emu *emu, tp_emu_session_t *sess)
+{
+  if ((sess == NULL) || (emu->txn != NULL))
+  {
+    return 1;
+  }
+  memcpy(emu->txn_cells, emu->cells, sizeof(emu->cells));
+  emu->txn_cell_count = emu->cell_count;
+  emu->txn = sess;
+  TP_DEBUG(2) printf("Emulator transaction started\n");
+  return 0;
+}
+
+/**
+ * \brief End Transaction
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] sess Session ending transaction
+ * \param[in] commit Keep changes made in transaction
+ * \return Transaction status (0 if committed)
+ */
+static uint8_t tp_emu_txn_end(struct tp_emu *emu, tp_emu_session_t *sess,
+			      int commit)
+{
+  if ((sess == NULL) || (emu->txn != sess))
+  {
+    return 1;
+  }
+  if (!commit)
+  {
+    memcpy(emu->cells, emu->txn_cells, sizeof(emu->cells));
+    emu->cell_count = emu->txn_cell_count;
+  }
+  emu->txn = NULL;
+  TP_DEBUG(2) printf("Emulator transaction %s\n",
+		     (commit ? "committed" : "aborted"));
+  return (commit ? 0 : 1);
+}
+
+/**
+ * \brief Look Up ComID
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] comid Communication ID
+ * \return State of ComID (static, or dynamic whether issued or not), or NULL
+ */
+static tp_emu_comid_t *tp_emu_comid(struct tp_emu *emu, uint16_t comid)
+{
+  if ((comid >= TP_EMU_COMID_BASE) &&
+      (comid < TP_EMU_COMID_BASE + TP_EMU_COMID_COUNT))
+  {
+    return emu->comids + (comid - TP_EMU_COMID_BASE);
+  }
+  if ((comid >= TP_EMU_DYN_COMID_BASE) &&
+      (comid < TP_EMU_DYN_COMID_BASE + TP_EMU_DYN_COMID_COUNT))
+  {
+    return emu->comids + TP_EMU_COMID_COUNT + (comid - TP_EMU_DYN_COMID_BASE);
+  }
+  return NULL;
+}
+
+/**
+ * \brief Get TPer Property
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] name Property name
+ * \param[in] value Value if property is not set
+ * \return Property value
+ */
+static uint64_t tp_emu_get_property(struct tp_emu *emu, char const *name,
+				    uint64_t value)
+{
+  unsigned i;
+  
+  for (i = 0; i < emu->prop_count; i++)
+  {
+    if (strcmp(emu->props[i].name, name) == 0)
+    {
+      return emu->props[i].value;
+    }
+  }
+  return value;
+}
+
+/**
+ * \brief Receive ComPacket
+ *
+ * Process ComPacket from host, and queue up response
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes transferred
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_swg_send(struct tp_emu *emu, uint16_t comid,
+				  void const *data, size_t len)
+{
+  tp_emu_comid_t *cid = tp_emu_comid(emu, comid);
+  tp_swg_header_t const *in_hdr = data;
+  tp_swg_header_t *out_hdr = (tp_swg_header_t*)cid->resp;
+  tp_emu_session_t *sess = NULL;
+  uint32_t tsn, hsn, sub_len, pad_len;
+  uint64_t latency = 0, txn_status, timeout;
+  tp_buffer_t in, out;
+  uint8_t next;
+  unsigned i;
+  
+  /* sanity check headers */
+  if (len < sizeof(tp_swg_header_t))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  sub_len = be32toh(in_hdr->sub.length);
+  if (sub_len > len - sizeof(tp_swg_header_t))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* sessions idle longer than DefSessionTimeout (ms) are aborted */
+  timeout = tp_emu_get_property(emu, "DefSessionTimeout", 0) * 1000000;
+  for (i = 0; (timeout) && (i < TP_EMU_MAX_SESSIONS); i++)
+  {
+    if ((emu->sessions[i].active) &&
+	(tp_trace_now() - emu->sessions[i].last > timeout))
+    {
+      TP_DEBUG(2) printf("Emulator session %x:%x timed out\n",
+			 emu->sessions[i].tsn, emu->sessions[i].hsn);
+      tp_emu_txn_end(emu, emu->sessions + i, 0);
+      emu->sessions[i].active = 0;
+    }
+  }
+  
+  /* which session (if any) this is for */
+  tsn = be32toh(in_hdr->pkt.tper_session_id);
+  hsn = be32toh(in_hdr->pkt.host_session_id);
+  if ((tsn != 0) || (hsn != 0))
+  {
+    sess = tp_emu_find_session(emu, comid, tsn, hsn);
+  }
+  
+  /* new response replaces anything uncollected */
+  tp_emu_buf(&in, (void*)(in_hdr + 1), sub_len);
+  in.cur_len = sub_len;
+  tp_emu_buf(&out, cid->resp + sizeof(tp_swg_header_t),
+	     emu->resp_size - sizeof(tp_swg_header_t) - 4);
+  
+  /* no such session (any more), so tell host via CloseSession */
+  if (((tsn != 0) || (hsn != 0)) && (sess == NULL))
+  {
+    if ((tp_buf_add_byte(&out, TP_SWG_CALL)) ||
+	(tp_syn_enc_uid(&out, TP_SWG_SMUID)) ||
+	(tp_syn_enc_uid(&out, TP_SWG_CLOSE_SESSION)) ||
+	(tp_buf_add_byte(&out, TP_SWG_START_LIST)) ||
+	(tp_syn_enc_uint(&out, hsn)) ||
+	(tp_syn_enc_uint(&out, tsn)) ||
+	(tp_buf_add_byte(&out, TP_SWG_END_LIST)) ||
+	(tp_buf_add_byte(&out, TP_SWG_END_OF_DATA)) ||
+	(tp_buf_add_byte(&out, TP_SWG_START_LIST)) ||
+	(tp_syn_enc_uint(&out, 0)) ||
+	(tp_syn_enc_uint(&out, 0)) ||
+	(tp_syn_enc_uint(&out, 0)) ||
+	(tp_buf_add_byte(&out, TP_SWG_END_LIST)))
+    {
+      return tp_errno;
+    }
+    in.parse_idx = in.cur_len;
+    tsn = hsn = 0;
+  }
+  else if (sess != NULL)
+  {
+    sess->last = tp_trace_now();
+  }
+  
+  /* work through the token stream */
+  while (tp_buf_peek(&next, &in) == 0)
+  {
+    if (next == TP_SWG_END_SESSION)
+    {
+      in.parse_idx++;
+      if (sess != NULL)
+      {
+	TP_DEBUG(2) printf("Emulator session %x:%x ended\n", tsn, hsn);
+	tp_emu_txn_end(emu, sess, 0);
+	sess->active = 0;
+	sess = NULL;
+      }
+      if (tp_buf_add_byte(&out, TP_SWG_END_SESSION))
+      {
+	return tp_errno;
+      }
+    }
+    else if (next == TP_SWG_CALL)
+    {
+      if (tp_emu_call(emu, comid, sess, &in, &out, &latency))
+      {
+	return tp_errno;
+      }
+    }
+    else if ((next == TP_SWG_START_TRANS) || (next == TP_SWG_END_TRANS))
+    {
+      /* token, then status (0 to commit) */
+      in.parse_idx++;
+      if (tp_syn_dec_uint(&txn_status, &in))
+      {
+	return tp_errno;
+      }
+      txn_status = (next == TP_SWG_START_TRANS ?
+		    tp_emu_txn_start(emu, sess) :
+		    tp_emu_txn_end(emu, sess, (txn_status == 0)));
+      if ((tp_buf_add_byte(&out, next)) ||
+	  (tp_syn_enc_uint(&out, txn_status)))
+      {
+	return tp_errno;
+      }
+    }
+    else
+    {
+      /* nothing else modelled */
+      break;
+    }
+  }
+  
+  /* wrap it up */
+  pad_len = (out.cur_len + 3) & ~3;
+  memset(out_hdr, 0, sizeof(tp_swg_header_t));
+  memset(out.byte_ptr + out.cur_len, 0, pad_len - out.cur_len);
+  out_hdr->com.com_id = htobe16(comid);
+  out_hdr->com.length = htobe32(sizeof(tp_swg_packet_header_t) +
+				sizeof(tp_swg_sub_packet_header_t) + pad_len);
+  out_hdr->pkt.tper_session_id = htobe32(tsn);
+  out_hdr->pkt.host_session_id = htobe32(hsn);
+  out_hdr->pkt.length = htobe32(sizeof(tp_swg_sub_packet_header_t) + pad_len);
+  out_hdr->sub.length = htobe32(out.cur_len);
+  cid->resp_len = sizeof(tp_swg_header_t) + pad_len;
+  cid->resp_sent = 0;
+  cid->ready = tp_trace_now() + latency;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Send ComPacket
+ *
+ * Hand pending response (if ready) to host, split over as many ComPackets
+ * as MaxResponseComPacketSize calls for
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_swg_recv(struct tp_emu *emu, uint16_t comid,
+				  void *data, size_t len)
+{
+  tp_emu_comid_t *cid = tp_emu_comid(emu, comid);
+  tp_swg_header_t const *resp_hdr = (tp_swg_header_t*)cid->resp;
+  tp_swg_header_t *out_hdr = data;
+  tp_swg_com_packet_header_t *hdr = data;
+  size_t chunk, left, sub_len, max_chunk;
+  
+  if (len < sizeof(tp_swg_com_packet_header_t))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  memset(data, 0, len);
+  hdr->com_id = htobe16(comid);
+  
+  /* nothing (yet), empty ComPacket */
+  if ((cid->resp_len == 0) || (tp_trace_now() < cid->ready))
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* next piece of response data, in multiples of 4 bytes */
+  max_chunk = tp_emu_get_property(emu, "MaxResponseComPacketSize",
+				  emu->resp_size);
+  max_chunk = (max_chunk - sizeof(tp_swg_header_t)) & ~(size_t)3;
+  left = cid->resp_len - sizeof(tp_swg_header_t) - cid->resp_sent;
+  chunk = (left < max_chunk ? left : max_chunk);
+  
+  /* host needs to ask for more */
+  if (sizeof(tp_swg_header_t) + chunk > len)
+  {
+    hdr->tper_left = htobe32(sizeof(tp_swg_header_t) + left);
+    hdr->min_xfer = htobe32(sizeof(tp_swg_header_t) + chunk);
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* same session and sub packet, just a slice of the data */
+  memcpy(out_hdr, resp_hdr, sizeof(tp_swg_header_t));
+  memcpy(out_hdr + 1, cid->resp + sizeof(tp_swg_header_t) + cid->resp_sent,
+	 chunk);
+  sub_len = be32toh(resp_hdr->sub.length);
+  sub_len = (sub_len > cid->resp_sent ? sub_len - cid->resp_sent : 0);
+  out_hdr->sub.length = htobe32(sub_len < chunk ? sub_len : chunk);
+  out_hdr->pkt.length = htobe32(sizeof(tp_swg_sub_packet_header_t) + chunk);
+  out_hdr->com.length = htobe32(sizeof(tp_swg_packet_header_t) +
+				sizeof(tp_swg_sub_packet_header_t) + chunk);
+  cid->resp_sent += chunk;
+  left -= chunk;
+  
+  /* more to come? */
+  if (left != 0)
+  {
+    chunk = (left < max_chunk ? left : max_chunk);
+    out_hdr->com.tper_left = htobe32(sizeof(tp_swg_header_t) + left);
+    out_hdr->com.min_xfer = htobe32(sizeof(tp_swg_header_t) + chunk);
+  }
+  else
+  {
+    cid->resp_len = 0;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Level 0 Discovery
+ *
+ * \param[in,out] emu Emulated TPer
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_emu_discovery(struct tp_emu *emu, void *data, size_t len)
+{
+  uint8_t raw[128], *feat;
+  tp_header_t *header = (tp_header_t*)raw;
+  size_t offset = sizeof(tp_header_t);
+  uint8_t lock = 0x01 | 0x08; /* supported, media encryption */
+  
+  memset(raw, 0, sizeof(raw));
+  
+  /* TPer - synchronous only */
+  feat = raw + offset;
+  feat[1] = TP_FEAT_TPER;
+  feat[2] = 0x10;
+  feat[3] = 12;
+  feat[4] = 0x41; /* Sync, ComID Mgmt */
+  offset += 4 + feat[3];
+  
+  /* Locking - reflects Global Range and MBR Control */
+  if (tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 5) |
+      tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 6))
+  {
+    lock |= 0x02;
+  }
+  if (tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 7) |
+      tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 8))
+  {
+    lock |= 0x04;
+  }
+  if (tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_MBR_CONTROL, 1))
+  {
+    lock |= 0x10;
+  }
+  if (tp_emu_cell_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_MBR_CONTROL, 2))
+  {
+    lock |= 0x20;
+  }
+  feat = raw + offset;
+  feat[1] = TP_FEAT_LOCK;
+  feat[2] = 0x10;
+  feat[3] = 12;
+  feat[4] = lock;
+  offset += 4 + feat[3];
+  
+  /* Opal SSC 2.0 */
+  feat = raw + offset;
+  feat[0] = TP_FEAT_OPAL2 >> 8;
+  feat[1] = TP_FEAT_OPAL2 & 0xff;
+  feat[2] = 0x10;
+  feat[3] = 16;
+  feat[4] = TP_EMU_COMID_BASE >> 8; /* built bytewise, spec layout is packed */
+  feat[5] = TP_EMU_COMID_BASE & 0xff;
+  feat[6] = TP_EMU_COMID_COUNT >> 8;
+  feat[7] = TP_EMU_COMID_COUNT & 0xff;
+  feat[10] = 4;  /* Locking SP Admins */
+  feat[12] = 8;  /* Locking SP Users */
+  offset += 4 + feat[3];
+  
+  /* header */
+  header->length = htobe32(offset - 4);
+  header->major_ver = htobe16(0);
+  header->minor_ver = htobe16(1);
+  
+  memset(data, 0, len);
+  memcpy(data, raw, (len < offset ? len : offset));
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Create Emulated TPer
+ *
+ * Bring up a new TPer, in manufactured state
+ *
+ * \return Pointer to new TPer, or NULL on error
+ */
+struct tp_emu *tp_emu_create(void)
+{
+  struct tp_emu *emu;
+  unsigned i;
+  
+  /* allocate some memory for TPer */
+  if ((emu = calloc(1, sizeof(struct tp_emu))) == NULL)
+  {
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  emu->next_tsn = 0x1001;
+  
+  /* response space per ComID */
+  emu->resp_size = TP_EMU_MAX_PKT_SIZE;
+  for (i = 0; i < TP_EMU_COMID_SLOTS; i++)
+  {
+    if ((emu->comids[i].resp = malloc(emu->resp_size)) == NULL)
+    {
+      tp_emu_destroy(emu);
+      tp_errno = TP_ERR_ALLOC;
+      return NULL;
+    }
+    emu->comids[i].issued = (i < TP_EMU_COMID_COUNT);
+  }
+  
+  /* communication properties */
+  tp_emu_set_property(emu, "MaxComPacketSize", TP_EMU_MAX_PKT_SIZE);
+  tp_emu_set_property(emu, "MaxResponseComPacketSize", TP_EMU_MAX_PKT_SIZE);
+  tp_emu_set_property(emu, "MaxPacketSize", TP_EMU_MAX_PKT_SIZE - 20);
+  tp_emu_set_property(emu, "MaxIndTokenSize", TP_EMU_MAX_PKT_SIZE - 56);
+  tp_emu_set_property(emu, "MaxAggTokenSize", TP_EMU_MAX_PKT_SIZE - 56);
+  tp_emu_set_property(emu, "MaxPackets", 1);
+  tp_emu_set_property(emu, "MaxSubpackets", 1);
+  tp_emu_set_property(emu, "MaxMethods", 1);
+  tp_emu_set_property(emu, "MaxSessions", TP_EMU_MAX_SESSIONS);
+  tp_emu_set_property(emu, "MaxAuthentications", 2);
+  tp_emu_set_property(emu, "MaxTransactionLimit", 1);
+  tp_emu_set_property(emu, "DefSessionTimeout", 0);
+  
+  /* Admin SP */
+  tp_emu_add_str(emu, TP_SWG_SP_ADMIN, TP_SWG_C_PIN_MSID, 3,
+		 TP_SWG_ANYBODY, TP_SWG_NULL, TP_EMU_MSID);
+  tp_emu_add_str(emu, TP_SWG_SP_ADMIN, TP_SWG_C_PIN_SID, 3,
+		 TP_SWG_NULL, TP_SWG_SID, TP_EMU_MSID);
+  tp_emu_add_uint(emu, TP_SWG_SP_ADMIN, TP_SWG_SP_LOCKING, 6,
+		  TP_SWG_ANYBODY, TP_SWG_NULL, 9); /* Manufactured */
+  
+  /* Locking SP */
+  tp_emu_add_str(emu, TP_SWG_SP_LOCKING, TP_SWG_C_PIN_ADMIN1, 3,
+		 TP_SWG_NULL, TP_SWG_ADMIN1, TP_EMU_MSID);
+  tp_emu_add_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 3,
+		  TP_SWG_ANYBODY, TP_SWG_NULL, 0); /* RangeStart */
+  tp_emu_add_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, 4,
+		  TP_SWG_ANYBODY, TP_SWG_NULL, 0); /* RangeLength */
+  for (i = 5; i <= 8; i++) /* Read/WriteLockEnabled, Read/WriteLocked */
+  {
+    tp_emu_add_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_LOCKING_GLOBAL, i,
+		    TP_SWG_ADMIN1, TP_SWG_ADMIN1, 0);
+  }
+  tp_emu_add_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_MBR_CONTROL, 1,
+		  TP_SWG_ADMIN1, TP_SWG_ADMIN1, 0); /* Enable */
+  tp_emu_add_uint(emu, TP_SWG_SP_LOCKING, TP_SWG_MBR_CONTROL, 2,
+		  TP_SWG_ADMIN1, TP_SWG_ADMIN1, 0); /* Done */
+  
+  tp_errno = TP_ERR_SUCCESS;
+  return emu;
+}
+
+/**
+ * \brief Destroy Emulated TPer
+ *
+ * \param[in] emu Emulated TPer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_destroy(struct tp_emu *emu)
+{
+  unsigned i;
+  
+  /* sanity check */
+  if (emu == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  for (i = 0; i < TP_EMU_COMID_SLOTS; i++)
+  {
+    free(emu->comids[i].resp);
+  }
+  free(emu);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Set Method Latency
+ *
+ * Set how long the TPer takes to answer a method, during which IF-RECV
+ * returns empty ComPackets (as a busy drive would).
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] method_uid UID of method, or TP_SWG_NULL to set the default
+ * \param[in] ns Latency in nanoseconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_set_latency(struct tp_emu *emu, uint64_t method_uid,
+			      uint64_t ns)
+{
+  unsigned i;
+  
+  /* check for NULL pointers */
+  if (emu == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  if (method_uid == TP_SWG_NULL)
+  {
+    emu->default_latency = ns;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* replace, or add */
+  for (i = 0; (i < emu->latency_count) &&
+	 (emu->latency[i].method != method_uid); i++);
+  if (i == TP_EMU_MAX_LATENCY)
+  {
+    return tp_errno = TP_ERR_SPACE;
+  }
+  emu->latency[i].method = method_uid;
+  emu->latency[i].ns = ns;
+  if (i == emu->latency_count)
+  {
+    emu->latency_count++;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Set TPer Property
+ *
+ * Change (or add) a communication property reported by the TPer in
+ * response to the Properties method.
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] name Property name (e.g. "MaxComPacketSize")
+ * \param[in] value Property value
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_set_property(struct tp_emu *emu, char const *name,
+			       uint64_t value)
+{
+  uint8_t *resp;
+  unsigned i;
+  
+  /* check for NULL pointers */
+  if ((emu == NULL) || (name == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  if (strlen(name) >= sizeof(emu->props[0].name))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* larger ComPackets need more response space */
+  if ((strcmp(name, "MaxComPacketSize") == 0) && (value > emu->resp_size))
+  {
+    for (i = 0; i < TP_EMU_COMID_SLOTS; i++)
+    {
+      if ((resp = realloc(emu->comids[i].resp, value)) == NULL)
+      {
+	return tp_errno = TP_ERR_ALLOC;
+      }
+      emu->comids[i].resp = resp;
+    }
+    emu->resp_size = value;
+  }
+  
+  /* replace, or add */
+  for (i = 0; (i < emu->prop_count) &&
+	 (strcmp(emu->props[i].name, name) != 0); i++);
+  if (i == TP_EMU_MAX_PROPS)
+  {
+    return tp_errno = TP_ERR_SPACE;
+  }
+  strcpy(emu->props[i].name, name);
+  emu->props[i].value = value;
+  if (i == emu->prop_count)
+  {
+    emu->prop_count++;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Emulated IF-SEND
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_if_send(struct tp_emu *emu, uint8_t proto, uint16_t comid,
+			  void const *data, size_t len)
+{
+  tp_comid_req_t const *req = data;
+  tp_emu_comid_t *cid;
+  unsigned i;
+  
+  /* check for NULL pointers */
+  if ((emu == NULL) || (data == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* only our ComIDs are valid for SWG traffic */
+  if ((cid = tp_emu_comid(emu, comid)) == NULL)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* SWG ComPacket */
+  if ((proto == 1) && (cid->issued))
+  {
+    return tp_emu_swg_send(emu, comid, data, len);
+  }
+  
+  /* ComID management */
+  if ((proto == 2) && (len >= sizeof(tp_comid_req_t)) &&
+      (be16toh(req->com_id) == comid))
+  {
+    cid->req_code = be32toh(req->req_code);
+    cid->reset_pending = 1;
+    if (cid->req_code == 0x02) /* STACK_RESET */
+    {
+      TP_DEBUG(2) printf("Emulator ComID 0x%x reset\n", comid);
+      for (i = 0; i < TP_EMU_MAX_SESSIONS; i++)
+      {
+	if (emu->sessions[i].comid == comid)
+	{
+	  tp_emu_txn_end(emu, emu->sessions + i, 0);
+	  emu->sessions[i].active = 0;
+	}
+      }
+      cid->resp_len = 0;
+      
+      /* dynamic ComIDs go back in the pool */
+      if (cid >= emu->comids + TP_EMU_COMID_COUNT)
+      {
+	cid->issued = 0;
+      }
+    }
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  return tp_errno = TP_ERR_INVALID;
+}
+
+/**
+ * \brief Emulated IF-RECV
+ *
+ * \param[in] emu Emulated TPer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_emu_if_recv(struct tp_emu *emu, uint8_t proto, uint16_t comid,
+			  void *data, size_t len)
+{
+  tp_comid_resp_t *resp = data;
+  tp_comid_verify_resp_t *verify = data;
+  uint8_t *bytes = data;
+  tp_emu_comid_t *cid;
+  unsigned i;
+  
+  /* check for NULL pointers */
+  if ((emu == NULL) || (data == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* supported security protocols */
+  if ((proto == 0) && (comid == 0) && (len >= 11))
+  {
+    memset(data, 0, len);
+    bytes[7] = 3;
+    bytes[8] = 0;
+    bytes[9] = 1;
+    bytes[10] = 2;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* Level 0 Discovery */
+  if ((proto == 1) && (comid == 1))
+  {
+    return tp_emu_discovery(emu, data, len);
+  }
+  
+  /* GET_COMID - issue first free dynamic ComID, or zero if none */
+  if ((proto == 2) && (comid == 0) && (len >= sizeof(tp_comid_req_t)))
+  {
+    memset(data, 0, len);
+    for (i = TP_EMU_COMID_COUNT; i < TP_EMU_COMID_SLOTS; i++)
+    {
+      if (!emu->comids[i].issued)
+      {
+	emu->comids[i].issued = 1;
+	emu->comids[i].resp_len = 0;
+	resp->com_id = htobe16(TP_EMU_DYN_COMID_BASE + i - TP_EMU_COMID_COUNT);
+	TP_DEBUG(2) printf("Emulator issued ComID 0x%x\n",
+			   be16toh(resp->com_id));
+	break;
+      }
+    }
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* everything else is on one of our ComIDs */
+  if ((cid = tp_emu_comid(emu, comid)) == NULL)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* SWG ComPacket */
+  if ((proto == 1) && (cid->issued))
+  {
+    return tp_emu_swg_recv(emu, comid, data, len);
+  }
+  
+  /* ComID management */
+  if ((proto == 2) && (len >= sizeof(tp_comid_resp_t)))
+  {
+    memset(data, 0, len);
+    resp->com_id = htobe16(comid);
+    if ((cid->reset_pending) && (cid->req_code == 0x01)) /* VERIFY_COMID_VALID */
+    {
+      verify->req_code = htobe32(cid->req_code);
+      verify->avail_data = htobe32(34); /* state, then (zero) timestamps */
+      verify->state = htobe32(cid->issued ? TP_COMID_ISSUED : TP_COMID_INVALID);
+      for (i = 0; (cid->issued) && (i < TP_EMU_MAX_SESSIONS); i++)
+      {
+	if ((emu->sessions[i].active) && (emu->sessions[i].comid == comid))
+	{
+	  verify->state = htobe32(TP_COMID_ASSOCIATED);
+	}
+      }
+      cid->reset_pending = 0;
+    }
+    else if (cid->reset_pending)
+    {
+      resp->req_code = htobe32(cid->req_code);
+      resp->avail_data = htobe32(4);
+      resp->failed = htobe32(cid->req_code == 0x02 ? 0 : 1);
+      cid->reset_pending = 0;
+    }
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  return tp_errno = TP_ERR_INVALID;
+}
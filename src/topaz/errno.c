@@ -29,8 +29,8 @@
 
 #include <topaz/errno.h>
 
-/** Last topaz error number */
-tp_errno_t tp_errno = 0;
+/** Last topaz error number (per thread) */
+__thread tp_errno_t tp_errno = 0;
 
 /** Known topaz error codes */
 struct
@@ -67,6 +67,8 @@ struct
   { TP_ERR_BAD_COMID      , "Unexpected ComID in TPM response" },
   { TP_ERR_TIMEOUT        , "Timeout waiting for TPM response" },
   { TP_ERR_MALFORMED      , "Bad / Malformed response from TPM" },
+  { TP_ERR_NO_COMID       , "TPM has no ComID available" },
+  { TP_ERR_SESSION_ABORTED, "TPM closed session unexpectedly" },
 
   /* SWG Method Call Statuses */
 
@@ -94,11 +96,19 @@ struct
   { TP_ERR_IOCTL          , "Failed to call ioctl" },
   { TP_ERR_SENSE          , "Bad sense data" },
   { TP_ERR_PACKET_SIZE    , "Packet too large for drive" },
+  { TP_ERR_NVME_STATUS    , "Bad NVMe completion status" },
+  { TP_ERR_URING          , "Failed to set up or enter io_uring" },
+  { TP_ERR_SG_QUEUE       , "Failed to queue or collect sg request" },
+  { TP_ERR_TRACE          , "Bad trace file, or traffic does not match trace" },
+  { TP_ERR_ATA_ABORT      , "Device (or SAT layer) rejected ATA command" },
+  { TP_ERR_ATA_ERROR      , "Device reported ATA error" },
+  { TP_ERR_TRANSIENT      , "Transient transport failure, retries exhausted" },
 
   /* Linux Specific Errors */
 
   { TP_ERR_SYSFS          , "Error reading from sysfs" },
   { TP_ERR_LIBATA         , "Libata blocking TPM calls (add kernel argument 'libata.allow_tpm=1')" },
+  { TP_ERR_SED_OPAL       , "Kernel sed-opal request rejected (or CONFIG_BLK_SED_OPAL missing)" },
 
 /* === END AUTOGENERATED CONTENT === */
 };
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <endian.h>
 #include <topaz/security.h>
+#include <topaz/transport.h>
 #include <topaz/transport_ata.h>
 #include <topaz/debug.h>
 
@@ -52,7 +53,7 @@ tp_errno_t tp_probe_security(tp_handle_t *handle)
   
   /* query protocol info */
   TP_DEBUG(1) printf("Probe TPM Security Protocols\n");
-  if (tp_ata_if_recv(handle->ata, 0, 0, buf, 1) != 0)
+  if (tp_if_recv(handle, 0, 0, buf, sizeof(buf)) != 0)
   {
     return tp_errno;
   }
@@ -158,8 +159,8 @@ tp_errno_t tp_security_comid_reset(tp_handle_t *handle, uint32_t com_id)
   cmd->req_code = htobe32(0x02);     /* STACK_RESET */
   
   /* Hit the reset */
-  if ((tp_ata_if_send(handle->ata, 2, com_id, block, 1) != 0) ||
-      (tp_ata_if_recv(handle->ata, 2, com_id, block, 1) != 0))
+  if ((tp_if_send(handle, 2, com_id, block, sizeof(block)) != 0) ||
+      (tp_if_recv(handle, 2, com_id, block, sizeof(block)) != 0))
   {
     return tp_errno;
   }
@@ -173,3 +174,110 @@ tp_errno_t tp_security_comid_reset(tp_handle_t *handle, uint32_t com_id)
   TP_DEBUG(2) printf("  Completed\n");
   return tp_errno = TP_ERR_SUCCESS;
 }
+
+/**
+ * \brief Get Dynamic ComID
+ *
+ * Ask TPer to issue a ComID (GET_COMID) for exclusive use of the caller
+ *
+ * \param[in] handle Target drive
+ * \param[out] com_id Issued Communication ID
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_get_comid(tp_handle_t *handle, uint32_t *com_id)
+{
+  unsigned char block[TP_ATA_BLOCK_SIZE] = {0};
+  tp_comid_req_t *resp = (tp_comid_req_t*)block;
+  
+  /* check for NULL pointers */
+  if (com_id == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  TP_DEBUG(1) printf("Get Dynamic ComID\n");
+  
+  /* GET_COMID is a bare IF-RECV on ComID zero */
+  if (tp_if_recv(handle, 2, 0, block, sizeof(block)) != 0)
+  {
+    return tp_errno;
+  }
+  
+  /* TPer answers zero when it has nothing left to hand out */
+  *com_id = be16toh(resp->com_id);
+  if (*com_id == 0)
+  {
+    return tp_errno = TP_ERR_NO_COMID;
+  }
+  
+  TP_DEBUG(2) printf("  Issued ComID 0x%x\n", *com_id);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Verify ComID
+ *
+ * Query state of a communication ID (VERIFY_COMID_VALID)
+ *
+ * \param[in] handle Target drive
+ * \param[in] com_id Communication ID to check
+ * \param[out] state State of ComID
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_verify_comid(tp_handle_t *handle, uint32_t com_id,
+				    tp_comid_state_t *state)
+{
+  unsigned char block[TP_ATA_BLOCK_SIZE] = {0};
+  tp_comid_req_t *cmd = (tp_comid_req_t*)block;
+  tp_comid_verify_resp_t *resp = (tp_comid_verify_resp_t*)block;
+  
+  /* check for NULL pointers */
+  if (state == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  TP_DEBUG(1) printf("Verify ComID 0x%x\n", com_id);
+  
+  /* Cook up the COMID management packet */
+  cmd->com_id = htobe16(com_id);
+  cmd->req_code = htobe32(0x01);     /* VERIFY_COMID_VALID */
+  
+  if ((tp_if_send(handle, 2, com_id, block, sizeof(block)) != 0) ||
+      (tp_if_recv(handle, 2, com_id, block, sizeof(block)) != 0))
+  {
+    return tp_errno;
+  }
+  
+  /* Check result */
+  if ((be16toh(resp->com_id) != com_id) ||
+      (be32toh(resp->req_code) != 0x01))
+  {
+    return tp_errno = TP_ERR_BAD_COMID;
+  }
+  if (be32toh(resp->avail_data) < sizeof(resp->state))
+  {
+    return tp_errno = TP_ERR_MALFORMED;
+  }
+  *state = (tp_comid_state_t)be32toh(resp->state);
+  
+  TP_DEBUG(2) printf("  State %u\n", (unsigned int)*state);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Release Dynamic ComID
+ *
+ * Hand an issued ComID back to TPer, ending any sessions still on it
+ *
+ * \param[in] handle Target drive
+ * \param[in] com_id Communication ID to release
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_security_comid_release(tp_handle_t *handle, uint32_t com_id)
+{
+  /* No explicit release in protocol 2, but a stack reset on a dynamic
+   * ComID drops it, rather than leaving it to expire on the TPer */
+  TP_DEBUG(1) printf("Release ComID 0x%x\n", com_id);
+  return tp_security_comid_reset(handle, com_id);
+}
@@ -0,0 +1,282 @@
+/*
+ * Topaz - Kernel SED Support (Linux ioctl)
+ *
+ * This file is an implementation of a Linux specific OS API for the
+ * kernel's sed-opal block layer support.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/sed-opal.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/sed_opal.h>
+
+/** Linux device handle */
+struct tp_sed_handle
+{
+  int fd; /** POSIX file descriptor */
+};
+
+/**
+ * \brief Open Kernel SED Device (OS Specific)
+ *
+ * OS-agnostic API to provide a handle for the kernel's Opal support
+ * of a block device. Fails if the kernel does not manage the device.
+ *
+ * \param[in] path Path to block device
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_sed_handle *tp_sed_open(char const *path)
+{
+  struct tp_sed_handle *handle = NULL;
+  uint32_t flags;
+  int rc, fd = -1;
+  
+  /* open block device */
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+  {
+    rc = TP_ERR_OPEN;
+    goto cleanup;
+  }
+  
+  /* allocate some memory for device handle */
+  handle = (struct tp_sed_handle*)calloc(sizeof(struct tp_sed_handle), 1);
+  if (handle == NULL)
+  {
+    rc = TP_ERR_ALLOC;
+    goto cleanup;
+  }
+  handle->fd = fd;
+  
+  /* kernel must have found an Opal drive here */
+  if (tp_sed_get_status(handle, &flags))
+  {
+    rc = tp_errno;
+    goto cleanup;
+  }
+  if ((flags & OPAL_FL_SUPPORTED) == 0)
+  {
+    rc = TP_ERR_NO_SSC;
+    goto cleanup;
+  }
+  
+  /* all done */
+  tp_errno = TP_ERR_SUCCESS;
+  return handle;
+  
+  cleanup: /* on failure */
+  
+  /* close handle if open */
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  
+  /* clear memory if allocated */
+  if (handle != NULL)
+  {
+    free(handle);
+  }
+  
+  /* set errno and return */
+  tp_errno = rc;
+  return NULL;
+}
+
+/**
+ * \brief Close Kernel SED Device (OS Specific)
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_close(struct tp_sed_handle *handle)
+{
+  /* sanity check */
+  if (handle == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* cleanup */
+  close(handle->fd);
+  free(handle);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Query Kernel SED Status (OS Specific)
+ *
+ * Fetch the kernel's view of Level 0 Discovery, as flags in the order
+ * supported, locking supported, locking enabled, locked, MBR enabled and
+ * MBR done (bit 0 upward).
+ *
+ * \param[in] handle Device handle
+ * \param[out] flags Status flags
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_get_status(struct tp_sed_handle *handle, uint32_t *flags)
+{
+  struct opal_status status;
+  
+  /* check for NULL pointers */
+  if ((handle == NULL) || (flags == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  memset(&status, 0, sizeof(status));
+  if (ioctl(handle->fd, IOC_OPAL_GET_STATUS, &status) != 0)
+  {
+    return tp_errno = TP_ERR_SED_OPAL;
+  }
+  
+  TP_DEBUG(2) printf("Kernel SED status = %08x\n", status.flags);
+  *flags = status.flags;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Fill Kernel Lock / Unlock Request
+ *
+ * \param[out] req ioctl data structure
+ * \param[in] key Locking range credentials
+ * \param[in] state State of range
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_sed_fill(struct opal_lock_unlock *req,
+			      tp_sed_key_t const *key,
+			      tp_sed_lock_state_t state)
+{
+  /* check for NULL pointers */
+  if (key == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* kernel bounds */
+  if ((key->key_len > OPAL_KEY_MAX) || (key->user > OPAL_USER9) ||
+      (key->range >= OPAL_MAX_LRS))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  if ((state != TP_SED_LOCK_RO) && (state != TP_SED_LOCK_RW) &&
+      (state != TP_SED_LOCK_LK))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  memset(req, 0, sizeof(*req));
+  req->session.sum = (key->sum != 0);
+  req->session.who = key->user;
+  req->session.opal_key.lr = key->range;
+  req->session.opal_key.key_len = key->key_len;
+  memcpy(req->session.opal_key.key, key->key, key->key_len);
+  req->l_state = state;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Issue Kernel Lock / Unlock Request
+ *
+ * \param[in] handle Device handle
+ * \param[in] request ioctl request code
+ * \param[in] key Locking range credentials
+ * \param[in] state State of range
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_sed_lock_ioctl(struct tp_sed_handle *handle,
+				    unsigned long request,
+				    tp_sed_key_t const *key,
+				    tp_sed_lock_state_t state)
+{
+  struct opal_lock_unlock req; // ioctl data structure
+  tp_errno_t rc;
+  
+  /* check for NULL pointers */
+  if (handle == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  if (tp_sed_fill(&req, key, state))
+  {
+    rc = tp_errno;
+    explicit_bzero(&req, sizeof(req));
+    return tp_errno = rc;
+  }
+  
+  TP_DEBUG(1) printf("Kernel SED range %u, user %u, state %u\n",
+		     key->range, key->user, state);
+  rc = (ioctl(handle->fd, request, &req) != 0 ?
+	TP_ERR_SED_OPAL : TP_ERR_SUCCESS);
+  
+  /* don't leave keys lying about on the stack (plain memset of a dying
+   * local is optimized away) */
+  explicit_bzero(&req, sizeof(req));
+  return tp_errno = rc;
+}
+
+/**
+ * \brief Save Locking Range Key (OS Specific)
+ *
+ * Hand a locking range key to the kernel, which replays it to restore
+ * the range to the given state whenever the drive resumes from suspend.
+ *
+ * \param[in] handle Device handle
+ * \param[in] key Locking range credentials
+ * \param[in] state State to restore range to on resume
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_save(struct tp_sed_handle *handle, tp_sed_key_t const *key,
+		       tp_sed_lock_state_t state)
+{
+  return tp_sed_lock_ioctl(handle, IOC_OPAL_SAVE, key, state);
+}
+
+/**
+ * \brief Lock / Unlock Locking Range (OS Specific)
+ *
+ * Have the kernel open its own session and set the range state
+ *
+ * \param[in] handle Device handle
+ * \param[in] key Locking range credentials
+ * \param[in] state New state of range
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_sed_lock_unlock(struct tp_sed_handle *handle,
+			      tp_sed_key_t const *key,
+			      tp_sed_lock_state_t state)
+{
+  return tp_sed_lock_ioctl(handle, IOC_OPAL_LOCK_UNLOCK, key, state);
+}
@@ -30,25 +30,102 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <time.h>
 #include <string.h>
 #include <endian.h>
 #include <topaz/debug.h>
 #include <topaz/uid_swg.h>
 #include <topaz/swg_core.h>
+#include <topaz/transport.h>
 #include <topaz/transport_ata.h>
 #include <topaz/syntax.h>
+#include <topaz/trace.h>
 #include <topaz/debug.h>
 
 /* Pad to value to mutiple of another */
 #define TP_PAD_MULTIPLE(val, mult) (((val + (mult - 1)) / mult) * mult)
 
-// How often to poll the device for data (millisecs)
-#define POLL_MS 1
+// Busy poll window, before sleeping between polls (microsecs)
+#define POLL_SPIN_US 50
 
-// How long to wait before timeout thrown
+// Transfer size while polling for a response (bytes)
+#define POLL_XFER TP_ATA_BLOCK_SIZE
+
+// First and longest sleep between polls (microsecs)
+#define POLL_MIN_US 20
+#define POLL_MAX_US 20000
+
+// Bytes closing a method call (end of args, end of data, status list)
+#define CALL_TRAILER 7
+
+// Default time budget for a method call, before timeout thrown
 #define TIMEOUT_SECS 10
 
+// Default time a pooled session may sit idle, before being closed
+#define POOL_TTL_MS 30000
+
+/**
+ * \brief Send SWG comms already in place
+ *
+ * Fill in headers around a payload already sitting behind them in the I/O
+ * block, zero the padding, and send it off.
+ *
+ * \param[in,out] dev Target device for data payload
+ * \param[in] sub_size Size of payload
+ * \param[in] use_session_ids If non-zero, include current session IDs in transmission
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_send_io(tp_handle_t *dev, size_t sub_size,
+				 int use_session_ids)
+{
+  size_t pkt_size, com_size, tot_size;
+  tp_swg_header_t *header;
+  
+  /* Packet includes Sub Packet header */
+  pkt_size = sub_size + sizeof(tp_swg_sub_packet_header_t);
+  
+  /* .. and gets padded to a multiple of 4 bytes */
+  pkt_size = TP_PAD_MULTIPLE(pkt_size, 4);
+  
+  /* Com Packet includes Packet header */
+  com_size = pkt_size + sizeof(tp_swg_packet_header_t);
+  
+  /* Grand total include Com Packet header */
+  tot_size = com_size + sizeof(tp_swg_com_packet_header_t);
+  
+  // ... and gets padded to multiple of 512 bytes
+  tot_size = TP_PAD_MULTIPLE(tot_size, TP_ATA_BLOCK_SIZE);
+  
+  /* Make sure the drive can handle this data */
+  if ((tot_size > dev->max_com_pkt_size) || (tot_size > dev->io_block_size))
+  {
+    return tp_errno = TP_ERR_PACKET_SIZE;
+  }
+  
+  /* fill in headers, and clear out everything past the payload */
+  header = (tp_swg_header_t*)dev->io_block;
+  memset(header, 0, sizeof(tp_swg_header_t));
+  memset(dev->io_block + sizeof(tp_swg_header_t) + sub_size, 0,
+	 tot_size - sizeof(tp_swg_header_t) - sub_size);
+  header->com.com_id = htobe16(dev->com_id);
+  header->com.length = htobe32(com_size);
+  header->pkt.length = htobe32(pkt_size);
+  header->sub.length = htobe32(sub_size);
+  
+  /* if desired, include current session IDs?
+   * (not used for session manager) */
+  if (use_session_ids)
+  {
+    header->pkt.tper_session_id = htobe32(dev->tper_session_id);
+    header->pkt.host_session_id = htobe32(dev->host_session_id);
+  }
+  
+  return tp_if_send(dev, 1, dev->com_id, dev->io_block, tot_size);
+}
+
 /**
  * \brief Send payload via SWG comms
  *
@@ -62,126 +139,1102 @@
 tp_errno_t tp_swg_send(tp_handle_t *dev, tp_buffer_t const *payload,
 		       int use_session_ids)
 {
-  size_t sub_size, pkt_size, com_size, tot_size;
-  tp_swg_header_t *header;
-  
   /* check for NULL pointers */
   if ((dev == NULL) || (payload == NULL))
   {
     return tp_errno = TP_ERR_NULL;
   }
   
-  /* Sub Packet contains the actual payload data */
-  sub_size = payload->cur_len;
+  /* copy over payload data */
+  if (payload->cur_len > dev->io_block_size - sizeof(tp_swg_header_t))
+  {
+    return tp_errno = TP_ERR_PACKET_SIZE;
+  }
+  memmove(dev->io_block + sizeof(tp_swg_header_t),
+	  payload->ptr, payload->cur_len);
   
-  /* Packet includes Sub Packet header */
-  pkt_size = sub_size + sizeof(tp_swg_sub_packet_header_t);
+  return tp_swg_send_io(dev, payload->cur_len, use_session_ids);
+}
+
+/**
+ * \brief Sleep
+ *
+ * \param[in] ns Nanoseconds to sleep
+ */
+static void tp_swg_sleep(uint64_t ns)
+{
+  struct timespec delay;
   
-  /* .. and gets padded to a multiple of 4 bytes */
-  pkt_size = TP_PAD_MULTIPLE(pkt_size, 4);
+  delay.tv_sec = ns / 1000000000;
+  delay.tv_nsec = ns % 1000000000;
+  nanosleep(&delay, NULL);
+}
+
+/**
+ * \brief Find Latency Estimate
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] method_uid Method awaiting response
+ * \param[in] create Claim a slot if method not yet seen
+ * \return Latency entry, or NULL if method not yet seen
+ */
+static tp_latency_t *tp_swg_latency(tp_handle_t *dev, uint64_t method_uid,
+				    int create)
+{
+  tp_latency_t *lat;
+  unsigned int i;
   
-  /* Com Packet includes Packet header */
-  com_size = pkt_size + sizeof(tp_swg_packet_header_t);
+  for (i = 0; i < MAX_LATENCY_METHODS; i++)
+  {
+    if ((dev->latency[i].est_ns != 0) &&
+	(dev->latency[i].method_uid == method_uid))
+    {
+      return dev->latency + i;
+    }
+  }
+  if (!create)
+  {
+    return NULL;
+  }
   
-  /* Grand total include Com Packet header */
-  tot_size = com_size + sizeof(tp_swg_com_packet_header_t);
+  /* recycle slots in turn once full */
+  lat = dev->latency + dev->latency_next;
+  dev->latency_next = (dev->latency_next + 1) % MAX_LATENCY_METHODS;
+  lat->method_uid = method_uid;
+  lat->est_ns = 0;
+  return lat;
+}
+
+/**
+ * \brief Size Next ComPacket Transfer
+ *
+ * Work out how much to ask for to collect the ComPacket the TPer has
+ * waiting, per the header of the last ComPacket it sent.
+ *
+ * \param[in] dev Target drive
+ * \param[in] header Last ComPacket received
+ * \return Transfer size, in whole blocks
+ */
+static size_t tp_swg_xfer_size(tp_handle_t const *dev,
+			       tp_swg_header_t const *header)
+{
+  size_t xfer = be32toh(header->com.min_xfer);
   
-  // ... and gets padded to multiple of 512 bytes
-  tot_size = TP_PAD_MULTIPLE(tot_size, TP_ATA_BLOCK_SIZE);
+  /* not all TPers say, so take as much as we can */
+  if (xfer == 0)
+  {
+    xfer = dev->max_com_pkt_size;
+  }
+  return (xfer + TP_ATA_BLOCK_SIZE - 1) & ~(size_t)(TP_ATA_BLOCK_SIZE - 1);
+}
+
+/**
+ * \brief Make Room in I/O Block
+ *
+ * Grow I/O block of drive, keeping what has been received so far
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] len Minimum size of I/O block
+ * \param[in] keep Leading bytes of I/O block to preserve
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_grow_io(tp_handle_t *dev, size_t len, size_t keep)
+{
+  char *saved;
+  
+  if (len <= dev->io_block_size)
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* set aside, as growing may not preserve contents */
+  if ((saved = malloc(keep)) == NULL)
+  {
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  memcpy(saved, dev->io_block, keep);
+  if (tp_trans_alloc_io(dev, len))
+  {
+    free(saved);
+    return tp_errno;
+  }
+  memcpy(dev->io_block, saved, keep);
+  free(saved);
+  
+  return tp_errno = (dev->io_block_size < len ? TP_ERR_PACKET_SIZE :
+		     TP_ERR_SUCCESS);
+}
+
+/**
+ * \brief Poll Once for Response
+ *
+ * Ask TPer for a response, growing the transfer to fit, should it have one
+ * waiting that is larger than was asked for. ComPacket lands at the given
+ * offset into the I/O block, and anything before it is kept.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] offset Where in I/O block to receive ComPacket
+ * \param[in,out] xfer Transfer size
+ * \param[out] ready Non-zero if a response was collected into I/O block
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_poll_once(tp_handle_t *dev, size_t offset,
+				   size_t *xfer, int *ready)
+{
+  tp_swg_header_t *header;
+  
+  *ready = 0;
+  while (1)
+  {
+    /* Receive formatted Com Packet (into buffer from device handle) */
+    header = (tp_swg_header_t*)(dev->io_block + offset);
+    memset(header, 0, sizeof(tp_swg_header_t));
+    if (tp_if_recv(dev, 1, dev->com_id, header, *xfer))
+    {
+      return tp_errno;
+    }
+    
+    /* Do some cursory verification here */
+    if (be16toh(header->com.com_id) != dev->com_id)
+    {
+      /* tp_debug_dump(dev->io_block, dev->io_block_size); */
+      return tp_errno = TP_ERR_BAD_COMID;
+    }
+    if (be32toh(header->com.length) > *xfer - sizeof(header->com))
+    {
+      return tp_errno = TP_ERR_PACKET_SIZE;
+    }
+    if (be32toh(header->com.length) != 0)
+    {
+      *ready = 1;
+      return tp_errno = TP_ERR_SUCCESS;
+    }
+    
+    /* Response is ready, but larger than we asked for */
+    if ((be32toh(header->com.tper_left) != 0) &&
+	(tp_swg_xfer_size(dev, header) > *xfer))
+    {
+      *xfer = tp_swg_xfer_size(dev, header);
+      if (tp_swg_grow_io(dev, offset + *xfer, offset))
+      {
+	return tp_errno;
+      }
+      continue;
+    }
+    
+    /* Response is not yet ready */
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+}
+
+/**
+ * \brief Wait for ComPacket
+ *
+ * Poll until the TPer has a ComPacket for us, busy polling for a short
+ * window, then sleeping for exponentially longer between polls.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] offset Where in I/O block to receive ComPacket
+ * \param[in,out] xfer Transfer size
+ * \param[in] deadline Give up after this
+ * \param[in] delay First sleep between polls (ns)
+ * \param[out] last_empty When TPer last had nothing ready
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_wait(tp_handle_t *dev, size_t offset, size_t *xfer,
+			      uint64_t deadline, uint64_t delay,
+			      uint64_t *last_empty)
+{
+  uint64_t now, spin_end = tp_trace_now() + POLL_SPIN_US * 1000;
+  int ready;
+  
+  /* if still processing, drive may respond with "no data yet" */
+  while (1)
+  {
+    if (tp_swg_poll_once(dev, offset, xfer, &ready))
+    {
+      return tp_errno;
+    }
+    if (ready)
+    {
+      return tp_errno = TP_ERR_SUCCESS;
+    }
+    
+    /* Response is not yet ready ... check for timeout */
+    now = tp_trace_now();
+    *last_empty = now;
+    if (now >= deadline)
+    {
+      return tp_errno = TP_ERR_TIMEOUT;
+    }
+    
+    /* spin a little, then back off (no further than deadline) */
+    if (now >= spin_end)
+    {
+      tp_swg_sleep(now + delay > deadline ? deadline - now : delay);
+      delay = (delay * 2 > POLL_MAX_US * 1000 ? POLL_MAX_US * 1000 : delay * 2);
+    }
+  }
+}
+
+/**
+ * \brief Learn Method Latency
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] method_uid Method that was awaiting response
+ * \param[in] start When request was sent
+ * \param[in] last_empty When TPer last had no response ready
+ */
+static void tp_swg_learn(tp_handle_t *dev, uint64_t method_uid,
+			 uint64_t start, uint64_t last_empty)
+{
+  uint64_t now, sample;
+  tp_latency_t *lat;
+  
+  /* response turned up somewhere between the last two polls */
+  now = tp_trace_now();
+  sample = (last_empty + now) / 2 - start;
+  lat = tp_swg_latency(dev, method_uid, 1);
+  lat->est_ns = (lat->est_ns == 0 ? sample :
+		 lat->est_ns - lat->est_ns / 8 + sample / 8);
+  if (lat->est_ns == 0)
+  {
+    lat->est_ns = 1;
+  }
+  TP_DEBUG(4) printf("Response after %lluus, expect %lluus next time\n",
+		     (unsigned long long)(now - start) / 1000,
+		     (unsigned long long)lat->est_ns / 1000);
+}
+
+/**
+ * \brief Gather Response
+ *
+ * With the first ComPacket of a response in the I/O block, collect any
+ * remaining ComPackets, appending their data to the first. Keeps going
+ * until all the data the first ComPacket said was outstanding has arrived,
+ * and the TPer has no more, waiting out any empty ComPackets in between.
+ *
+ * \param[out] payload Buffer describing data received
+ * \param[in,out] dev Target drive
+ * \param[in] first Transfer size of first ComPacket
+ * \param[in] deadline Give up on remaining ComPackets after this
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_gather(tp_buffer_t *payload, tp_handle_t *dev,
+				size_t first, uint64_t deadline)
+{
+  tp_swg_header_t *header = (tp_swg_header_t*)dev->io_block, last;
+  size_t xfer, got, left, took, sub_len;
+  uint64_t last_empty;
+  char *next;
+  
+  /* outstanding data (padding and all) comes with a header of its own */
+  got = be32toh(header->sub.length);
+  if (got > first - sizeof(tp_swg_header_t))
+  {
+    return tp_errno = TP_ERR_PACKET_SIZE;
+  }
+  left = be32toh(header->com.tper_left);
+  left = (left > sizeof(tp_swg_header_t) ?
+	  left - sizeof(tp_swg_header_t) : 0);
+  memcpy(&last, header, sizeof(last));
+  while ((left != 0) || (be32toh(last.com.tper_left) != 0))
+  {
+    xfer = tp_swg_xfer_size(dev, &last);
+    if (tp_swg_grow_io(dev, sizeof(tp_swg_header_t) + got + xfer,
+		       sizeof(tp_swg_header_t) + got))
+    {
+      return tp_errno;
+    }
+    
+    /* empty ComPacket just means the rest isn't ready yet */
+    if (tp_swg_wait(dev, sizeof(tp_swg_header_t) + got, &xfer, deadline,
+		    POLL_MIN_US * 1000, &last_empty))
+    {
+      return tp_errno;
+    }
+    next = dev->io_block + sizeof(tp_swg_header_t) + got;
+    memcpy(&last, next, sizeof(last));
+    
+    /* slide data down over its own header */
+    sub_len = be32toh(last.sub.length);
+    if (sub_len > xfer - sizeof(tp_swg_header_t))
+    {
+      return tp_errno = TP_ERR_PACKET_SIZE;
+    }
+    memmove(next, next + sizeof(tp_swg_header_t), sub_len);
+    got += sub_len;
+    
+    /* count everything past the headers against what was announced */
+    took = be32toh(last.com.length) + sizeof(tp_swg_com_packet_header_t);
+    took = (took > sizeof(tp_swg_header_t) ?
+	    took - sizeof(tp_swg_header_t) : 0);
+    left = (took < left ? left - took : 0);
+  }
+  
+  /* Ready the receiver buffer */
+  memset(payload, 0, sizeof(tp_buffer_t));
+  payload->ptr = dev->io_block + sizeof(tp_swg_header_t);
+  payload->cur_len = got;
+  payload->max_len = got;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Receive payload via SWG comms, paced for method
+ *
+ * Poll for response, first waiting out most of the latency seen before
+ * from this method, then busy polling for a short window, then sleeping
+ * for exponentially longer between polls. Latency is learned as we go.
+ *
+ * Polls only ask for a single block. Once the TPer says how much it has
+ * waiting, exactly that much is collected, and responses spanning more
+ * than one ComPacket are reassembled into a single payload.
+ *
+ * \param[out] payload Buffer describing data to transmit
+ * \param[in] dev Target device for data payload
+ * \param[in] method_uid Method awaiting response (TP_SWG_NULL if none)
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_poll(tp_buffer_t *payload, tp_handle_t *dev,
+			      uint64_t method_uid)
+{
+  uint64_t start, deadline, delay, last_empty;
+  size_t xfer = POLL_XFER;
+  tp_latency_t *lat;
+  
+  /* check for NULL pointers */
+  if ((dev == NULL) || (payload == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+
+  start = tp_trace_now();
+  deadline = (dev->deadline != 0 ? dev->deadline :
+	      tp_swg_deadline(dev->timeout_ms ? dev->timeout_ms :
+			      TIMEOUT_SECS * 1000));
+  last_empty = start;
+  
+  /* no point asking before the TPer usually has an answer */
+  lat = tp_swg_latency(dev, method_uid, 0);
+  delay = POLL_MIN_US * 1000;
+  if ((lat != NULL) && (lat->est_ns > POLL_SPIN_US * 1000) &&
+      (start + lat->est_ns < deadline))
+  {
+    tp_swg_sleep(lat->est_ns - lat->est_ns / 8);
+    delay = (lat->est_ns / 16 > delay ? lat->est_ns / 16 : delay);
+  }
+  
+  if (tp_swg_wait(dev, 0, &xfer, deadline, delay, &last_empty))
+  {
+    return tp_errno;
+  }
+  tp_swg_learn(dev, method_uid, start, last_empty);
+  return tp_swg_gather(payload, dev, xfer, deadline);
+}
+
+/**
+ * \brief Receive payload via SWG comms
+ *
+ * Receive data from Trusted Peripheral (TPer) in target device to payload buffer.
+ *
+ * \param[out] payload Buffer describing data to transmit
+ * \param[in] dev Target device for data payload
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_recv(tp_buffer_t *payload, tp_handle_t *dev)
+{
+  return tp_swg_poll(payload, dev, TP_SWG_NULL);
+}
+
+/**
+ * \brief Compute Deadline
+ *
+ * \param[in] timeout_ms Time budget from now, in milliseconds
+ * \return Absolute deadline, for use with tp_swg_invoke_ex()
+ */
+uint64_t tp_swg_deadline(unsigned int timeout_ms)
+{
+  return tp_trace_now() + (uint64_t)timeout_ms * 1000000;
+}
+
+/**
+ * \brief Set Default Timeout
+ *
+ * Set time budget of method calls on drive not given an explicit deadline
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] timeout_ms Time budget in milliseconds, or 0 for library default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_set_timeout(tp_handle_t *dev, unsigned int timeout_ms)
+{
+  /* check for NULL pointers */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  dev->timeout_ms = timeout_ms;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Prefix Transaction Start
+ *
+ * If a transaction has been started on session, but not yet sent, add
+ * StartTransaction to head of method call(s) about to go out. It only
+ * counts as sent once tp_swg_trans_sent() says so.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] call Method call stream being built
+ * \param[in] obj_uid UID of object for (first) method call
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_trans_prefix(tp_handle_t *dev, tp_buffer_t *call,
+				      uint64_t obj_uid)
+{
+  if ((dev->txn_state != TP_TXN_PENDING) || (obj_uid == TP_SWG_SMUID))
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  if ((tp_buf_add_byte(call, TP_SWG_START_TRANS)) ||
+      (tp_syn_enc_uint(call, 0)))
+  {
+    return tp_errno;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Note Transaction Start Sent
+ *
+ * Once method call(s) prefixed by tp_swg_trans_prefix() are safely out,
+ * expect StartTransaction status at the head of the response. Until then
+ * transaction stays pending, so a call that fails to encode or send
+ * leaves it for the next.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] obj_uid UID of object for (first) method call
+ */
+static void tp_swg_trans_sent(tp_handle_t *dev, uint64_t obj_uid)
+{
+  if ((dev->txn_state == TP_TXN_PENDING) && (obj_uid != TP_SWG_SMUID))
+  {
+    dev->txn_state = TP_TXN_SENT;
+  }
+}
+
+/**
+ * \brief Check Transaction Start
+ *
+ * If StartTransaction went out with method call(s), strip its status
+ * from the head of the response
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] work Response to method call(s)
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_trans_ack(tp_handle_t *dev, tp_buffer_t *work)
+{
+  uint64_t status;
+  
+  if (dev->txn_state != TP_TXN_SENT)
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* not open, unless TPer says so */
+  dev->txn_state = TP_TXN_NONE;
+  work->parse_idx = 0;
+  if ((tp_syn_dec_byte(work, TP_SWG_START_TRANS)) ||
+      (tp_syn_dec_uint(&status, work)) ||
+      (tp_buf_trim_left(work, work->parse_idx)))
+  {
+    return tp_errno = TP_ERR_MALFORMED;
+  }
+  if (status != 0)
+  {
+    return tp_errno = TP_ERR_CALL_TRANSATION_FAILURE;
+  }
+  dev->txn_state = TP_TXN_OPEN;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Start Transaction
+ *
+ * Start transaction on current session. Nothing is sent until the next
+ * method call (or batch), which then carries StartTransaction with it.
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_start(tp_handle_t *dev)
+{
+  /* check for NULL pointers */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* needs a session, and no nesting */
+  if ((dev->host_session_id == 0) || (dev->txn_state != TP_TXN_NONE))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  dev->txn_state = TP_TXN_PENDING;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief End Transaction
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] commit Nonzero to commit, zero to abort
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_trans_end(tp_handle_t *dev, int commit)
+{
+  tp_buffer_t buf;
+  uint64_t status;
+  char raw[16];
+  
+  /* check for NULL pointers */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* nothing went out yet, nothing to do */
+  if (dev->txn_state == TP_TXN_PENDING)
+  {
+    dev->txn_state = TP_TXN_NONE;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  if (dev->txn_state != TP_TXN_OPEN)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* EndTransaction, with status saying which way to go */
+  memset(&buf, 0, sizeof(buf));
+  buf.ptr = raw;
+  buf.max_len = sizeof(raw);
+  if ((tp_buf_add_byte(&buf, TP_SWG_END_TRANS)) ||
+      (tp_syn_enc_uint(&buf, (commit ? 0 : 1))) ||
+      (tp_swg_send(dev, &buf, 1)) ||
+      (tp_swg_recv(&buf, dev)))
+  {
+    return tp_errno;
+  }
+  dev->txn_state = TP_TXN_NONE;
+  
+  /* TPer answers in kind, with how it went */
+  if ((tp_syn_dec_byte(&buf, TP_SWG_END_TRANS)) ||
+      (tp_syn_dec_uint(&status, &buf)))
+  {
+    return tp_errno = TP_ERR_MALFORMED;
+  }
+  if ((commit) && (status != 0))
+  {
+    return tp_errno = TP_ERR_CALL_TRANSATION_FAILURE;
+  }
+  
+  TP_DEBUG(1) printf("Transaction %s\n", (commit ? "committed" : "aborted"));
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Commit Transaction
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_commit(tp_handle_t *dev)
+{
+  return tp_swg_trans_end(dev, 1);
+}
+
+/**
+ * \brief Abort Transaction
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_trans_abort(tp_handle_t *dev)
+{
+  return tp_swg_trans_end(dev, 0);
+}
+
+/**
+ * \brief Begin Method Call
+ *
+ * Start building a method call directly in the I/O block of the drive,
+ * behind space reserved for the ComPacket headers. On return, args is
+ * positioned where the method arguments go, so they can be encoded in
+ * place. Finish with tp_swg_call_commit(). Any other I/O to the drive in
+ * between discards the call. Fails while a call posted with
+ * tp_swg_call_post() is still outstanding.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] args Buffer to encode method arguments into
+ * \param[in] obj_uid UID of object for method call
+ * \param[in] method_uid UID of method to call
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_begin(tp_handle_t *dev, tp_buffer_t *args,
+			     uint64_t obj_uid, uint64_t method_uid)
+{
+  tp_buffer_t call;
+  size_t limit;
+  
+  /* check for NULL pointers */
+  if ((dev == NULL) || (args == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* one at a time, posted call still owns the I/O block */
+  if (dev->call_posted)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* all of it must fit in one ComPacket */
+  limit = (dev->io_block_size < dev->max_com_pkt_size ?
+	   dev->io_block_size : dev->max_com_pkt_size);
+  if (limit < sizeof(tp_swg_header_t) + CALL_TRAILER)
+  {
+    return tp_errno = TP_ERR_PACKET_SIZE;
+  }
+  memset(&call, 0, sizeof(call));
+  call.ptr = dev->io_block + sizeof(tp_swg_header_t);
+  call.max_len = limit - sizeof(tp_swg_header_t) - CALL_TRAILER;
+  
+  /* transaction rides along with first call in session */
+  if ((tp_swg_trans_prefix(dev, &call, obj_uid)) ||
+      
+      /* method invocation, up to the start of the argument list */
+      (tp_buf_add_byte(&call, TP_SWG_CALL)) ||
+      (tp_syn_enc_uid(&call, obj_uid)) ||
+      (tp_syn_enc_uid(&call, method_uid)) ||
+      (tp_buf_add_byte(&call, TP_SWG_START_LIST)))
+  {
+    return tp_errno;
+  }
+  dev->call_obj_uid = obj_uid;
+  dev->call_method_uid = method_uid;
+  
+  /* arguments follow */
+  memset(args, 0, sizeof(tp_buffer_t));
+  args->byte_ptr = call.byte_ptr + call.cur_len;
+  args->max_len = call.max_len - call.cur_len;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Check for CloseSession
+ *
+ * \param[in] work Response from drive
+ * \return Non-zero if response is TPer closing session on host
+ */
+static int tp_swg_closed(tp_buffer_t const *work)
+{
+  tp_buffer_t sig = *work;
+  uint64_t obj_uid, method_uid;
+  
+  sig.parse_idx = 0;
+  return ((tp_syn_dec_byte(&sig, TP_SWG_CALL) == 0) &&
+	  (tp_syn_dec_uid(&obj_uid, &sig) == 0) &&
+	  (tp_syn_dec_uid(&method_uid, &sig) == 0) &&
+	  (obj_uid == TP_SWG_SMUID) &&
+	  (method_uid == TP_SWG_CLOSE_SESSION));
+}
+
+/**
+ * \brief Check for Session Closed by TPer
+ *
+ * TPer may answer with CloseSession, if it has dropped our session, in
+ * which case there is no session left to end
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] work Response from drive
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_check_closed(tp_handle_t *dev,
+				      tp_buffer_t const *work)
+{
+  if (tp_swg_closed(work))
+  {
+    TP_DEBUG(1) printf("Session %x:%x Closed by TPer\n",
+		       dev->tper_session_id,
+		       dev->host_session_id);
+    tp_swg_session_forget(dev);
+    return tp_errno = TP_ERR_SESSION_ABORTED;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Check Method Call Result
+ *
+ * Check status of response to method call, now sitting in the I/O block
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] work Response received
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_call_result(tp_handle_t *dev, tp_buffer_t *work,
+				     tp_buffer_t *response)
+{
+  uint8_t call_status;
+  
+  /* debug for the curious */
+  TP_DEBUG(3) {
+    printf("SWG RX:");
+    tp_syn_print(work);
+    printf("\n");
+    work->parse_idx = 0;
+  }
+  
+  /* NOTE - work->ptr now points within dev->io_block via tp_swg_recv() */
+  
+  /* TPer may answer with CloseSession, if it has dropped our session */
+  if (tp_swg_check_closed(dev, work))
+  {
+    return tp_errno;
+  }
+  
+  /* transaction start, if it went out with call */
+  if (tp_swg_trans_ack(dev, work))
+  {
+    return tp_errno;
+  }
+  
+  /* skip method signature, if present (session manager stuff) */
+  if (work->byte_ptr[0] == 0xf8)
+  {
+    /* remove leading 19 bytes from buffer */
+    if (tp_buf_trim_left(work, 19))
+    {
+      return tp_errno;
+    }
+  }
+  
+  /* last 5 bytes contain method status code */
+  call_status = work->byte_ptr[work->cur_len - 4];
+  if (call_status)
+  {
+    /* convert to appropriate error code */
+    return tp_errno = (TP_ERR_CALL_SUCCESS + call_status);
+  }
+  
+  /* if response is wanted, extract from remaining bytes */
+  if (response)
+  {
+    if ((tp_buf_trim_left(work, 1)) ||
+	(tp_buf_trim_right(work, 7)))
+    {
+      return tp_errno;
+    }
+    
+    /* set up return buffer */
+    response->byte_ptr = work->byte_ptr + work->parse_idx;
+    response->cur_len = work->cur_len - work->parse_idx;
+    response->max_len = response->cur_len;
+    response->parse_idx = 0;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Finish Method Call
+ *
+ * Collect response to method call sent to drive, and check its status
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] method_uid UID of method called
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_call_finish(tp_handle_t *dev, tp_buffer_t *response,
+				     uint64_t method_uid)
+{
+  tp_buffer_t work;
+  
+  if (tp_swg_poll(&work, dev, method_uid))
+  {
+    return tp_errno;
+  }
+  return tp_swg_call_result(dev, &work, response);
+}
+
+/**
+ * \brief Send Method Call
+ *
+ * Close out method call begun with tp_swg_call_begin(), and send it. The
+ * deadline of the call is left set on the drive.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] args Arguments encoded in place, from tp_swg_call_begin()
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_call_send(tp_handle_t *dev, tp_buffer_t const *args,
+				   uint64_t deadline)
+{
+  tp_buffer_t call;
+  
+  /* whole call, from the top (trailer space was held back) */
+  memset(&call, 0, sizeof(call));
+  call.ptr = dev->io_block + sizeof(tp_swg_header_t);
+  call.cur_len = (args->byte_ptr - call.byte_ptr) + args->cur_len;
+  call.max_len = call.cur_len + CALL_TRAILER;
+  
+  /* end of arguments, and nominal method status (list of three zeros) */
+  if ((tp_buf_add_byte(&call, TP_SWG_END_LIST)) ||
+      (tp_buf_add_byte(&call, TP_SWG_END_OF_DATA)) ||
+      (tp_buf_add_byte(&call, TP_SWG_START_LIST)) ||
+      (tp_syn_enc_uint(&call, 0)) ||
+      (tp_syn_enc_uint(&call, 0)) ||
+      (tp_syn_enc_uint(&call, 0)) ||
+      (tp_buf_add_byte(&call, TP_SWG_END_LIST)))
+  {
+    return tp_errno;
+  }
+  
+  /* debug for the curious */
+  TP_DEBUG(3) {
+    printf("SWG TX:");
+    tp_syn_print(&call);
+    printf("\n");
+  }
+  
+  /* budget for entire call, send through response */
+  if (deadline == 0)
+  {
+    deadline = tp_swg_deadline(dev->timeout_ms ? dev->timeout_ms :
+			       TIMEOUT_SECS * 1000);
+  }
+  dev->deadline = deadline;
+  
+  /* off it goes, session ID's with everything but session manager */
+  if (tp_swg_send_io(dev, call.cur_len,
+		     (dev->call_obj_uid == TP_SWG_SMUID ? 0 : 1)))
+  {
+    return tp_errno;
+  }
+  tp_swg_trans_sent(dev, dev->call_obj_uid);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Commit Method Call
+ *
+ * Close out method call begun with tp_swg_call_begin(), send it, and wait
+ * for the response, failing with TP_ERR_TIMEOUT if it has not arrived by
+ * deadline.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] args Arguments encoded in place, from tp_swg_call_begin()
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_commit(tp_handle_t *dev, tp_buffer_t *response,
+			      tp_buffer_t const *args, uint64_t deadline)
+{
+  tp_errno_t rc;
+  
+  /* check for NULL pointers */
+  if ((dev == NULL) || (args == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  rc = tp_swg_call_send(dev, args, deadline);
+  if (rc == TP_ERR_SUCCESS)
+  {
+    rc = tp_swg_call_finish(dev, response, dev->call_method_uid);
+  }
+  dev->deadline = 0;
+  
+  return tp_errno = rc;
+}
+
+/**
+ * \brief Post Method Call
+ *
+ * Close out method call begun with tp_swg_call_begin(), and send it
+ * without waiting for the response. Collect it later with
+ * tp_swg_call_reap() or tp_swg_call_wait_any(). Only one call may be
+ * outstanding per drive handle (ComID), so to have several in flight at
+ * once, post them on separate channels or handles. Any other I/O to the
+ * drive before the response is collected discards the call.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] args Arguments encoded in place, from tp_swg_call_begin()
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_call_post(tp_handle_t *dev, tp_buffer_t const *args,
+			    uint64_t deadline)
+{
+  /* check for NULL pointers */
+  if ((dev == NULL) || (args == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  if (tp_swg_call_send(dev, args, deadline))
+  {
+    dev->deadline = 0;
+    return tp_errno;
+  }
+  dev->call_posted = 1;
+  dev->call_sent = tp_trace_now();
+  dev->call_polled = dev->call_sent;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Reap Method Call
+ *
+ * Check once, without waiting, for the response to a call posted with
+ * tp_swg_call_post(). The drive is not even asked until most of the
+ * latency seen before from the method has passed.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[out] done Set non-zero once call is finished (either way)
+ * \return 0 on success (or still in flight), error code indicating failure
+ */
+tp_errno_t tp_swg_call_reap(tp_handle_t *dev, tp_buffer_t *response,
+			    int *done)
+{
+  size_t xfer = POLL_XFER;
+  tp_buffer_t work;
+  tp_latency_t *lat;
+  uint64_t now;
+  tp_errno_t rc;
+  int ready;
   
-  /* Make sure the drive can handle this data */
-  if (tot_size > dev->max_com_pkt_size)
+  /* check for NULL pointers */
+  if ((dev == NULL) || (done == NULL))
   {
-    return tp_errno = TP_ERR_PACKET_SIZE;
+    return tp_errno = TP_ERR_NULL;
   }
   
-  /* using the buffer from device handle */
-  memset(dev->io_block, 0, sizeof(dev->io_block));
-  header = (tp_swg_header_t*)dev->io_block;
+  /* must be something to collect */
+  *done = 0;
+  if (!dev->call_posted)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
   
-  /* fill in headers */
-  header->com.com_id = htobe16(dev->com_id);
-  header->com.length = htobe32(com_size);
-  header->pkt.length = htobe32(pkt_size);
-  header->sub.length = htobe32(sub_size);
+  /* too early to bother asking */
+  now = tp_trace_now();
+  lat = tp_swg_latency(dev, dev->call_method_uid, 0);
+  if ((lat != NULL) && (now < dev->call_sent + lat->est_ns - lat->est_ns / 8) &&
+      (now < dev->deadline))
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
   
-  /* if desired, include current session IDs?
-   * (not used for session manager) */
-  if (use_session_ids)
+  /* ask */
+  rc = tp_swg_poll_once(dev, 0, &xfer, &ready);
+  if ((rc == TP_ERR_SUCCESS) && (!ready))
   {
-    header->pkt.tper_session_id = htobe32(dev->tper_session_id);
-    header->pkt.host_session_id = htobe32(dev->host_session_id);
+    dev->call_polled = tp_trace_now();
+    if (dev->call_polled < dev->deadline)
+    {
+      return tp_errno = TP_ERR_SUCCESS;
+    }
+    rc = TP_ERR_TIMEOUT;
   }
   
-  /* copy over payload data */
-  memcpy(dev->io_block + sizeof(tp_swg_header_t),
-	 payload->ptr, payload->cur_len);
+  /* collect (rest of) response, and check it */
+  if (rc == TP_ERR_SUCCESS)
+  {
+    tp_swg_learn(dev, dev->call_method_uid, dev->call_sent, dev->call_polled);
+    rc = tp_swg_gather(&work, dev, xfer, dev->deadline);
+  }
+  if (rc == TP_ERR_SUCCESS)
+  {
+    rc = tp_swg_call_result(dev, &work, response);
+  }
   
-  return tp_ata_if_send(dev->ata, 1, dev->com_id,
-			dev->io_block, tot_size / TP_ATA_BLOCK_SIZE);
+  dev->call_posted = 0;
+  dev->deadline = 0;
+  *done = 1;
+  return tp_errno = rc;
 }
 
 /**
- * \brief Receive payload via SWG comms
+ * \brief Wait for Any Method Call
  *
- * Receive data from Trusted Peripheral (TPer) in target device to payload buffer.
+ * Wait for the first of the calls posted on several drive handles to
+ * finish, and collect it, so slow methods on one handle do not hold up
+ * calls on the others. Handles with nothing posted are skipped.
  *
- * \param[out] payload Buffer describing data to transmit
- * \param[in] dev Target device for data payload
- * \return 0 on success, error code indicating failure
+ * \param[in,out] devs Drive handles (e.g. channels of one drive)
+ * \param[in] count Number of drive handles
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[out] which Index of drive handle whose call finished
+ * \return Status of finished call, or error code indicating failure
  */
-tp_errno_t tp_swg_recv(tp_buffer_t *payload, tp_handle_t *dev)
+tp_errno_t tp_swg_call_wait_any(tp_handle_t **devs, unsigned int count,
+				tp_buffer_t *response, unsigned int *which)
 {
-  /* Maximum poll attempts before timeout */
-  int max_iters = (TIMEOUT_SECS * 1000) / POLL_MS;
-  tp_swg_header_t *header;
+  uint64_t spin_end, delay, now, deadline;
+  unsigned int i, posted;
+  int done;
   
   /* check for NULL pointers */
-  if ((dev == NULL) || (payload == NULL))
+  if ((devs == NULL) || (which == NULL))
   {
     return tp_errno = TP_ERR_NULL;
   }
-
-  /* using the buffer from device handle */
-  memset(dev->io_block, 0, sizeof(dev->io_block));
-  header = (tp_swg_header_t*)dev->io_block;
   
-  /* if still processing, drive may respond with "no data yet" */
-  do
+  spin_end = tp_trace_now() + POLL_SPIN_US * 1000;
+  delay = POLL_MIN_US * 1000;
+  while (1)
   {
-    /* Receive formatted Com Packet */
-    if (tp_ata_if_recv(dev->ata, 1, dev->com_id, dev->io_block,
-		       dev->max_com_pkt_size / TP_ATA_BLOCK_SIZE))
+    /* sweep everything in flight */
+    deadline = UINT64_MAX;
+    for (i = 0, posted = 0; i < count; i++)
     {
-      return tp_errno;
+      if ((devs[i] == NULL) || (!devs[i]->call_posted))
+      {
+	continue;
+      }
+      posted++;
+      if ((tp_swg_call_reap(devs[i], response, &done)) || (done))
+      {
+	*which = i;
+	return tp_errno;
+      }
+      deadline = (devs[i]->deadline < deadline ? devs[i]->deadline : deadline);
     }
-    
-    /* Do some cursory verification here */
-    if (be16toh(header->com.com_id) != dev->com_id)
+    if (posted == 0)
     {
-      /* tp_debug_dump(dev->io_block, sizeof(dev->io_block)); */
-      return tp_errno = TP_ERR_BAD_COMID;
+      return tp_errno = TP_ERR_INVALID;
     }
-    if (be32toh(header->com.length) == 0)
+    
+    /* spin a little, then back off (no further than nearest deadline) */
+    now = tp_trace_now();
+    if ((now >= spin_end) && (now < deadline))
     {
-      /* Response is not yet ready ... wait a bit and try again */
-      usleep(POLL_MS * 1000);
+      tp_swg_sleep(now + delay > deadline ? deadline - now : delay);
+      delay = (delay * 2 > POLL_MAX_US * 1000 ? POLL_MAX_US * 1000 : delay * 2);
     }
-  } while ((be32toh(header->com.length) == 0) && (--max_iters > 0));
-  
-  /* Check for timeout */
-  if (max_iters == 0)
-  {
-    return tp_errno = TP_ERR_TIMEOUT;
   }
-  
-  /* Ready the receiver buffer */
-  memset(payload, 0, sizeof(tp_buffer_t));
-  payload->ptr = dev->io_block + sizeof(tp_swg_header_t);
-  payload->cur_len = be32toh(header->sub.length);
-  payload->max_len = be32toh(header->sub.length);
-  
-  return tp_errno = TP_ERR_SUCCESS;
 }
 
 /**
@@ -200,47 +1253,215 @@ tp_errno_t tp_swg_invoke(tp_handle_t *dev, tp_buffer_t *response,
 			 uint64_t obj_uid, uint64_t method_uid,
 			 tp_buffer_t const *args)
 {
-  int use_session_ids;
-  uint8_t call_status;
-  tp_buffer_t work;
-  char work_raw[MAX_IO_BLOCK];
+  return tp_swg_invoke_ex(dev, response, obj_uid, method_uid, args, 0);
+}
+
+/**
+ * \brief Invoke Method, with Deadline
+ *
+ * Invoke method in SWG communication stream upon object, failing with
+ * TP_ERR_TIMEOUT if the response has not arrived by deadline. Deadline
+ * also bounds the OS timeout of each transfer to the drive.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] obj_uid UID of object for method call
+ * \param[in] method_uid UID of method to call
+ * \param[in] args Encoded arguments to pass to method (or NULL for none)
+ * \param[in] deadline From tp_swg_deadline(), or 0 for drive default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_invoke_ex(tp_handle_t *dev, tp_buffer_t *response,
+			    uint64_t obj_uid, uint64_t method_uid,
+			    tp_buffer_t const *args, uint64_t deadline)
+{
+  tp_buffer_t call_args;
+  
+  if ((tp_swg_call_begin(dev, &call_args, obj_uid, method_uid)) ||
+      ((args != NULL) && (tp_buf_add_buf(&call_args, args))))
+  {
+    return tp_errno;
+  }
+  return tp_swg_call_commit(dev, response, &call_args, deadline);
+}
+
+/**
+ * \brief Skip Encoded Item
+ *
+ * Step parser past one atom, or one complete list / named value
+ *
+ * \param[in,out] buf Buffer being parsed
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_skip(tp_buffer_t *buf)
+{
+  tp_syn_atom_info_t info;
+  int depth = 0;
+  uint8_t next;
+  
+  do
+  {
+    if (tp_buf_peek(&next, buf))
+    {
+      return tp_errno;
+    }
+    if ((next == TP_SWG_START_LIST) || (next == TP_SWG_START_NAME))
+    {
+      depth++;
+      buf->parse_idx++;
+    }
+    else if ((next == TP_SWG_END_LIST) || (next == TP_SWG_END_NAME))
+    {
+      depth--;
+      buf->parse_idx++;
+    }
+    else if (next >= TP_SWG_CALL)
+    {
+      /* no control tokens inside return values */
+      return tp_errno = TP_ERR_SYNTAX;
+    }
+    else if (tp_syn_dec_atom_header(&info, buf))
+    {
+      return tp_errno;
+    }
+    else if (info.header_bytes + info.data_bytes >
+	     buf->cur_len - buf->parse_idx)
+    {
+      return tp_errno = TP_ERR_BUFFER_END;
+    }
+    else
+    {
+      buf->parse_idx += info.header_bytes + info.data_bytes;
+    }
+  } while (depth > 0);
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Invoke Batch of Methods
+ *
+ * Send several independent method calls within the current session in a
+ * single ComPacket, and sort out the results of each from the response.
+ * As many calls are sent as the drive allows in one go (MaxMethods, and
+ * MaxComPacketSize), which may be fewer than requested. Results point
+ * within the I/O block of the drive, and are valid until its next I/O.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] batch Method calls, results and statuses filled in
+ * \param[in] count Number of method calls in batch
+ * \param[out] sent Number of leading method calls actually invoked
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_invoke_batch(tp_handle_t *dev, tp_swg_batch_t *batch,
+			       unsigned int count, unsigned int *sent)
+{
+  tp_buffer_t call, work;
+  uint64_t status, reserved;
+  unsigned int i, max;
+  size_t mark, end;
+  tp_errno_t rc;
   
   /* check for NULL pointers */
-  if (dev == NULL)
+  if ((dev == NULL) || (batch == NULL) || (sent == NULL))
   {
     return tp_errno = TP_ERR_NULL;
   }
+  *sent = 0;
+  if (count == 0)
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
   
-  /* set up static buffer */
-  memset(work_raw, 0, sizeof(work_raw));
-  memset(&work, 0, sizeof(work));
-  work.ptr = work_raw;
-  work.max_len = sizeof(work_raw);
+  /* posted call still owns the I/O block */
+  if (dev->call_posted)
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
   
-  /* session ID's with everything but session manager */
-  use_session_ids = (obj_uid == TP_SWG_SMUID ? 0 : 1);
+  /* all of it must fit in one ComPacket */
+  memset(&call, 0, sizeof(call));
+  call.ptr = dev->io_block + sizeof(tp_swg_header_t);
+  call.max_len = (dev->io_block_size < dev->max_com_pkt_size ?
+		  dev->io_block_size : dev->max_com_pkt_size);
   
-  /* encode method, and perform I/O */
-  if (tp_syn_enc_method(&work, obj_uid, method_uid, args))
+  /* ComPacket goes out in whole blocks, and sub packet is padded to 4 */
+  call.max_len &= ~(size_t)(TP_ATA_BLOCK_SIZE - 1);
+  call.max_len = (call.max_len - sizeof(tp_swg_header_t)) & ~(size_t)3;
+  
+  /* transaction rides along, if one was started */
+  if (tp_swg_trans_prefix(dev, &call, batch[0].obj_uid))
   {
     return tp_errno;
   }
   
+  /* pack in as many calls as fit */
+  max = (count < dev->max_methods ? count : dev->max_methods);
+  for (i = 0; i < max; i++)
+  {
+    /* session manager calls can't share a session's packet */
+    if (batch[i].obj_uid == TP_SWG_SMUID)
+    {
+      return tp_errno = TP_ERR_INVALID;
+    }
+    
+    mark = call.cur_len;
+    if ((tp_buf_add_byte(&call, TP_SWG_CALL)) ||
+	(tp_syn_enc_uid(&call, batch[i].obj_uid)) ||
+	(tp_syn_enc_uid(&call, batch[i].method_uid)) ||
+	(tp_buf_add_byte(&call, TP_SWG_START_LIST)) ||
+	((batch[i].args != NULL) && (tp_buf_add_buf(&call, batch[i].args))) ||
+	(tp_buf_add_byte(&call, TP_SWG_END_LIST)) ||
+	(tp_buf_add_byte(&call, TP_SWG_END_OF_DATA)) ||
+	(tp_buf_add_byte(&call, TP_SWG_START_LIST)) ||
+	(tp_syn_enc_uint(&call, 0)) ||
+	(tp_syn_enc_uint(&call, 0)) ||
+	(tp_syn_enc_uint(&call, 0)) ||
+	(tp_buf_add_byte(&call, TP_SWG_END_LIST)))
+    {
+      /* leave the rest for next time, unless even one won't fit */
+      if (tp_errno != TP_ERR_SPACE)
+      {
+	return tp_errno;
+      }
+      if (i == 0)
+      {
+	return tp_errno = TP_ERR_PACKET_SIZE;
+      }
+      call.cur_len = mark;
+      break;
+    }
+    
+    memset(&batch[i].result, 0, sizeof(tp_buffer_t));
+    batch[i].status = TP_ERR_MALFORMED;
+  }
+  max = i;
+  
   /* debug for the curious */
   TP_DEBUG(3) {
-    printf("SWG TX:");
-    tp_syn_print(&work);
+    printf("SWG TX (%u calls):", max);
+    tp_syn_print(&call);
     printf("\n");
-    work.parse_idx = 0;
   }
   
-  /* off it goes */
-  if ((tp_swg_send(dev, &work, use_session_ids)) ||
-      (tp_swg_recv(&work, dev)))
+  /* one round trip for the lot, no single method to pace polling by */
+  dev->deadline = tp_swg_deadline(dev->timeout_ms ? dev->timeout_ms :
+				  TIMEOUT_SECS * 1000);
+  rc = tp_swg_send_io(dev, call.cur_len, 1);
+  if (rc == TP_ERR_SUCCESS)
   {
-    return tp_errno;
+    tp_swg_trans_sent(dev, batch[0].obj_uid);
+    rc = tp_swg_poll(&work, dev, TP_SWG_NULL);
   }
-
+  dev->deadline = 0;
+  if ((rc != TP_ERR_SUCCESS) ||
+      ((rc = tp_swg_check_closed(dev, &work)) != TP_ERR_SUCCESS) ||
+      ((rc = tp_swg_trans_ack(dev, &work)) != TP_ERR_SUCCESS))
+  {
+    return tp_errno = rc;
+  }
+  *sent = max;
+  
   /* debug for the curious */
   TP_DEBUG(3) {
     printf("SWG RX:");
@@ -249,40 +1470,126 @@ tp_errno_t tp_swg_invoke(tp_handle_t *dev, tp_buffer_t *response,
     work.parse_idx = 0;
   }
   
-  /* NOTE - work.ptr now points within dev->io_block via tp_swg_recv() */
-  
-  /* skip method signature, if present (session manager stuff) */
-  if (work.byte_ptr[0] == 0xf8)
+  /* each response is [ results ] EOD [ status 0 0 ] */
+  for (i = 0; i < max; i++)
   {
-    /* remove leading 19 bytes from buffer */
-    if (tp_buf_trim_left(&work, 19))
+    mark = work.parse_idx;
+    if ((mark >= work.cur_len) ||
+	(work.byte_ptr[mark] != TP_SWG_START_LIST) ||
+	(tp_swg_skip(&work)))
     {
-      return tp_errno;
+      /* TPer stopped answering, rest stay malformed */
+      break;
+    }
+    end = work.parse_idx;
+    if ((tp_syn_dec_byte(&work, TP_SWG_END_OF_DATA)) ||
+	(tp_syn_dec_byte(&work, TP_SWG_START_LIST)) ||
+	(tp_syn_dec_uint(&status, &work)) ||
+	(tp_syn_dec_uint(&reserved, &work)) ||
+	(tp_syn_dec_uint(&reserved, &work)) ||
+	(tp_syn_dec_byte(&work, TP_SWG_END_LIST)))
+    {
+      break;
+    }
+    
+    /* results are what's inside the list */
+    if (status != 0)
+    {
+      batch[i].status = TP_ERR_CALL_SUCCESS + status;
+      continue;
     }
+    batch[i].result.byte_ptr = work.byte_ptr + mark + 1;
+    batch[i].result.cur_len = end - mark - 2;
+    batch[i].result.max_len = batch[i].result.cur_len;
+    batch[i].status = TP_ERR_SUCCESS;
   }
   
-  /* last 5 bytes contain method status code */
-  call_status = work.byte_ptr[work.cur_len - 4];
-  if (call_status)
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/* Communication properties, by name, and whether host may propose them */
+static struct
+{
+  char const *name;
+  size_t offset;
+  int host;
+} const tp_swg_props[] =
+{
+  { "MaxMethods",               offsetof(tp_props_t, max_methods),            1 },
+  { "MaxSubpackets",            offsetof(tp_props_t, max_subpackets),         1 },
+  { "MaxPacketSize",            offsetof(tp_props_t, max_packet_size),        1 },
+  { "MaxPackets",               offsetof(tp_props_t, max_packets),            1 },
+  { "MaxComPacketSize",         offsetof(tp_props_t, max_com_pkt_size),       1 },
+  { "MaxResponseComPacketSize", offsetof(tp_props_t, max_resp_com_pkt_size),  1 },
+  { "MaxSessions",              offsetof(tp_props_t, max_sessions),           0 },
+  { "MaxReadSessions",          offsetof(tp_props_t, max_read_sessions),      0 },
+  { "MaxIndTokenSize",          offsetof(tp_props_t, max_ind_token_size),     1 },
+  { "MaxAggTokenSize",          offsetof(tp_props_t, max_agg_token_size),     1 },
+  { "MaxAuthentications",       offsetof(tp_props_t, max_authentications),    0 },
+  { "MaxTransactionLimit",      offsetof(tp_props_t, max_transaction_limit),  0 },
+  { "DefSessionTimeout",        offsetof(tp_props_t, def_session_timeout),    0 },
+  { "MaxSessionTimeout",        offsetof(tp_props_t, max_session_timeout),    0 },
+  { "MinSessionTimeout",        offsetof(tp_props_t, min_session_timeout),    0 },
+  { "DefTransTimeout",          offsetof(tp_props_t, def_trans_timeout),      0 },
+  { "MaxTransTimeout",          offsetof(tp_props_t, max_trans_timeout),      0 },
+  { "MinTransTimeout",          offsetof(tp_props_t, min_trans_timeout),      0 },
+  { "MaxComIDTime",             offsetof(tp_props_t, max_comid_time),         0 },
+  { "ContinuedTokens",          offsetof(tp_props_t, continued_tokens),       1 },
+  { "SequenceNumbers",          offsetof(tp_props_t, sequence_numbers),       1 },
+  { "AckNak",                   offsetof(tp_props_t, ack_nak),                1 },
+  { "Asynchronous",             offsetof(tp_props_t, asynchronous),           1 }
+};
+
+/* Number of known communication properties */
+#define PROP_COUNT (sizeof(tp_swg_props) / sizeof(tp_swg_props[0]))
+
+/* Property of set, by index into tp_swg_props */
+#define PROP(set, i) ((uint64_t*)((char*)(set) + tp_swg_props[i].offset))
+
+/**
+ * \brief Parse Communication Properties
+ *
+ * Parse a list of named values (string = uint) into property set. Names
+ * not recognized are skipped, and properties not listed left as they are.
+ *
+ * \param[in,out] buf Buffer being parsed
+ * \param[in,out] props Property set
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_parse_props(tp_buffer_t *buf, tp_props_t *props)
+{
+  tp_buffer_t key;
+  unsigned int i;
+  uint8_t next;
+  
+  if (tp_syn_dec_byte(buf, TP_SWG_START_LIST))
   {
-    /* convert to appropriate error code */
-    return tp_errno = (TP_ERR_CALL_SUCCESS + call_status);
+    return tp_errno;
   }
-  
-  /* if response is wanted, extract from remaining bytes */
-  if (response)
+  while ((tp_buf_peek(&next, buf) == 0) && (next == TP_SWG_START_NAME))
   {
-    if ((tp_buf_trim_left(&work, 1)) ||
-	(tp_buf_trim_right(&work, 7)))
+    buf->parse_idx++;
+    if (tp_syn_dec_bin(&key, buf))
     {
       return tp_errno;
     }
-    
-    /* set up return buffer */
-    response->byte_ptr = work.byte_ptr + work.parse_idx;
-    response->cur_len = work.cur_len - work.parse_idx;
-    response->max_len = response->cur_len;
-    response->parse_idx = 0;
+    for (i = 0; i < PROP_COUNT; i++)
+    {
+      if (tp_buf_cmp_str(&key, tp_swg_props[i].name))
+      {
+	break;
+      }
+    }
+    if ((i < PROP_COUNT ? tp_syn_dec_uint(PROP(props, i), buf) :
+	 tp_swg_skip(buf)) ||
+	(tp_syn_dec_byte(buf, TP_SWG_END_NAME)))
+    {
+      return tp_errno;
+    }
+  }
+  if (tp_syn_dec_byte(buf, TP_SWG_END_LIST))
+  {
+    return tp_errno;
   }
   
   return tp_errno = TP_ERR_SUCCESS;
@@ -295,39 +1602,82 @@ tp_errno_t tp_swg_invoke(tp_handle_t *dev, tp_buffer_t *response,
  * with TPM on drive.
  *
  * \param[in,out] dev Target drive
- * \param[out] response Buffer to catch encoded return (or NULL to ignore)
- * \param[in] obj_uid UID of object for method call
- * \param[in] method_uid UID of method to call
- * \param[in] args Encoded arguments to pass to method (or NULL for none)
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_swg_do_properties(tp_handle_t *dev)
 {
-  tp_buffer_t props, key;
-  uint64_t value;
+  return tp_swg_do_properties_ex(dev, NULL);
+}
+
+/**
+ * \brief Host Properties, as Proposed by Caller
+ *
+ * Establish level 1 communications by exchanging communication properties
+ * with TPM on drive. Non-zero properties given by caller are proposed in
+ * place of library defaults, and properties only a TPer reports (session
+ * limits, timeouts, etc) are refused. The full property set reported by
+ * the TPer, and the host properties it accepted, are kept in the drive
+ * handle.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] host Host properties to propose (or NULL for defaults)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_do_properties_ex(tp_handle_t *dev, tp_props_t const *host)
+{
+  tp_props_t proposed;
+  tp_buffer_t props;
+  unsigned int i;
   uint8_t next;
   
-  /* Our comm settings */
-  uint64_t host_max_pkt_size = sizeof(dev->io_block);
-  uint64_t host_max_token_size = host_max_pkt_size - 56;
+  /* Check for NULL pointer */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* Only host properties may be proposed, the rest are TPer's alone */
+  for (i = 0; (host != NULL) && (i < PROP_COUNT); i++)
+  {
+    if ((*PROP(host, i) != 0) && (!tp_swg_props[i].host))
+    {
+      return tp_errno = TP_ERR_INVALID;
+    }
+  }
   
-  /* Default assumptions about TPer(drive), until it tell us better.
-   * NOTE that these are from SWG core spec */
-  uint64_t drive_max_pkt_size = 1024;
-  uint64_t drive_max_token_size = 968;
+  /* Caller's comm settings, filling in our own (sized to fit whatever
+   * ComPacket size is proposed) */
+  memset(&proposed, 0, sizeof(proposed));
+  if (host != NULL)
+  {
+    memcpy(&proposed, host, sizeof(proposed));
+  }
+  if (proposed.max_com_pkt_size == 0)
+  {
+    proposed.max_com_pkt_size = MAX_COM_PKT_SIZE;
+  }
+  if (proposed.max_packet_size == 0)
+  {
+    proposed.max_packet_size = proposed.max_com_pkt_size - 20;
+  }
+  if (proposed.max_ind_token_size == 0)
+  {
+    proposed.max_ind_token_size = proposed.max_com_pkt_size - 56;
+  }
+  if (proposed.max_agg_token_size == 0)
+  {
+    proposed.max_agg_token_size = proposed.max_com_pkt_size - 56;
+  }
   
   /*
    * Setting up outbound method arguments
    */
 
-  /* initialize */
-  char raw[512];
-  memset(&props, 0, sizeof(props));
-  props.ptr = raw;
-  props.max_len = sizeof(raw);
-  
-  /* start of named argument (HostProperties) */
-  if (tp_buf_add_byte(&props, TP_SWG_START_NAME))
+  /* encoded in place, as HostProperties method of Session Manager */
+  if ((tp_swg_call_begin(dev, &props, TP_SWG_SMUID, TP_SWG_PROPERTIES)) ||
+      
+      /* start of named argument (HostProperties) */
+      (tp_buf_add_byte(&props, TP_SWG_START_NAME)))
   {
     return tp_errno;
   }
@@ -355,108 +1705,109 @@ tp_errno_t tp_swg_do_properties(tp_handle_t *dev)
     return tp_errno = TP_ERR_NO_SSC;
   }
   
-  /* the rest is identical ... */
-  if ((tp_buf_add_byte(&props, TP_SWG_START_LIST)) ||
-      
-      /* max com packet size */
-      (tp_buf_add_byte(&props, TP_SWG_START_NAME)) ||
-      (tp_syn_enc_str(&props, "MaxComPacketSize")) ||
-      (tp_syn_enc_uint(&props, host_max_pkt_size)) ||
-      (tp_buf_add_byte(&props, TP_SWG_END_NAME)) ||
-      
-      /* max packet size */
-      (tp_buf_add_byte(&props, TP_SWG_START_NAME)) ||
-      (tp_syn_enc_str(&props, "MaxPacketSize")) ||
-      (tp_syn_enc_uint(&props, host_max_pkt_size - 20)) ||
-      (tp_buf_add_byte(&props, TP_SWG_END_NAME)) ||
-      
-      /* max token size */
-      (tp_buf_add_byte(&props, TP_SWG_START_NAME)) ||
-      (tp_syn_enc_str(&props, "MaxIndTokenSize")) ||
-      (tp_syn_enc_uint(&props, host_max_token_size)) ||
-      (tp_buf_add_byte(&props, TP_SWG_END_NAME)) ||
-      
-      /* max aggregate token size */
-      (tp_buf_add_byte(&props, TP_SWG_START_NAME)) ||
-      (tp_syn_enc_str(&props, "MaxAggTokenSize")) ||
-      (tp_syn_enc_uint(&props, host_max_token_size)) ||
-      (tp_buf_add_byte(&props, TP_SWG_END_NAME)) ||
-      
-      /* syntatic sugar */
-      (tp_buf_add_byte(&props, TP_SWG_END_LIST)) ||
+  /* the rest is identical ... everything we have an opinion on */
+  if (tp_buf_add_byte(&props, TP_SWG_START_LIST))
+  {
+    return tp_errno;
+  }
+  for (i = 0; i < PROP_COUNT; i++)
+  {
+    if ((*PROP(&proposed, i) != 0) &&
+	((tp_buf_add_byte(&props, TP_SWG_START_NAME)) ||
+	 (tp_syn_enc_str(&props, tp_swg_props[i].name)) ||
+	 (tp_syn_enc_uint(&props, *PROP(&proposed, i))) ||
+	 (tp_buf_add_byte(&props, TP_SWG_END_NAME))))
+    {
+      return tp_errno;
+    }
+  }
+  if ((tp_buf_add_byte(&props, TP_SWG_END_LIST)) ||
       (tp_buf_add_byte(&props, TP_SWG_END_NAME)))
   {
     return tp_errno;
   }
   
   /* Invoke HostProperties method on Session Manager */
-  if (tp_swg_invoke(dev, &props, TP_SWG_SMUID, TP_SWG_PROPERTIES, &props))
+  if (tp_swg_call_commit(dev, &props, &props, 0))
+  {
+    return tp_errno;
+  }
+  
+  /* TPer properties come back first, taking SWG core spec minimums for
+   * anything left out */
+  memset(&dev->tper_props, 0, sizeof(tp_props_t));
+  dev->tper_props.max_methods = 1;
+  dev->tper_props.max_subpackets = 1;
+  dev->tper_props.max_packet_size = 1004;
+  dev->tper_props.max_packets = 1;
+  dev->tper_props.max_com_pkt_size = 1024;
+  dev->tper_props.max_resp_com_pkt_size = 1024;
+  dev->tper_props.max_sessions = 1;
+  dev->tper_props.max_ind_token_size = 968;
+  dev->tper_props.max_agg_token_size = 968;
+  dev->tper_props.max_authentications = 2;
+  dev->tper_props.max_transaction_limit = 1;
+  if (tp_swg_parse_props(&props, &dev->tper_props))
+  {
+    return tp_errno;
+  }
+  
+  /* then our own, as the TPer accepted them (as proposed, if not echoed) */
+  memcpy(&dev->host_props, &proposed, sizeof(tp_props_t));
+  if ((tp_buf_peek(&next, &props) == 0) && (next == TP_SWG_START_NAME))
+  {
+    props.parse_idx++;
+    if ((tp_swg_skip(&props)) ||
+	(tp_swg_parse_props(&props, &dev->host_props)) ||
+	(tp_syn_dec_byte(&props, TP_SWG_END_NAME)))
+    {
+      return tp_errno;
+    }
+  }
+  
+  /* Comms based on minimum capabilities of both sides (a packet travels
+   * in a ComPacket, behind its 20 byte header) */
+  dev->max_com_pkt_size = dev->tper_props.max_com_pkt_size;
+  if (dev->tper_props.max_packet_size + 20 < dev->max_com_pkt_size)
+  {
+    dev->max_com_pkt_size = dev->tper_props.max_packet_size + 20;
+  }
+  if (dev->host_props.max_com_pkt_size < dev->max_com_pkt_size)
+  {
+    dev->max_com_pkt_size = dev->host_props.max_com_pkt_size;
+  }
+  dev->max_token_size = dev->tper_props.max_ind_token_size;
+  if (dev->host_props.max_ind_token_size < dev->max_token_size)
   {
-    return tp_errno;
+    dev->max_token_size = dev->host_props.max_ind_token_size;
   }
+  dev->max_methods = (dev->tper_props.max_methods ?
+		      dev->tper_props.max_methods : 1);
   
-  /* Return data is a list of named data types of form (string = uint) */
-  
-  /* first get rid of the starting / ending list tokens */
-  if ((tp_buf_trim_left(&props, 1)) ||
-      (tp_buf_trim_right(&props, 1)))
+  /* Grow I/O space to match, or settle for what we have */
+  if (tp_trans_alloc_io(dev, dev->max_com_pkt_size))
   {
-    return tp_errno;
+    dev->max_com_pkt_size = dev->io_block_size;
   }
   
-  /* then parse start name, string, uint, end name
-   * NOTE - this ignores the fact that the TPer responds with a copy
-   * of our proposed host properties. the below code doesn't really
-   * look for it, and therefore exits quietly when it sees something
-   * it doesn't expect (TL;DR - it works, but make this better?) */
-  
-  while (1)
+  /* debug for the interested */
+  TP_DEBUG(2)
   {
-    /* start of named value */
-    if ((tp_buf_peek(&next, &props)) ||
-	(next != TP_SWG_START_NAME))
-    {
-      break;
-    }
-    props.parse_idx++;
-    
-    /* name - a string (key) and
-     * value - a uint (value) */
-    if ((tp_syn_dec_bin(&key, &props)) ||
-	(tp_syn_dec_uint(&value, &props)))
-    {
-      break;
-    }
-    
-    /* end of named value */
-    if ((tp_buf_peek(&next, &props)) ||
-	(next != TP_SWG_END_NAME))
-    {
-      break;
-    }
-    props.parse_idx++;
-    
-    /* Only care about a few parameters ... */
-    if (tp_buf_cmp_str(&key, "MaxComPacketSize"))
+    for (i = 0; i < PROP_COUNT; i++)
     {
-      drive_max_pkt_size = value;
-    }
-    else if (tp_buf_cmp_str(&key, "MaxIndTokenSize"))
-    {
-      drive_max_token_size = value;
+      if ((*PROP(&dev->tper_props, i) != 0) ||
+	  (*PROP(&dev->host_props, i) != 0))
+      {
+	printf("  %-24s TPer %-10llu Host %llu\n", tp_swg_props[i].name,
+	       (unsigned long long)*PROP(&dev->tper_props, i),
+	       (unsigned long long)*PROP(&dev->host_props, i));
+      }
     }
+    printf("MaxComPktSize is now %zu\n", dev->max_com_pkt_size);
+    printf("MaxIndTokenSize is now %zu\n", dev->max_token_size);
+    printf("MaxMethods is now %u\n", dev->max_methods);
   }
   
-  /* Comms based on minimum capabilities of both sides */
-  dev->max_com_pkt_size = (drive_max_pkt_size < host_max_pkt_size ?
-			   drive_max_pkt_size : host_max_pkt_size);
-  dev->max_token_size = (drive_max_token_size < host_max_token_size ?
-			 drive_max_token_size : host_max_token_size);
-  
-  /* debug for the interested */
-  TP_DEBUG(2) printf("MaxComPktSize is now %zu\n", dev->max_com_pkt_size);
-  TP_DEBUG(2) printf("MaxIndTokenSize is now %zu\n", dev->max_token_size);
-  
   return tp_errno = TP_ERR_SUCCESS;
 }
 
@@ -470,37 +1821,68 @@ tp_errno_t tp_swg_do_properties(tp_handle_t *dev)
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_swg_session_start(tp_handle_t *dev, uint64_t sp_uid)
+{
+  return tp_swg_session_start_auth(dev, sp_uid, 0, NULL, 0, 1);
+}
+
+/**
+ * \brief Start Authenticated Session
+ *
+ * Begin session with target Security Provider (SP), as given authority
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] sp_uid UID of SP object
+ * \param[in] auth_uid UID of authority, or 0 for anonymous session
+ * \param[in] pin Password of authority
+ * \param[in] pin_len Length of password
+ * \param[in] write Non-zero for read / write session
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_session_start_auth(tp_handle_t *dev, uint64_t sp_uid,
+				     uint64_t auth_uid, void const *pin,
+				     size_t pin_len, int write)
 {
   tp_buffer_t args, resp;
-  char raw[64];
   uint64_t host_id, value;
   
   /* Check for NULL pointer */
-  if (dev == NULL)
+  if ((dev == NULL) || ((pin == NULL) && (pin_len > 0)))
   {
     return tp_errno = TP_ERR_NULL;
   }
   
-  /* initialize buffer */
-  memset(raw, 0, sizeof(raw));
-  memset(&args, 0, sizeof(args));
-  args.ptr = raw;
-  args.max_len = sizeof(raw);
-  
-  /* Ideally, this should be a unique value, but doesn't really matter */
-  host_id = 1;
+  /* Sessions may share a ComID (e.g. pooled), so keep host IDs distinct */
+  if (++dev->last_host_session_id == 0)
+  {
+    dev->last_host_session_id = 1;
+  }
+  host_id = dev->last_host_session_id;
   
-  /* session startup uses three arguments */
-  if ((tp_syn_enc_uint(&args, host_id)) ||
+  /* session startup uses three arguments, to the session manager */
+  if ((tp_swg_call_begin(dev, &args, TP_SWG_SMUID, TP_SWG_START_SESSION)) ||
+      (tp_syn_enc_uint(&args, host_id)) ||
       (tp_syn_enc_uid(&args, sp_uid)) ||
-      (tp_syn_enc_uint(&args, 1)))         /* read/write flag */
+      (tp_syn_enc_uint(&args, (write ? 1 : 0))))
+  {
+    return tp_errno;
+  }
+  
+  /* then HostChallenge and HostSigningAuthority, if not anonymous */
+  if ((auth_uid != 0) &&
+      ((tp_buf_add_byte(&args, TP_SWG_START_NAME)) ||
+       (tp_syn_enc_uint(&args, 0)) ||
+       (tp_syn_enc_bin(&args, pin, pin_len)) ||
+       (tp_buf_add_byte(&args, TP_SWG_END_NAME)) ||
+       (tp_buf_add_byte(&args, TP_SWG_START_NAME)) ||
+       (tp_syn_enc_uint(&args, 3)) ||
+       (tp_syn_enc_uid(&args, auth_uid)) ||
+       (tp_buf_add_byte(&args, TP_SWG_END_NAME))))
   {
     return tp_errno;
   }
   
   /* call the session manager */
-  if (tp_swg_invoke(dev, &resp, TP_SWG_SMUID,
- 		    TP_SWG_START_SESSION, &args))
+  if (tp_swg_call_commit(dev, &resp, &args, 0))
   {
     return tp_errno;
   }
@@ -526,7 +1908,8 @@ tp_errno_t tp_swg_session_start(tp_handle_t *dev, uint64_t sp_uid)
   dev->host_session_id = host_id;
   dev->tper_session_id = value;   /* return from drive */
 
-  TP_DEBUG(1) printf("Anonymous Session %x:%x Started\n",
+  TP_DEBUG(1) printf("%s Session %x:%x Started\n",
+		     (auth_uid ? "Authenticated" : "Anonymous"),
 		     dev->tper_session_id,
 		     dev->host_session_id);
   
@@ -572,6 +1955,12 @@ tp_errno_t tp_swg_session_end(tp_handle_t *dev)
     return tp_errno;
   }
 
+  /* already gone, as far as TPer is concerned */
+  if (tp_swg_closed(&buf))
+  {
+    return tp_swg_session_forget(dev);
+  }
+  
   /* if all went well, we should receive a single byte in response */
   if ((buf.cur_len != 1) ||
       (buf.byte_ptr[0] != TP_SWG_END_SESSION))
@@ -601,10 +1990,399 @@ tp_errno_t tp_swg_session_forget(tp_handle_t *dev)
     return tp_errno = TP_ERR_NULL;
   }
 
-  /* Forget current session */
+  /* Forget current session (TPer aborts any transaction with it) */
+  dev->tper_session_id = 0;
+  dev->host_session_id = 0;
+  dev->txn_state = TP_TXN_NONE;
+
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Drop Pooled Session
+ *
+ * Clear out pool slot, including remembered password
+ *
+ * \param[in,out] ent Pool slot
+ */
+static void tp_swg_pool_drop(tp_pool_session_t *ent)
+{
+  memset(ent, 0, sizeof(tp_pool_session_t));
+}
+
+/**
+ * \brief Close Idle Pooled Session
+ *
+ * End session parked in pool, leaving the current session (if any) be
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] ent Pool slot
+ */
+static void tp_swg_pool_close(tp_handle_t *dev, tp_pool_session_t *ent)
+{
+  uint32_t tper_session_id = dev->tper_session_id;
+  uint32_t host_session_id = dev->host_session_id;
+  tp_txn_state_t txn_state = dev->txn_state;
+  
+  /* best effort, TPer may well have dropped it already */
+  dev->tper_session_id = ent->tper_session_id;
+  dev->host_session_id = ent->host_session_id;
+  dev->txn_state = TP_TXN_NONE;
+  tp_swg_session_end(dev);
+  tp_swg_pool_drop(ent);
+  
+  dev->tper_session_id = tper_session_id;
+  dev->host_session_id = host_session_id;
+  dev->txn_state = txn_state;
+}
+
+/**
+ * \brief Find Least Recently Used Pooled Session
+ *
+ * \param[in] dev Target drive
+ * \return Idle pool slot, or NULL if none
+ */
+static tp_pool_session_t *tp_swg_pool_lru(tp_handle_t *dev)
+{
+  tp_pool_session_t *lru = NULL;
+  unsigned int i;
+  
+  for (i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    if ((dev->pool[i].active) && (!dev->pool[i].in_use) &&
+	((lru == NULL) || (dev->pool[i].idle_since < lru->idle_since)))
+    {
+      lru = dev->pool + i;
+    }
+  }
+  return lru;
+}
+
+/**
+ * \brief Find Current Pooled Session
+ *
+ * \param[in] dev Target drive
+ * \return Pool slot lent out as current session, or NULL if none
+ */
+static tp_pool_session_t *tp_swg_pool_current(tp_handle_t *dev)
+{
+  unsigned int i;
+  
+  for (i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    if ((dev->pool[i].active) && (dev->pool[i].in_use))
+    {
+      return dev->pool + i;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * \brief Open Pooled Session
+ *
+ * Start session described by pool slot, as current session of drive. If
+ * TPer is short of sessions, idle pooled sessions are closed to make room.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in,out] ent Pool slot
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_swg_pool_open(tp_handle_t *dev, tp_pool_session_t *ent)
+{
+  tp_pool_session_t *lru;
+  
+  while (tp_swg_session_start_auth(dev, ent->sp_uid, ent->auth_uid, ent->pin,
+				   ent->pin_len, ent->write) != 0)
+  {
+    if (((tp_errno != TP_ERR_CALL_NO_SESSIONS_AVAILABLE) &&
+	 (tp_errno != TP_ERR_CALL_SP_BUSY)) ||
+	((lru = tp_swg_pool_lru(dev)) == NULL))
+    {
+      return tp_errno;
+    }
+    tp_swg_pool_close(dev, lru);
+  }
+  
+  ent->tper_session_id = dev->tper_session_id;
+  ent->host_session_id = dev->host_session_id;
+  ent->active = 1;
+  ent->in_use = 1;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Acquire Pooled Session
+ *
+ * Make a session with SP, as authority, the current session of drive.
+ * An idle session already open with the same SP, authority, password and
+ * mode is reused if there is one, saving the StartSession round trip.
+ * Hand session back with tp_swg_pool_release() rather than ending it.
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] sp_uid UID of SP object
+ * \param[in] auth_uid UID of authority, or 0 for anonymous session
+ * \param[in] pin Password of authority
+ * \param[in] pin_len Length of password
+ * \param[in] write Non-zero for read / write session
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_acquire(tp_handle_t *dev, uint64_t sp_uid,
+			       uint64_t auth_uid, void const *pin,
+			       size_t pin_len, int write)
+{
+  tp_pool_session_t *ent = NULL;
+  unsigned int i, open;
+  uint64_t ttl_ns;
+  
+  /* Check for NULL pointers */
+  if ((dev == NULL) || ((pin == NULL) && (pin_len > 0)))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* one current session at a time, and the password must fit */
+  if ((dev->host_session_id != 0) || (tp_swg_pool_current(dev) != NULL) ||
+      (pin_len > MAX_PIN_SIZE))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* close sessions left idle too long (by default, well inside the
+   * TPer's own session timeout) */
+  ttl_ns = (uint64_t)(dev->pool_ttl_ms ? dev->pool_ttl_ms : POOL_TTL_MS) *
+    1000000;
+  if ((dev->pool_ttl_ms == 0) && (dev->tper_props.def_session_timeout != 0) &&
+      (dev->tper_props.def_session_timeout / 2 * 1000000 < ttl_ns))
+  {
+    ttl_ns = dev->tper_props.def_session_timeout / 2 * 1000000;
+  }
+  for (i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    if ((dev->pool[i].active) &&
+	(tp_trace_now() - dev->pool[i].idle_since > ttl_ns))
+    {
+      tp_swg_pool_close(dev, dev->pool + i);
+    }
+  }
+  
+  /* reuse matching session, if we have one */
+  for (i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    ent = dev->pool + i;
+    if ((ent->active) && (ent->sp_uid == sp_uid) &&
+	(ent->auth_uid == auth_uid) && (ent->write == (write != 0)) &&
+	(ent->pin_len == pin_len) &&
+	((pin_len == 0) || (memcmp(ent->pin, pin, pin_len) == 0)))
+    {
+      dev->tper_session_id = ent->tper_session_id;
+      dev->host_session_id = ent->host_session_id;
+      ent->in_use = 1;
+      TP_DEBUG(1) printf("Session %x:%x Reused\n",
+			 dev->tper_session_id,
+			 dev->host_session_id);
+      return tp_errno = TP_ERR_SUCCESS;
+    }
+  }
+  
+  /* otherwise somewhere to keep a new one, evicting if need be (and
+   * keeping within MaxSessions of TPer) */
+  for (ent = NULL, open = 0, i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    if (dev->pool[i].active)
+    {
+      open++;
+    }
+    else if (ent == NULL)
+    {
+      ent = dev->pool + i;
+    }
+  }
+  if ((dev->tper_props.max_sessions != 0) &&
+      (open >= dev->tper_props.max_sessions))
+  {
+    ent = NULL;
+  }
+  if ((ent == NULL) && ((ent = tp_swg_pool_lru(dev)) != NULL))
+  {
+    tp_swg_pool_close(dev, ent);
+  }
+  if (ent == NULL)
+  {
+    return tp_errno = TP_ERR_SPACE;
+  }
+  
+  /* and open it */
+  ent->sp_uid = sp_uid;
+  ent->auth_uid = auth_uid;
+  ent->write = (write != 0);
+  if (pin_len > 0)
+  {
+    memcpy(ent->pin, pin, pin_len);
+  }
+  ent->pin_len = pin_len;
+  if (tp_swg_pool_open(dev, ent))
+  {
+    tp_swg_pool_drop(ent);
+    return tp_errno;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Release Pooled Session
+ *
+ * Hand current session back to pool, to be reused by a later
+ * tp_swg_pool_acquire(). Sessions with a transaction still open are ended
+ * instead (aborting the transaction), as are sessions not from the pool.
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_release(tp_handle_t *dev)
+{
+  tp_pool_session_t *ent;
+  
+  /* Check for NULL pointer */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* not ours to keep */
+  if ((ent = tp_swg_pool_current(dev)) == NULL)
+  {
+    return tp_swg_session_end(dev);
+  }
+  
+  /* already gone (e.g. closed by TPer) */
+  if (dev->host_session_id != ent->host_session_id)
+  {
+    tp_swg_pool_drop(ent);
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* can't leave a transaction hanging */
+  if (dev->txn_state != TP_TXN_NONE)
+  {
+    tp_swg_pool_drop(ent);
+    return tp_swg_session_end(dev);
+  }
+  
+  /* park it */
+  ent->in_use = 0;
+  ent->idle_since = tp_trace_now();
   dev->tper_session_id = 0;
   dev->host_session_id = 0;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Invoke Method on Pooled Session
+ *
+ * As tp_swg_invoke(), but should the TPer have closed the current pooled
+ * session (e.g. timed out while idle), a new one is opened with the same
+ * credentials, and the method tried again. Nothing is retried within a
+ * transaction, as the TPer has rolled it back.
+ *
+ * \param[in,out] dev Target drive
+ * \param[out] response Buffer to catch encoded return (or NULL to ignore)
+ * \param[in] obj_uid UID of object for method call
+ * \param[in] method_uid UID of method to call
+ * \param[in] args Encoded arguments to pass to method (or NULL for none)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_invoke(tp_handle_t *dev, tp_buffer_t *response,
+			      uint64_t obj_uid, uint64_t method_uid,
+			      tp_buffer_t const *args)
+{
+  tp_pool_session_t *ent;
+  tp_txn_state_t txn_state;
+  
+  /* Check for NULL pointer */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* usual case */
+  txn_state = dev->txn_state;
+  if ((tp_swg_invoke(dev, response, obj_uid, method_uid, args) == 0) ||
+      (tp_errno != TP_ERR_SESSION_ABORTED) ||
+      (txn_state != TP_TXN_NONE) ||
+      ((ent = tp_swg_pool_current(dev)) == NULL))
+  {
+    return tp_errno;
+  }
+  
+  /* rebuild session, and go again */
+  TP_DEBUG(1) printf("Reopening Pooled Session\n");
+  if (tp_swg_pool_open(dev, ent))
+  {
+    tp_swg_pool_drop(ent);
+    return tp_errno;
+  }
+  return tp_swg_invoke(dev, response, obj_uid, method_uid, args);
+}
+
+/**
+ * \brief Flush Session Pool
+ *
+ * End all pooled sessions, including the current one if it came from pool
+ *
+ * \param[in,out] dev Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_flush(tp_handle_t *dev)
+{
+  tp_pool_session_t *ent;
+  unsigned int i;
+  
+  /* Check for NULL pointer */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* current one first, then whatever is idle */
+  if ((ent = tp_swg_pool_current(dev)) != NULL)
+  {
+    if (dev->host_session_id == ent->host_session_id)
+    {
+      tp_swg_session_end(dev);
+    }
+    tp_swg_pool_drop(ent);
+  }
+  for (i = 0; i < MAX_POOL_SESSIONS; i++)
+  {
+    if (dev->pool[i].active)
+    {
+      tp_swg_pool_close(dev, dev->pool + i);
+    }
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
 
+/**
+ * \brief Set Pooled Session Lifetime
+ *
+ * Set how long a session may sit idle in pool before it is closed
+ *
+ * \param[in,out] dev Target drive
+ * \param[in] ttl_ms Idle time in milliseconds, or 0 for library default
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_swg_pool_set_ttl(tp_handle_t *dev, unsigned int ttl_ms)
+{
+  /* Check for NULL pointer */
+  if (dev == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  dev->pool_ttl_ms = ttl_ms;
   return tp_errno = TP_ERR_SUCCESS;
 }
 
@@ -624,7 +2402,6 @@ tp_errno_t tp_swg_get_by_str(tp_buffer_t *value, tp_handle_t *dev,
 {
   tp_buffer_t args, ret, tmp;
   tp_syn_atom_info_t info;
-  char raw[128];
 
   /* Check for NULL pointers */
   if ((value == NULL) || (dev == NULL) || (col == NULL))
@@ -632,14 +2409,9 @@ tp_errno_t tp_swg_get_by_str(tp_buffer_t *value, tp_handle_t *dev,
     return tp_errno = TP_ERR_NULL;
   }
 
-  /* initialize args */
-  memset(&args, 0, sizeof(args));
-  memset(raw, 0, sizeof(raw));
-  args.ptr = raw;
-  args.max_len = sizeof(raw);
-
   /* Method arguments defined in Draft 0.9 version of SWG spec ... */
-  if ((tp_buf_add_byte(&args, TP_SWG_START_LIST)) ||
+  if ((tp_swg_call_begin(dev, &args, table_uid, TP_SWG_GET_OBS)) ||
+      (tp_buf_add_byte(&args, TP_SWG_START_LIST)) ||
       (tp_buf_add_byte(&args, TP_SWG_START_NAME)) ||
       (tp_syn_enc_str(&args, "startColumn")) ||
       (tp_syn_enc_str(&args, col)) ||
@@ -654,7 +2426,7 @@ tp_errno_t tp_swg_get_by_str(tp_buffer_t *value, tp_handle_t *dev,
   }
   
   /* using the obsolete get method */
-  if (tp_swg_invoke(dev, &ret, table_uid, TP_SWG_GET_OBS, &args))
+  if (tp_swg_call_commit(dev, &ret, &args, 0))
   {
     return tp_errno;
   }
@@ -704,7 +2476,6 @@ tp_errno_t tp_swg_get_by_num(tp_buffer_t *value, tp_handle_t *dev,
   tp_buffer_t args, ret;
   tp_syn_atom_info_t info;
   uint64_t tmp;
-  char raw[128];
 
   /* Check for NULL pointers */
   if ((value == NULL) || (dev == NULL))
@@ -712,14 +2483,9 @@ tp_errno_t tp_swg_get_by_num(tp_buffer_t *value, tp_handle_t *dev,
     return tp_errno = TP_ERR_NULL;
   }
 
-  /* initialize args */
-  memset(&args, 0, sizeof(args));
-  memset(raw, 0, sizeof(raw));
-  args.ptr = raw;
-  args.max_len = sizeof(raw);
-
   /* Method arguments defined in Draft 0.9 version of SWG spec ... */
-  if ((tp_buf_add_byte(&args, TP_SWG_START_LIST)) ||
+  if ((tp_swg_call_begin(dev, &args, table_uid, TP_SWG_GET)) ||
+      (tp_buf_add_byte(&args, TP_SWG_START_LIST)) ||
       (tp_buf_add_byte(&args, TP_SWG_START_NAME)) ||
       (tp_syn_enc_uint(&args, 3)) || /* startColumn */
       (tp_syn_enc_uint(&args, col)) ||
@@ -734,7 +2500,7 @@ tp_errno_t tp_swg_get_by_num(tp_buffer_t *value, tp_handle_t *dev,
   }
   
   /* using the obsolete get method */
-  if (tp_swg_invoke(dev, &ret, table_uid, TP_SWG_GET, &args))
+  if (tp_swg_call_commit(dev, &ret, &args, 0))
   {
     return tp_errno;
   }
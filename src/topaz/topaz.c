@@ -38,12 +38,45 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <topaz/topaz.h>
-#include <topaz/transport_ata.h>
+#include <topaz/transport.h>
 #include <topaz/security.h>
 #include <topaz/discovery.h>
 #include <topaz/swg_core.h>
 
+/**
+ * \brief Pick ComID for Drive Handle
+ *
+ * Where TPer manages ComIDs, ask it for one of our own, so other processes
+ * using the drive are left alone. Otherwise fall back to the SSC's base
+ * ComID, resetting whatever state some earlier user left on it.
+ *
+ * \param[in] handle Target drive
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_open_comid(tp_handle_t *handle)
+{
+  uint32_t com_id;
+  
+  /* fresh ComID, nothing to reset */
+  if ((handle->has_reset) && (handle->has_comid_mgmt) &&
+      (tp_security_get_comid(handle, &com_id) == 0))
+  {
+    handle->com_id = com_id;
+    handle->comid_dynamic = 1;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* shared base ComID */
+  if ((handle->has_reset) &&
+      (tp_security_comid_reset(handle, handle->com_id) != 0))
+  {
+    return tp_errno;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
 /**
  * \brief Open Drive / Trusted Peripheral (TPer)
  *
@@ -69,15 +102,16 @@ tp_handle_t *tp_open(char const *path)
   handle->lba_align = 1;
   handle->max_com_pkt_size = 1024;
   handle->max_token_size = 968;
+  handle->max_methods = 1;
   
-  /* open ATA device */
-  if ((handle->ata = tp_ata_open(path)) == NULL)
+  /* open device, and check for TPM */
+  if (tp_trans_open(handle, path) != 0)
   {
     rc = tp_errno;
   }
   
-  /* check for TPM */
-  else if (tp_ata_probe_tpm(handle->ata) != 0)
+  /* space for I/O, until drive says it can handle more */
+  else if (tp_trans_alloc_io(handle, MAX_IO_BLOCK) != 0)
   {
     rc = tp_errno;
   }
@@ -94,14 +128,98 @@ tp_handle_t *tp_open(char const *path)
     rc = tp_errno;
   }
   
-  /* reset the SSC's ComID, if possible */
+  /* get a ComID to ourselves, or else reset the SSC's ComID, if possible */
+  else if (tp_open_comid(handle) != 0)
+  {
+    rc = tp_errno;
+  }
+  
+  /* perform host properties handshake */
+  else if (tp_swg_do_properties(handle))
+  {
+    rc = tp_errno;
+  }
+  
+  /* otherwise everything's ok */
+  else
+  {
+    tp_errno = TP_ERR_SUCCESS;
+    return handle;
+  }
+  
+  /* cleanup */
+  tp_close(handle);
+  tp_errno = rc;
+  return NULL;
+}
+
+/**
+ * \brief Open Channel on Drive
+ *
+ * Opens another handle on an already open drive, using one of the other
+ * statically allocated ComIDs of its SSC. Each channel keeps its own
+ * session, transaction, and I/O space, so work on one need not wait on
+ * another (e.g. when driven from separate threads). Channels share the
+ * drive's transport, which takes one IF-SEND / IF-RECV at a time, and
+ * must be closed before the drive handle.
+ *
+ * \param[in] dev Open drive
+ * \param[in] index Which ComID, counting from SSC base (drive uses 0)
+ * \return Pointer to allocated handle, or NULL on error
+ */
+tp_handle_t *tp_channel_open(tp_handle_t *dev, unsigned int index)
+{
+  tp_handle_t *handle = NULL;
+  tp_errno_t rc = 0;
+  
+  /* check for NULL pointers */
+  if (dev == NULL)
+  {
+    tp_errno = TP_ERR_NULL;
+    return NULL;
+  }
+  
+  /* one of the others */
+  if ((index == 0) || (index >= dev->comid_count))
+  {
+    tp_errno = TP_ERR_INVALID;
+    return NULL;
+  }
+  
+  /* same drive, but its own ComID, session, and I/O space */
+  if ((handle = malloc(sizeof(tp_handle_t))) == NULL)
+  {
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  memcpy(handle, dev, sizeof(tp_handle_t));
+  handle->is_channel = 1;
+  handle->com_id = dev->comid_base + index;
+  handle->comid_dynamic = 0;
+  handle->tper_session_id = 0;
+  handle->host_session_id = 0;
+  handle->txn_state = TP_TXN_NONE;
+  memset(handle->pool, 0, sizeof(handle->pool));
+  handle->deadline = 0;
+  handle->call_posted = 0;
+  handle->io_block = NULL;
+  handle->io_block_size = 0;
+  handle->io_block_mapped = 0;
+  
+  /* space for I/O, same as drive has settled on */
+  if (tp_trans_alloc_io(handle, dev->io_block_size) != 0)
+  {
+    rc = tp_errno;
+  }
+  
+  /* reset the ComID, if possible */
   else if ((handle->has_reset) &&
 	   (tp_security_comid_reset(handle, handle->com_id) != 0))
   {
     rc = tp_errno;
   }
   
-  /* perform host properties handshake */
+  /* host properties are per ComID */
   else if (tp_swg_do_properties(handle))
   {
     rc = tp_errno;
@@ -133,12 +251,27 @@ tp_errno_t tp_close(tp_handle_t *handle)
   /* sanity check */
   if (handle != NULL)
   {
-    /* close ATA device */
-    if (handle->ata != NULL)
+    /* close device */
+    if (handle->trans_type != TP_TRANS_UNKNOWN)
     {
+      tp_swg_pool_flush(handle);
       tp_swg_session_end(handle);
-      tp_ata_close(handle->ata);
-      handle->ata = NULL;
+    }
+    
+    /* hand back ComID we were issued */
+    if (handle->comid_dynamic)
+    {
+      tp_security_comid_release(handle, handle->com_id);
+    }
+    
+    /* channels only own their I/O space */
+    if (handle->is_channel)
+    {
+      free(handle->io_block);
+    }
+    else
+    {
+      tp_trans_close(handle);
     }
     
     /* clear mem */
@@ -0,0 +1,125 @@
+/*
+ * Topaz - Storage Topology (Linux sysfs)
+ *
+ * This file is an implementation of a Linux specific OS API for finding
+ * the controller a drive is attached to, by walking its sysfs device path.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/topology.h>
+
+/**
+ * \brief Check for PCI Function
+ *
+ * \param[in] name Path component
+ * \param[in] len Length of component
+ * \return Nonzero if component looks like a PCI address (dddd:bb:dd.f)
+ */
+static int tp_topo_is_pci(char const *name, size_t len)
+{
+  return ((len == 12) && (name[4] == ':') && (name[7] == ':') &&
+	  (name[10] == '.'));
+}
+
+/**
+ * \brief Look Up Drive Controller (OS Specific)
+ *
+ * Find the shared path a drive is reached through, as a string naming the
+ * topmost SAS expander above it, or failing that its host controller. Drives
+ * returning the same string contend for the same link.
+ *
+ * \param[in] path Path to device
+ * \param[out] hba Buffer for controller name
+ * \param[in] len Size of buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_topo_lookup(char const *path, char *hba, size_t len)
+{
+  char link[PATH_MAX], dev[PATH_MAX];
+  char const *name, *next;
+  size_t name_len, end = 0;
+  struct stat st;
+  int expander = 0;
+  
+  /* check for NULL pointers */
+  if ((path == NULL) || (hba == NULL) || (len == 0))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  hba[0] = '\0';
+  
+  /* sysfs knows devices by number */
+  if (stat(path, &st) != 0)
+  {
+    return tp_errno = TP_ERR_OPEN;
+  }
+  snprintf(link, sizeof(link), "/sys/dev/%s/%u:%u",
+	   (S_ISBLK(st.st_mode) ? "block" : "char"),
+	   major(st.st_rdev), minor(st.st_rdev));
+  if (realpath(link, dev) == NULL)
+  {
+    return tp_errno = TP_ERR_SYSFS;
+  }
+  
+  /* walk down from the root complex, last PCI function is the controller,
+   * unless there is an expander between it and the drive */
+  for (name = dev + 1; (*name != '\0') && (!expander); name = next)
+  {
+    next = strchr(name, '/');
+    next = (next == NULL ? name + strlen(name) : next + 1);
+    name_len = next - name - (next[-1] == '/');
+    
+    if (strncmp(name, "expander-", 9) == 0)
+    {
+      expander = 1;
+      end = name + name_len - dev;
+    }
+    else if (tp_topo_is_pci(name, name_len))
+    {
+      end = name + name_len - dev;
+    }
+  }
+  
+  /* virtual devices and the like share nothing we know of */
+  if (end == 0)
+  {
+    return tp_errno = TP_ERR_SYSFS;
+  }
+  
+  dev[end] = '\0';
+  snprintf(hba, len, "%s", dev);
+  TP_DEBUG(1) printf("Drive attached via %s\n", hba);
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
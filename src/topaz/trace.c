@@ -0,0 +1,187 @@
+/*
+ * Topaz - Transport Traces
+ *
+ * This file implements recording of IF-SEND / IF-RECV traffic to a compact
+ * binary trace, for later playback by the replay transport.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <topaz/debug.h>
+#include <topaz/trace.h>
+
+/** Record traffic of subsequently opened drives to this file (or NULL).
+ *  Drives after the first get a count appended (.1, .2, etc) */
+char const *tp_trace_record = NULL;
+
+/** Replay speedup, 1 for real time, N for N times faster, 0 for no delay */
+unsigned int tp_trace_speedup = 1;
+
+/** Trace recorder */
+struct tp_trace
+{
+  FILE *fp;       /** Output trace file */
+  uint64_t start; /** Time trace started */
+};
+
+/**
+ * \brief Start Trace
+ *
+ * Create a new trace file for recording transport traffic
+ *
+ * \param[in] path Path to trace file
+ * \return Pointer to new recorder, or NULL on error
+ */
+struct tp_trace *tp_trace_open(char const *path)
+{
+  struct tp_trace *trace;
+  tp_trace_file_t header;
+  
+  /* allocate some memory for recorder */
+  if ((trace = calloc(1, sizeof(struct tp_trace))) == NULL)
+  {
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  
+  /* and fire up the file */
+  TP_DEBUG(1) printf("Recording trace to %s\n", path);
+  if ((trace->fp = fopen(path, "wb")) == NULL)
+  {
+    free(trace);
+    tp_errno = TP_ERR_OPEN;
+    return NULL;
+  }
+  
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TP_TRACE_MAGIC, sizeof(TP_TRACE_MAGIC));
+  header.version = TP_TRACE_VERSION;
+  if (fwrite(&header, sizeof(header), 1, trace->fp) != 1)
+  {
+    fclose(trace->fp);
+    free(trace);
+    tp_errno = TP_ERR_TRACE;
+    return NULL;
+  }
+  
+  trace->start = tp_trace_now();
+  tp_errno = TP_ERR_SUCCESS;
+  return trace;
+}
+
+/**
+ * \brief Stop Trace
+ *
+ * Flush and close a trace file
+ *
+ * \param[in] trace Trace recorder
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trace_close(struct tp_trace *trace)
+{
+  int rc;
+  
+  /* sanity check */
+  if (trace == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  rc = fclose(trace->fp);
+  free(trace);
+  return tp_errno = (rc == 0 ? TP_ERR_SUCCESS : TP_ERR_TRACE);
+}
+
+/**
+ * \brief Get Time
+ *
+ * Library wide clock, for timing recorded transfers, method call
+ * deadlines, pooled sessions, and the emulated TPer
+ *
+ * \return Nanoseconds on a monotonic clock
+ */
+uint64_t tp_trace_now(void)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * \brief Record Transfer
+ *
+ * Append one IF-SEND / IF-RECV to trace
+ *
+ * \param[in] trace Trace recorder
+ * \param[in] dir Direction of transfer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes transferred
+ * \param[in] status Result of transfer
+ * \param[in] start Time transfer started, from tp_trace_now()
+ * \param[in] end Time transfer ended, from tp_trace_now()
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trace_write(struct tp_trace *trace, tp_trace_dir_t dir,
+			  uint8_t proto, uint16_t comid, void const *data,
+			  size_t len, tp_errno_t status,
+			  uint64_t start, uint64_t end)
+{
+  static const char pad[8] = {0};
+  uint8_t const *bytes = data;
+  tp_trace_rec_t rec;
+  size_t stored = len;
+  
+  /* ComPackets are mostly zero padding, no need to keep it */
+  while ((stored > 0) && (bytes[stored - 1] == 0))
+  {
+    stored--;
+  }
+  
+  memset(&rec, 0, sizeof(rec));
+  rec.timestamp = start - trace->start;
+  rec.duration  = end - start;
+  rec.length    = len;
+  rec.stored    = stored;
+  rec.status    = status;
+  rec.comid     = comid;
+  rec.proto     = proto;
+  rec.dir       = dir;
+  
+  /* record, payload, and padding to keep next record aligned */
+  if ((fwrite(&rec, sizeof(rec), 1, trace->fp) != 1) ||
+      (fwrite(bytes, 1, stored, trace->fp) != stored) ||
+      (fwrite(pad, 1, -stored & 7, trace->fp) != (-stored & 7)))
+  {
+    return tp_errno = TP_ERR_TRACE;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
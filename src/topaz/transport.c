@@ -0,0 +1,1039 @@
+/*
+ * Topaz - Transport
+ *
+ * This file implements a transport agnostic API for TCG IF-SEND and IF-RECV
+ * calls, dispatching to whichever device transport (ATA, NVMe, etc) was
+ * selected when the drive was opened.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <topaz/debug.h>
+#include <topaz/emu.h>
+#include <topaz/topology.h>
+#include <topaz/transport.h>
+#include <topaz/transport_ata.h>
+#include <topaz/transport_nvme.h>
+#include <topaz/transport_scsi.h>
+#include <topaz/trace.h>
+
+/* Longest wait for any one batched completion */
+#define BATCH_TIMEOUT_MS 10000
+
+/** Most batched commands in flight behind one controller, 0 for no limit */
+unsigned int tp_trans_hba_depth = TP_HBA_DEPTH;
+
+/** Drives recorded so far, so each gets a trace file of its own */
+static unsigned int tp_trans_traced = 0;
+static pthread_mutex_t tp_trans_traced_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \brief Start Trace of Drive
+ *
+ * First drive recorded goes to tp_trace_record, the rest to the same path
+ * with a count appended (.1, .2, etc), so no drive clobbers another's
+ * trace, even one since closed.
+ *
+ * \return Pointer to new recorder, or NULL on error
+ */
+static struct tp_trace *tp_trans_trace_open(void)
+{
+  char path[PATH_MAX];
+  unsigned int count;
+  
+  pthread_mutex_lock(&tp_trans_traced_lock);
+  count = tp_trans_traced++;
+  pthread_mutex_unlock(&tp_trans_traced_lock);
+  
+  if (count == 0)
+  {
+    return tp_trace_open(tp_trace_record);
+  }
+  snprintf(path, sizeof(path), "%s.%u", tp_trace_record, count);
+  return tp_trace_open(path);
+}
+
+/**
+ * \brief Probe Transport
+ *
+ * Probe target device for a supported transport, and attach the first one
+ * found (and confirmed to contain a TPM) to the drive handle.
+ *
+ * \param[in,out] handle Target drive
+ * \param[in] path Path to device
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_trans_probe(tp_handle_t *handle, char const *path)
+{
+  /* NVMe is cheap to rule out, and needs no kernel configuration */
+  TP_DEBUG(1) printf("Probe NVMe transport\n");
+  if ((handle->nvme = tp_nvme_open(path)) != NULL)
+  {
+    handle->trans_type = TP_TRANS_NVME;
+    return tp_nvme_probe_tpm(handle->nvme);
+  }
+  
+  /* native SCSI devices get SECURITY PROTOCOL IN / OUT, but SATA drives
+   * (those behind a SAT layer) keep using ATA pass through */
+  TP_DEBUG(1) printf("Probe SCSI transport\n");
+  if ((handle->scsi = tp_scsi_open(path)) != NULL)
+  {
+    if (!tp_scsi_is_ata(handle->scsi))
+    {
+      handle->trans_type = TP_TRANS_SCSI;
+      return tp_scsi_probe_tpm(handle->scsi);
+    }
+    tp_scsi_close(handle->scsi);
+    handle->scsi = NULL;
+  }
+  
+  /* otherwise fall back to ATA pass through */
+  TP_DEBUG(1) printf("Probe ATA transport\n");
+  if ((handle->ata = tp_ata_open(path)) != NULL)
+  {
+    handle->trans_type = TP_TRANS_ATA;
+    return tp_ata_probe_tpm(handle->ata);
+  }
+  
+  /* nothing usable, tp_errno holds the last failure */
+  return tp_errno;
+}
+
+/**
+ * \brief Open Transport
+ *
+ * Probe target device for a supported transport, and attach the first one
+ * found (and confirmed to contain a TPM) to the drive handle. Paths with
+ * the replay prefix attach a recorded trace instead, those with the
+ * emulator prefix a freshly manufactured software TPer, and traffic is
+ * recorded if tp_trace_record is set.
+ *
+ * \param[in,out] handle Target drive
+ * \param[in] path Path to device
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_open(tp_handle_t *handle, char const *path)
+{
+  size_t prefix_len = strlen(TP_TRACE_REPLAY_PREFIX);
+  
+  /* check for NULL pointers */
+  if ((handle == NULL) || (path == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* one transfer at a time, whichever channel it's for */
+  if ((handle->trans_lock = malloc(sizeof(pthread_mutex_t))) == NULL)
+  {
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  pthread_mutex_init(handle->trans_lock, NULL);
+  
+  /* recorded traffic stands in for a drive */
+  if (strncmp(path, TP_TRACE_REPLAY_PREFIX, prefix_len) == 0)
+  {
+    if ((handle->replay = tp_replay_open(path + prefix_len)) == NULL)
+    {
+      return tp_errno;
+    }
+    handle->trans_type = TP_TRANS_REPLAY;
+  }
+  
+  /* as does a software TPer */
+  else if (strncmp(path, TP_EMU_PREFIX, strlen(TP_EMU_PREFIX)) == 0)
+  {
+    if ((handle->emu = tp_emu_create()) == NULL)
+    {
+      return tp_errno;
+    }
+    handle->trans_type = TP_TRANS_EMU;
+  }
+  
+  /* otherwise go find the real thing */
+  else if (tp_trans_probe(handle, path))
+  {
+    return tp_errno;
+  }
+  
+  /* and where it lives, unknown just means unscheduled */
+  else if (tp_topo_lookup(path, handle->hba, sizeof(handle->hba)))
+  {
+    handle->hba[0] = '\0';
+  }
+  
+  /* and maybe keep a record of what happens next */
+  if ((tp_trace_record != NULL) &&
+      ((handle->trace = tp_trans_trace_open()) == NULL))
+  {
+    return tp_errno;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Close Transport
+ *
+ * Release any transport attached to drive handle
+ *
+ * \param[in,out] handle Target drive
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_close(tp_handle_t *handle)
+{
+  /* check for NULL pointers */
+  if (handle == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* close ATA device */
+  if (handle->ata != NULL)
+  {
+    tp_ata_close(handle->ata);
+    handle->ata = NULL;
+  }
+  
+  /* close NVMe device */
+  if (handle->nvme != NULL)
+  {
+    tp_nvme_close(handle->nvme);
+    handle->nvme = NULL;
+  }
+  
+  /* close SCSI device */
+  if (handle->scsi != NULL)
+  {
+    tp_scsi_close(handle->scsi);
+    handle->scsi = NULL;
+  }
+  
+  /* stop replay */
+  if (handle->replay != NULL)
+  {
+    tp_replay_close(handle->replay);
+    handle->replay = NULL;
+  }
+  
+  /* tear down emulator */
+  if (handle->emu != NULL)
+  {
+    tp_emu_destroy(handle->emu);
+    handle->emu = NULL;
+  }
+  
+  /* finish recording */
+  if (handle->trace != NULL)
+  {
+    tp_trace_close(handle->trace);
+    handle->trace = NULL;
+  }
+  
+  /* nothing left to serialize */
+  if (handle->trans_lock != NULL)
+  {
+    pthread_mutex_destroy(handle->trans_lock);
+    free(handle->trans_lock);
+    handle->trans_lock = NULL;
+  }
+  
+  /* mapped I/O space went with the transport */
+  if (!handle->io_block_mapped)
+  {
+    free(handle->io_block);
+  }
+  handle->io_block = NULL;
+  handle->io_block_size = 0;
+  handle->io_block_mapped = 0;
+  
+  handle->trans_type = TP_TRANS_UNKNOWN;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Size I/O Block
+ *
+ * Make sure the drive handle's I/O block holds at least the given number
+ * of bytes. Where the transport can hand out a buffer it transfers without
+ * copying (e.g. an sg reserved buffer), that is used in place of the heap.
+ * Contents are not preserved.
+ *
+ * \param[in,out] handle Target drive
+ * \param[in] len Minimum size of I/O block
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_trans_alloc_io(tp_handle_t *handle, size_t len)
+{
+  size_t map_len = len;
+  char *io_block = NULL;
+  
+  /* check for NULL pointers */
+  if (handle == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* big enough already? */
+  if ((handle->io_block != NULL) && (handle->io_block_size >= len))
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* zero copy buffer from transport, if it has one (for first handle) */
+  if ((handle->trans_type == TP_TRANS_ATA) && (!handle->is_channel))
+  {
+    io_block = tp_ata_map_buffer(handle->ata, &map_len);
+  }
+  if (io_block != NULL)
+  {
+    if (!handle->io_block_mapped)
+    {
+      free(handle->io_block);
+    }
+    handle->io_block = io_block;
+    handle->io_block_size = map_len;
+    handle->io_block_mapped = 1;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* otherwise plain old heap (mapping, if any, stays with transport) */
+  TP_DEBUG(1) printf("Using heap for %zu byte I/O block\n", len);
+  io_block = (handle->io_block_mapped ? NULL : handle->io_block);
+  if ((io_block = realloc(io_block, len)) == NULL)
+  {
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  handle->io_block = io_block;
+  handle->io_block_size = len;
+  handle->io_block_mapped = 0;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Take Transport
+ *
+ * Transport state (timeouts, queue slots, emulator, trace) is shared by a
+ * drive and all its channels, so only one may use it at a time.
+ *
+ * \param[in] handle Target drive
+ */
+static void tp_if_lock(tp_handle_t *handle)
+{
+  if (handle->trans_lock != NULL)
+  {
+    pthread_mutex_lock(handle->trans_lock);
+  }
+}
+
+/**
+ * \brief Release Transport
+ *
+ * \param[in] handle Target drive
+ */
+static void tp_if_unlock(tp_handle_t *handle)
+{
+  if (handle->trans_lock != NULL)
+  {
+    pthread_mutex_unlock(handle->trans_lock);
+  }
+}
+
+/**
+ * \brief Bound Transfer by Deadline
+ *
+ * Fit OS timeout of the next transfer within the deadline of the method
+ * call in progress on drive
+ *
+ * \param[in] handle Target drive
+ * \param[in] deadline Absolute deadline (monotonic ns), or 0 to clear
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_if_set_deadline(tp_handle_t *handle, uint64_t deadline)
+{
+  unsigned int timeout_ms = 0;
+  uint64_t now;
+  
+  if (deadline != 0)
+  {
+    now = tp_trace_now();
+    if (now >= deadline)
+    {
+      return tp_errno = TP_ERR_TIMEOUT;
+    }
+    timeout_ms = (deadline - now + 999999) / 1000000;
+  }
+  
+  switch (handle->trans_type)
+  {
+    case TP_TRANS_ATA:
+      tp_ata_set_timeout(handle->ata, timeout_ms);
+      break;
+      
+    case TP_TRANS_NVME:
+      tp_nvme_set_timeout(handle->nvme, timeout_ms);
+      break;
+      
+    case TP_TRANS_SCSI:
+      tp_scsi_set_timeout(handle->scsi, timeout_ms);
+      break;
+      
+    default: /* Nothing to bound */
+      break;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Begin Transfer
+ *
+ * Apply the deadline of the method call in progress, and note the start
+ * time for the trace
+ *
+ * \param[in] handle Target drive
+ * \param[out] start Time transfer started
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_if_begin(tp_handle_t *handle, uint64_t *start)
+{
+  if ((handle->deadline != 0) &&
+      (tp_if_set_deadline(handle, handle->deadline)))
+  {
+    return tp_errno;
+  }
+  *start = tp_trace_now();
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief End Transfer
+ *
+ * Record a finished transfer in the trace, if any
+ *
+ * \param[in] handle Target drive
+ * \param[in] dir Direction of transfer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes transferred
+ * \param[in] status Outcome of transfer
+ * \param[in] start Time transfer started, from tp_if_begin()
+ */
+static void tp_if_end(tp_handle_t *handle, tp_trace_dir_t dir, uint8_t proto,
+		      uint16_t comid, void const *data, size_t len,
+		      tp_errno_t status, uint64_t start)
+{
+  if (handle->trace != NULL)
+  {
+    tp_trace_write(handle->trace, dir, proto, comid, data, len, status,
+		   start, tp_trace_now());
+  }
+}
+
+/**
+ * \brief IF-SEND (Untraced)
+ *
+ * Dispatch IF-SEND to the transport attached to the drive handle
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_if_send_raw(tp_handle_t *handle, uint8_t proto,
+				 uint16_t comid, void *data, size_t len)
+{
+  size_t bcount = (len + TP_ATA_BLOCK_SIZE - 1) / TP_ATA_BLOCK_SIZE;
+  
+  switch (handle->trans_type)
+  {
+    case TP_TRANS_ATA:
+      /* ATA16 extended sector count limits a single transfer */
+      if (bcount > 0xffff)
+      {
+	return tp_errno = TP_ERR_PACKET_SIZE;
+      }
+      return tp_ata_if_send(handle->ata, proto, comid, data, bcount);
+      
+    case TP_TRANS_NVME:
+      return tp_nvme_if_send(handle->nvme, proto, comid, data, len);
+      
+    case TP_TRANS_SCSI:
+      return tp_scsi_if_send(handle->scsi, proto, comid, data, len);
+      
+    case TP_TRANS_REPLAY:
+      return tp_replay_if_send(handle->replay, proto, comid, data, len);
+      
+    case TP_TRANS_EMU:
+      return tp_emu_if_send(handle->emu, proto, comid, data, len);
+      
+    default: /* No transport */
+      return tp_errno = TP_ERR_INVALID;
+  }
+}
+
+/**
+ * \brief IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send data to a particular
+ * Communication ID via a specified security protocol, using the transport
+ * attached to the drive handle.
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_send(tp_handle_t *handle, uint8_t proto,
+		      uint16_t comid, void *data, size_t len)
+{
+  uint64_t start = 0;
+  tp_errno_t rc;
+  
+  tp_if_lock(handle);
+  
+  /* no recording or deadline, no overhead */
+  if ((handle->trace == NULL) && (handle->deadline == 0))
+  {
+    rc = tp_if_send_raw(handle, proto, comid, data, len);
+  }
+  else if (tp_if_begin(handle, &start))
+  {
+    rc = tp_errno;
+  }
+  else
+  {
+    rc = tp_if_send_raw(handle, proto, comid, data, len);
+    tp_if_end(handle, TP_TRACE_SEND, proto, comid, data, len, rc, start);
+    if (handle->deadline != 0)
+    {
+      tp_if_set_deadline(handle, 0);
+    }
+  }
+  
+  tp_if_unlock(handle);
+  return tp_errno = rc;
+}
+
+/**
+ * \brief IF-RECV (Untraced)
+ *
+ * Dispatch IF-RECV to the transport attached to the drive handle
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_if_recv_raw(tp_handle_t *handle, uint8_t proto,
+				 uint16_t comid, void *data, size_t len)
+{
+  size_t bcount = (len + TP_ATA_BLOCK_SIZE - 1) / TP_ATA_BLOCK_SIZE;
+  
+  switch (handle->trans_type)
+  {
+    case TP_TRANS_ATA:
+      /* ATA16 extended sector count limits a single transfer */
+      if (bcount > 0xffff)
+      {
+	return tp_errno = TP_ERR_PACKET_SIZE;
+      }
+      return tp_ata_if_recv(handle->ata, proto, comid, data, bcount);
+      
+    case TP_TRANS_NVME:
+      return tp_nvme_if_recv(handle->nvme, proto, comid, data, len);
+      
+    case TP_TRANS_SCSI:
+      return tp_scsi_if_recv(handle->scsi, proto, comid, data, len);
+      
+    case TP_TRANS_REPLAY:
+      return tp_replay_if_recv(handle->replay, proto, comid, data, len);
+      
+    case TP_TRANS_EMU:
+      return tp_emu_if_recv(handle->emu, proto, comid, data, len);
+      
+    default: /* No transport */
+      return tp_errno = TP_ERR_INVALID;
+  }
+}
+
+/**
+ * \brief IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive data from a particular
+ * Communication ID via a specified security protocol, using the transport
+ * attached to the drive handle.
+ *
+ * \param[in] handle Target drive
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_recv(tp_handle_t *handle, uint8_t proto,
+		      uint16_t comid, void *data, size_t len)
+{
+  uint64_t start = 0;
+  tp_errno_t rc;
+  
+  tp_if_lock(handle);
+  
+  /* no recording or deadline, no overhead */
+  if ((handle->trace == NULL) && (handle->deadline == 0))
+  {
+    rc = tp_if_recv_raw(handle, proto, comid, data, len);
+  }
+  else if (tp_if_begin(handle, &start))
+  {
+    rc = tp_errno;
+  }
+  else
+  {
+    rc = tp_if_recv_raw(handle, proto, comid, data, len);
+    tp_if_end(handle, TP_TRACE_RECV, proto, comid, data, len, rc, start);
+    if (handle->deadline != 0)
+    {
+      tp_if_set_deadline(handle, 0);
+    }
+  }
+  
+  tp_if_unlock(handle);
+  return tp_errno = rc;
+}
+
+/** Progress of a request within a batch */
+typedef enum
+{
+  TP_BATCH_WAITING = 0, /* not yet queued */
+  TP_BATCH_QUEUED,      /* in flight */
+  TP_BATCH_DONE         /* status is final */
+} tp_batch_state_t;
+
+/** Scheduling state of a batch */
+typedef struct
+{
+  tp_if_batch_t *batch;    /* requests */
+  unsigned count;          /* number of requests */
+  unsigned *group;         /* first request behind same controller */
+  unsigned *inflight;      /* commands queued, per group leader */
+  unsigned char *state;    /* tp_batch_state_t, per request */
+  uint64_t *start;         /* time queued, per request */
+} tp_batch_sched_t;
+
+/**
+ * \brief Check Batch Request Can Be Queued
+ *
+ * \param[in] req Request
+ * \return Nonzero if request can go via ATA queued commands
+ */
+static int tp_if_batch_queueable(tp_if_batch_t const *req)
+{
+  return ((req->handle != NULL) && (req->handle->trans_type == TP_TRANS_ATA) &&
+	  (req->len <= 0xffff * TP_ATA_BLOCK_SIZE));
+}
+
+/**
+ * \brief Check Batch for Queued ATA Requests
+ *
+ * \param[in] sched Batch
+ * \param[in] ata Device to look for
+ * \return Nonzero if device has requests in flight
+ */
+static int tp_if_batch_pending(tp_batch_sched_t const *sched,
+			       struct tp_ata_handle const *ata)
+{
+  unsigned i;
+  
+  for (i = 0; i < sched->count; i++)
+  {
+    if ((sched->state[i] == TP_BATCH_QUEUED) &&
+	(sched->batch[i].handle->ata == ata))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * \brief Group Batch by Controller
+ *
+ * Requests to drives behind the same controller share a group, named by
+ * the first such request. Drives of unknown topology stand alone.
+ *
+ * \param[in,out] sched Batch
+ */
+static void tp_if_batch_group(tp_batch_sched_t *sched)
+{
+  tp_handle_t const *a, *b;
+  unsigned i, j;
+  
+  for (i = 0; i < sched->count; i++)
+  {
+    sched->group[i] = i;
+    a = sched->batch[i].handle;
+    if ((a == NULL) || (a->hba[0] == '\0'))
+    {
+      continue;
+    }
+    for (j = 0; j < i; j++)
+    {
+      b = sched->batch[j].handle;
+      if ((b != NULL) && (strcmp(a->hba, b->hba) == 0))
+      {
+	sched->group[i] = sched->group[j];
+	break;
+      }
+    }
+  }
+}
+
+/**
+ * \brief Find Drive Behind Queued Requests
+ *
+ * \param[in] sched Batch
+ * \param[in] ata Device with requests in flight
+ * \return Drive handle of first such request
+ */
+static tp_handle_t *tp_if_batch_owner(tp_batch_sched_t const *sched,
+				      struct tp_ata_handle const *ata)
+{
+  unsigned i;
+  
+  for (i = 0; (i < sched->count) &&
+	 ((sched->state[i] != TP_BATCH_QUEUED) ||
+	  (sched->batch[i].handle->ata != ata)); i++);
+  return sched->batch[i].handle;
+}
+
+/**
+ * \brief Finish Queued Batch Request
+ *
+ * \param[in,out] sched Batch
+ * \param[in] i Index of request
+ * \param[in] status Outcome of request
+ */
+static void tp_if_batch_done(tp_batch_sched_t *sched, unsigned i,
+			     tp_errno_t status)
+{
+  tp_if_batch_t *req = sched->batch + i;
+  
+  req->status = status;
+  sched->state[i] = TP_BATCH_DONE;
+  sched->inflight[sched->group[i]]--;
+  tp_if_end(req->handle, TP_TRACE_RECV, req->proto, req->comid, req->data,
+	    req->len, status, sched->start[i]);
+}
+
+/**
+ * \brief Collect Completed Batch Requests
+ *
+ * \param[in,out] sched Batch
+ * \param[in] ata Device with completions waiting
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_if_batch_reap(tp_batch_sched_t *sched,
+				   struct tp_ata_handle *ata)
+{
+  tp_handle_t *owner = tp_if_batch_owner(sched, ata);
+  tp_ata_event_t events[TP_ATA_QUEUE_DEPTH];
+  unsigned i, reaped;
+  tp_errno_t rc;
+  
+  tp_if_lock(owner);
+  if ((rc = tp_ata_reap(ata, events, TP_ATA_QUEUE_DEPTH, &reaped)) == 0)
+  {
+    for (i = 0; i < reaped; i++)
+    {
+      tp_if_batch_done(sched, (tp_if_batch_t *)events[i].user - sched->batch,
+		       events[i].status);
+    }
+  }
+  tp_if_unlock(owner);
+  return tp_errno = rc;
+}
+
+/**
+ * \brief Give Up on Batch Requests
+ *
+ * Abandon whatever is still queued on a device, so nothing is left in
+ * flight against caller buffers once the batch returns.
+ *
+ * \param[in,out] sched Batch
+ * \param[in] ata Device to give up on
+ * \param[in] status Outcome to record for unfinished requests
+ * \return Number of requests abandoned
+ */
+static unsigned tp_if_batch_abandon(tp_batch_sched_t *sched,
+				    struct tp_ata_handle *ata,
+				    tp_errno_t status)
+{
+  tp_handle_t *owner = tp_if_batch_owner(sched, ata);
+  unsigned i, count = 0;
+  
+  tp_if_lock(owner);
+  tp_ata_abandon(ata);
+  for (i = 0; i < sched->count; i++)
+  {
+    if ((sched->state[i] == TP_BATCH_QUEUED) &&
+	(sched->batch[i].handle->ata == ata))
+    {
+      tp_if_batch_done(sched, i, status);
+      count++;
+    }
+  }
+  tp_if_unlock(owner);
+  return count;
+}
+
+/**
+ * \brief Queue Batch Requests
+ *
+ * Top up every controller to its limit, one request per controller per
+ * pass, so that controllers are interleaved rather than filled in order.
+ * Requests that can't be queued on an idle drive are run synchronously.
+ * Each goes out under the deadline of its drive's method call, and is
+ * traced once it completes, as with tp_if_recv().
+ *
+ * \param[in,out] sched Batch
+ */
+static void tp_if_batch_submit(tp_batch_sched_t *sched)
+{
+  tp_if_batch_t *req;
+  unsigned g, i;
+  int progress = 1;
+  tp_errno_t rc;
+  
+  while (progress)
+  {
+    progress = 0;
+    for (g = 0; g < sched->count; g++)
+    {
+      /* once per controller, if there's room */
+      if ((sched->group[g] != g) ||
+	  ((tp_trans_hba_depth != 0) &&
+	   (sched->inflight[g] >= tp_trans_hba_depth)))
+      {
+	continue;
+      }
+      
+      /* next request behind it */
+      for (i = g; (i < sched->count) &&
+	     ((sched->group[i] != g) || (sched->state[i] != TP_BATCH_WAITING));
+	   i++);
+      if (i == sched->count)
+      {
+	continue;
+      }
+      req = sched->batch + i;
+      
+      /* past its deadline already? */
+      tp_if_lock(req->handle);
+      if (tp_if_begin(req->handle, sched->start + i))
+      {
+	tp_if_unlock(req->handle);
+	req->status = tp_errno;
+	sched->state[i] = TP_BATCH_DONE;
+	progress = 1;
+	continue;
+      }
+      
+      /* timeout is fixed once queued */
+      rc = tp_ata_if_recv_async(req->handle->ata, req->proto, req->comid,
+				req->data,
+				(req->len + TP_ATA_BLOCK_SIZE - 1) /
+				TP_ATA_BLOCK_SIZE, req);
+      if (req->handle->deadline != 0)
+      {
+	tp_if_set_deadline(req->handle, 0);
+      }
+      tp_if_unlock(req->handle);
+      if (rc == 0)
+      {
+	sched->state[i] = TP_BATCH_QUEUED;
+	sched->inflight[g]++;
+	progress = 1;
+      }
+      else if ((rc != TP_ERR_SPACE) ||
+	       (!tp_if_batch_pending(sched, req->handle->ata)))
+      {
+	/* couldn't queue, do it the slow way */
+	req->status = tp_if_recv(req->handle, req->proto, req->comid,
+				 req->data, req->len);
+	sched->state[i] = TP_BATCH_DONE;
+	progress = 1;
+      }
+      
+      /* otherwise drive queue is full, wait for it to drain */
+    }
+  }
+}
+
+/**
+ * \brief Batched IF-RECV
+ *
+ * Issue IF-RECV on many drives at once. ATA drives have their commands
+ * queued together and are then serviced by a shared wait, rather than one
+ * blocking ioctl per drive; other transports are handled one at a time.
+ * No more than tp_trans_hba_depth commands are kept in flight behind any
+ * one controller, and controllers are fed in turn so none is starved.
+ * Outcome of each request is in its status field. If queued commands stop
+ * completing, whatever is still outstanding is abandoned with a timeout
+ * status, and the batch fails. Queued commands share their drive's
+ * slots, so a drive (or its channels) should be in one batch at a time.
+ *
+ * \param[in,out] batch Array of requests
+ * \param[in] count Number of requests
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_if_recv_batch(tp_if_batch_t *batch, unsigned count)
+{
+  struct tp_ata_handle **waiting;
+  tp_batch_sched_t sched;
+  tp_if_batch_t *req;
+  tp_errno_t rc = TP_ERR_SUCCESS;
+  unsigned i, j, pending;
+  int *ready;
+  
+  /* check for NULL pointers */
+  if (batch == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* scratch space for scheduling and waiting on devices */
+  sched.batch = batch;
+  sched.count = count;
+  sched.group = calloc(count, sizeof(unsigned));
+  sched.inflight = calloc(count, sizeof(unsigned));
+  sched.state = calloc(count, sizeof(unsigned char));
+  sched.start = calloc(count, sizeof(uint64_t));
+  waiting = calloc(count, sizeof(struct tp_ata_handle *));
+  ready = calloc(count, sizeof(int));
+  if ((sched.group == NULL) || (sched.inflight == NULL) ||
+      (sched.state == NULL) || (sched.start == NULL) ||
+      (waiting == NULL) || (ready == NULL))
+  {
+    free(sched.group);
+    free(sched.inflight);
+    free(sched.state);
+    free(sched.start);
+    free(waiting);
+    free(ready);
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  
+  /* anything left over at the end keeps its timeout status */
+  for (i = 0; i < count; i++)
+  {
+    batch[i].status = TP_ERR_TIMEOUT;
+    if (!tp_if_batch_queueable(batch + i))
+    {
+      sched.state[i] = TP_BATCH_DONE;
+    }
+  }
+  tp_if_batch_group(&sched);
+  
+  /* get as much in flight as controllers allow */
+  tp_if_batch_submit(&sched);
+  
+  /* the rest go one at a time, while queued ones make progress */
+  for (i = 0; i < count; i++)
+  {
+    req = batch + i;
+    if (!tp_if_batch_queueable(req))
+    {
+      req->status = (req->handle == NULL ? TP_ERR_NULL :
+		     tp_if_recv(req->handle, req->proto, req->comid,
+				req->data, req->len));
+    }
+  }
+  
+  /* and harvest them as they come in */
+  while (1)
+  {
+    /* one wait entry per device with something outstanding */
+    for (i = 0, pending = 0; i < count; i++)
+    {
+      if (sched.state[i] != TP_BATCH_QUEUED)
+      {
+	continue;
+      }
+      for (j = 0; (j < pending) && (waiting[j] != batch[i].handle->ata); j++);
+      if (j == pending)
+      {
+	waiting[pending++] = batch[i].handle->ata;
+      }
+    }
+    if (pending == 0)
+    {
+      break;
+    }
+    
+    /* nothing back in time, keep what finished and give up on the rest */
+    if (tp_ata_poll(waiting, ready, pending, BATCH_TIMEOUT_MS))
+    {
+      for (i = 0; i < pending; i++)
+      {
+	tp_if_batch_reap(&sched, waiting[i]);
+	if (tp_if_batch_abandon(&sched, waiting[i], TP_ERR_TIMEOUT))
+	{
+	  rc = TP_ERR_TIMEOUT;
+	}
+      }
+      break;
+    }
+    
+    /* a device we can't reap from won't get any better */
+    for (i = 0; i < pending; i++)
+    {
+      if ((ready[i]) && (tp_if_batch_reap(&sched, waiting[i])))
+      {
+	rc = tp_errno;
+	tp_if_batch_abandon(&sched, waiting[i], rc);
+      }
+    }
+    
+    /* room freed up behind some controllers */
+    tp_if_batch_submit(&sched);
+  }
+  
+  free(sched.group);
+  free(sched.inflight);
+  free(sched.state);
+  free(sched.start);
+  free(waiting);
+  free(ready);
+  return tp_errno = rc;
+}
@@ -34,6 +34,147 @@
 #include <topaz/errno.h>
 #include <topaz/transport_ata.h>
 
+/**
+ * \brief Classify ATA Status
+ *
+ * \param[in] info Decoded sense data, with ATA registers
+ * \return Classification of outcome
+ */
+static tp_ata_class_t tp_ata_classify_ata(tp_ata_sense_t const *info)
+{
+  /* BSY - device never finished with command */
+  if (info->status & 0x80)
+  {
+    return TP_ATA_CLASS_TRANSIENT;
+  }
+  
+  /* DF - device fault */
+  if (info->status & 0x20)
+  {
+    return TP_ATA_CLASS_FATAL;
+  }
+  
+  /* ERR - look at error register */
+  if (info->status & 0x01)
+  {
+    if (info->error & 0x80) /* ICRC - interface CRC, data got mangled */
+    {
+      return TP_ATA_CLASS_TRANSIENT;
+    }
+    if (info->error & 0x04) /* ABRT - command (or its arguments) refused */
+    {
+      return TP_ATA_CLASS_REJECTED;
+    }
+    return TP_ATA_CLASS_FATAL;
+  }
+  
+  return TP_ATA_CLASS_OK;
+}
+
+/**
+ * \brief Classify SCSI Sense Key
+ *
+ * \param[in] info Decoded sense data, without ATA registers
+ * \return Classification of outcome
+ */
+static tp_ata_class_t tp_ata_classify_key(tp_ata_sense_t const *info)
+{
+  switch (info->sense_key)
+  {
+    case 0x00: /* NO SENSE */
+    case 0x01: /* RECOVERED ERROR */
+      return TP_ATA_CLASS_OK;
+      
+    case 0x02: /* NOT READY - only if on its way to ready */
+      return (info->asc == 0x04 ? TP_ATA_CLASS_TRANSIENT : TP_ATA_CLASS_FATAL);
+      
+    case 0x05: /* ILLEGAL REQUEST */
+      return TP_ATA_CLASS_REJECTED;
+      
+    case 0x06: /* UNIT ATTENTION - reset, power on, etc */
+    case 0x0b: /* ABORTED COMMAND - without ATA status, a bus problem */
+      return TP_ATA_CLASS_TRANSIENT;
+      
+    default: /* MEDIUM ERROR, HARDWARE ERROR, etc */
+      return TP_ATA_CLASS_FATAL;
+  }
+}
+
+/**
+ * \brief Decode SAT Sense Data
+ *
+ * Pull sense key and ATA Error / Status registers out of fixed or
+ * descriptor format sense data, and classify the outcome.
+ *
+ * \param[out] info Decoded sense data
+ * \param[in] sense Raw sense data
+ * \param[in] len Size of sense data
+ * \return Classification of outcome
+ */
+tp_ata_class_t tp_ata_decode_sense(tp_ata_sense_t *info, void const *sense,
+				   size_t len)
+{
+  uint8_t const *raw = sense;
+  size_t idx, end;
+  
+  memset(info, 0, sizeof(*info));
+  info->cls = TP_ATA_CLASS_FATAL;
+  if ((raw == NULL) || (len < 8))
+  {
+    return info->cls;
+  }
+  
+  switch (raw[0] & 0x7f)
+  {
+    case 0x72: /* descriptor format (current / deferred) */
+    case 0x73:
+      info->sense_key = raw[1] & 0x0f;
+      info->asc = raw[2];
+      info->ascq = raw[3];
+      
+      /* hunt for ATA Status Return descriptor */
+      end = 8 + raw[7];
+      for (idx = 8; (idx + 2 <= end) && (idx + 2 <= len);
+	   idx += 2 + raw[idx + 1])
+      {
+	if ((raw[idx] == 0x09) && (raw[idx + 1] == 0x0c) && (idx + 14 <= len))
+	{
+	  info->has_ata = 1;
+	  info->error = raw[idx + 3];
+	  info->status = raw[idx + 13];
+	  break;
+	}
+      }
+      break;
+      
+    case 0x70: /* fixed format (current / deferred) */
+    case 0x71:
+      if (len < 14)
+      {
+	return info->cls;
+      }
+      info->sense_key = raw[2] & 0x0f;
+      info->asc = raw[12];
+      info->ascq = raw[13];
+      
+      /* ATA registers land in the information field */
+      if ((info->asc == 0x00) && (info->ascq == 0x1d))
+      {
+	info->has_ata = 1;
+	info->error = raw[3];
+	info->status = raw[4];
+      }
+      break;
+      
+    default: /* not sense data we know */
+      return info->cls;
+  }
+  
+  info->cls = (info->has_ata ?
+	       tp_ata_classify_ata(info) : tp_ata_classify_key(info));
+  return info->cls;
+}
+
 /**
  * \brief ATA Identify
  *
@@ -85,10 +226,185 @@ tp_errno_t tp_ata_probe_tpm(struct tp_ata_handle *handle)
     return tp_errno = TP_ERR_NO_TPM;
   }
   
+  /* Trusted DMA commands are worth a try if device does DMA at all */
+  if (id_data[49] & 0x0100)
+  {
+    TP_DEBUG(1) printf("Device supports DMA, probing Trusted DMA\n");
+    tp_ata_set_trusted_mode(handle, TP_ATA_TRUSTED_DMA_PROBE);
+  }
+  else
+  {
+    tp_ata_set_trusted_mode(handle, TP_ATA_TRUSTED_PIO);
+  }
+  
   /* looks ok */
   return tp_errno = TP_ERR_SUCCESS;
 }
 
+/**
+ * \brief Narrow ATA16 Command
+ *
+ * Copy registers of an ATA16 command (sans extended bytes) to ATA12 form
+ *
+ * \param[out] cmd12 ATA12 command
+ * \param[in] cmd ATA16 command
+ */
+static void tp_ata_narrow_cmd(tp_ata_cmd12_t *cmd12, tp_ata_cmd16_t const *cmd)
+{
+  cmd12->feature  = cmd->feature;
+  cmd12->count    = cmd->count;
+  cmd12->lba_low  = cmd->lba_low;
+  cmd12->lba_mid  = cmd->lba_mid;
+  cmd12->lba_high = cmd->lba_high;
+  cmd12->device   = cmd->device;
+  cmd12->command  = cmd->command;
+}
+
+/**
+ * \brief Execute Trusted Command (ATA12 or ATA16)
+ *
+ * Issue a Trusted Send / Receive, picking ATA12 pass through when the
+ * transfer fits an 8 bit sector count, and ATA16 (with the extend bit set)
+ * when it does not.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd ATA16 command, complete with command code
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_exec_sized(struct tp_ata_handle *handle,
+				    tp_ata_cmd16_t const *cmd,
+				    tp_ata_oper_type_t optype,
+				    void *data, uint16_t bcount)
+{
+  tp_ata_cmd12_t cmd12;
+  
+  /* Large transfers need the 16 bit sector count of ATA16 */
+  if (bcount > 0xff)
+  {
+    return tp_ata_exec16(handle, cmd, optype, data, bcount, 5);
+  }
+  
+  /* Otherwise prefer ATA12, which every SAT layer knows */
+  tp_ata_narrow_cmd(&cmd12, cmd);
+  return tp_ata_exec12(handle, &cmd12, optype, data, bcount, 5);
+}
+
+/**
+ * \brief Check for Rejected DMA Opcode
+ *
+ * Decide from the sense data of a failed Trusted DMA command whether it
+ * was the DMA opcode itself that was refused, by the drive (ABRT) or by
+ * the SAT layer (ILLEGAL REQUEST), rather than some other failure.
+ *
+ * \param[in] handle Device handle
+ * \return Nonzero if PIO is worth a try
+ */
+static int tp_ata_dma_rejected(struct tp_ata_handle *handle)
+{
+  tp_ata_sense_t info;
+  
+  if ((tp_ata_get_sense(handle, &info) != 0) ||
+      (info.cls != TP_ATA_CLASS_REJECTED))
+  {
+    return 0;
+  }
+  
+  /* drive aborted the command */
+  if (info.has_ata)
+  {
+    return ((info.error & 0x04) != 0);
+  }
+  
+  /* SAT layer doesn't know the opcode, or won't pass DMA protocol */
+  return ((info.sense_key == 0x05) &&
+	  ((info.asc == 0x20) || (info.asc == 0x24)) && (info.ascq == 0x00));
+}
+
+/**
+ * \brief Execute Trusted Command
+ *
+ * Issue a Trusted Send / Receive using DMA where possible, falling back
+ * (permanently for this device) to PIO if the DMA opcode is rejected and
+ * PIO then works. Any other failure is returned as is, and DMA is tried
+ * again next time.
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] cmd ATA16 command, less the command code
+ * \param[in] optype Operation type / direction (PIO form)
+ * \param[in,out] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_exec_trusted(struct tp_ata_handle *handle,
+				      tp_ata_cmd16_t *cmd,
+				      tp_ata_oper_type_t optype,
+				      void *data, uint16_t bcount)
+{
+  tp_ata_trusted_mode_t mode = tp_ata_get_trusted_mode(handle);
+  int write = (optype == TP_ATA_OPER_WRITE);
+  
+  /* DMA - Trusted Send (0x5f) / Trusted Receive (0x5d) */
+  if (mode != TP_ATA_TRUSTED_PIO)
+  {
+    cmd->command = (write ? 0x5f : 0x5d);
+    if (tp_ata_exec_sized(handle, cmd,
+			  (write ? TP_ATA_OPER_WRITE_DMA : TP_ATA_OPER_READ_DMA),
+			  data, bcount) == 0)
+    {
+      tp_ata_set_trusted_mode(handle, TP_ATA_TRUSTED_DMA);
+      return tp_errno = TP_ERR_SUCCESS;
+    }
+    
+    /* DMA has worked before, or failed for some other reason */
+    if ((mode == TP_ATA_TRUSTED_DMA) || (!tp_ata_dma_rejected(handle)))
+    {
+      return tp_errno;
+    }
+  }
+  
+  /* PIO - Trusted Send (0x5e) / Trusted Receive (0x5c) */
+  cmd->command = (write ? 0x5e : 0x5c);
+  if (tp_ata_exec_sized(handle, cmd, optype, data, bcount))
+  {
+    return tp_errno;
+  }
+  
+  /* controller won't do DMA, remember that */
+  if (mode != TP_ATA_TRUSTED_PIO)
+  {
+    TP_DEBUG(1) printf("Trusted DMA rejected, using PIO\n");
+    tp_ata_set_trusted_mode(handle, TP_ATA_TRUSTED_PIO);
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Build Trusted Command
+ *
+ * Fill in ATA registers common to Trusted Send / Receive. ACS places the
+ * transfer length in Count (7:0) and LBA Low (15:8); the same length is
+ * mirrored into the extended count so the SAT layer sizes the transfer.
+ *
+ * \param[out] cmd ATA16 command
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ */
+static void tp_ata_build_trusted(tp_ata_cmd16_t *cmd, uint8_t proto,
+				 uint16_t comid, uint16_t bcount)
+{
+  memset(cmd, 0, sizeof(*cmd));
+  cmd->feature      = proto;
+  cmd->count        = bcount & 0xff;
+  cmd->count_ext    = bcount >> 8;
+  cmd->lba_low      = bcount >> 8;
+  cmd->lba_mid      = comid & 0xff;
+  cmd->lba_high     = comid >> 8;
+}
+
 /**
  * \brief ATA IF-SEND
  *
@@ -104,19 +420,14 @@ tp_errno_t tp_ata_probe_tpm(struct tp_ata_handle *handle)
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_ata_if_send(struct tp_ata_handle *handle, uint8_t proto,
-			  uint16_t comid, void *data, uint8_t bcount)
+			  uint16_t comid, void *data, uint16_t bcount)
 {
-  /* Build ATA12 Command - Trusted Send (0x5e) */
-  tp_ata_cmd12_t cmd;
-  memset(&cmd, 0, sizeof(cmd));
-  cmd.feature      = proto;
-  cmd.count        = bcount;
-  cmd.lba_mid      = comid & 0xff;
-  cmd.lba_high     = comid >> 8;
-  cmd.command      = 0x5e;
+  /* Build ATA Command - Trusted Send */
+  tp_ata_cmd16_t cmd;
+  tp_ata_build_trusted(&cmd, proto, comid, bcount);
   
   /* Off it goes */
-  return tp_ata_exec12(handle, &cmd, TP_ATA_OPER_WRITE, data, bcount, 5);
+  return tp_ata_exec_trusted(handle, &cmd, TP_ATA_OPER_WRITE, data, bcount);
 }
 
 /**
@@ -134,17 +445,104 @@ tp_errno_t tp_ata_if_send(struct tp_ata_handle *handle, uint8_t proto,
  * \return 0 on success, error code indicating failure
  */
 tp_errno_t tp_ata_if_recv(struct tp_ata_handle *handle, uint8_t proto,
-			  uint16_t comid, void *data, uint8_t bcount)
+			  uint16_t comid, void *data, uint16_t bcount)
 {
-  /* Build ATA12 command - Trusted Receive (0x5c) */
-  tp_ata_cmd12_t cmd;
-  memset(&cmd, 0, sizeof(cmd));
-  cmd.feature      = proto;
-  cmd.count        = bcount;
-  cmd.lba_mid      = comid & 0xff;
-  cmd.lba_high     = comid >> 8;
-  cmd.command      = 0x5c;
+  /* Build ATA command - Trusted Receive */
+  tp_ata_cmd16_t cmd;
+  tp_ata_build_trusted(&cmd, proto, comid, bcount);
   
   /* Off it goes */
-  return tp_ata_exec12(handle, &cmd, TP_ATA_OPER_READ, data, bcount, 5);
+  return tp_ata_exec_trusted(handle, &cmd, TP_ATA_OPER_READ, data, bcount);
+}
+
+/**
+ * \brief Queue Trusted Command
+ *
+ * Asynchronous counterpart of tp_ata_exec_trusted(). There is no room
+ * to retry here, so DMA is only used once it is known to work.
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] cmd ATA16 command, less the command code
+ * \param[in] write Nonzero for Trusted Send
+ * \param[in,out] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_submit_trusted(struct tp_ata_handle *handle,
+					tp_ata_cmd16_t *cmd, int write,
+					void *data, uint16_t bcount,
+					void *user)
+{
+  tp_ata_cmd12_t cmd12;
+  tp_ata_oper_type_t optype;
+  
+  /* DMA 0x5f / 0x5d, otherwise PIO 0x5e / 0x5c */
+  if (tp_ata_get_trusted_mode(handle) == TP_ATA_TRUSTED_DMA)
+  {
+    cmd->command = (write ? 0x5f : 0x5d);
+    optype = (write ? TP_ATA_OPER_WRITE_DMA : TP_ATA_OPER_READ_DMA);
+  }
+  else
+  {
+    cmd->command = (write ? 0x5e : 0x5c);
+    optype = (write ? TP_ATA_OPER_WRITE : TP_ATA_OPER_READ);
+  }
+  
+  /* Large transfers need the 16 bit sector count of ATA16 */
+  if (bcount > 0xff)
+  {
+    return tp_ata_submit16(handle, cmd, optype, data, bcount, 5, user);
+  }
+  
+  tp_ata_narrow_cmd(&cmd12, cmd);
+  return tp_ata_submit12(handle, &cmd12, optype, data, bcount, 5, user);
+}
+
+/**
+ * \brief ATA IF-SEND (Queued)
+ *
+ * Queue a TCG SWG IF-SEND without waiting for it to complete. Completion
+ * is collected with tp_ata_reap(). Uses Trusted DMA only once the device
+ * has been seen to accept it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_if_send_async(struct tp_ata_handle *handle, uint8_t proto,
+				uint16_t comid, void *data, uint16_t bcount,
+				void *user)
+{
+  tp_ata_cmd16_t cmd;
+  tp_ata_build_trusted(&cmd, proto, comid, bcount);
+  return tp_ata_submit_trusted(handle, &cmd, 1, data, bcount, user);
+}
+
+/**
+ * \brief ATA IF-RECV (Queued)
+ *
+ * Queue a TCG SWG IF-RECV without waiting for it to complete. Completion
+ * is collected with tp_ata_reap(). Uses Trusted DMA only once the device
+ * has been seen to accept it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_if_recv_async(struct tp_ata_handle *handle, uint8_t proto,
+				uint16_t comid, void *data, uint16_t bcount,
+				void *user)
+{
+  tp_ata_cmd16_t cmd;
+  tp_ata_build_trusted(&cmd, proto, comid, bcount);
+  return tp_ata_submit_trusted(handle, &cmd, 0, data, bcount, user);
 }
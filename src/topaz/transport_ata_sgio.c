@@ -33,18 +33,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
 #include <scsi/sg.h>
 #include <topaz/debug.h>
 #include <topaz/errno.h>
 #include <topaz/transport_ata.h>
 
+/* not all userspace copies of scsi/sg.h carry this one */
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 0x20
+#endif
+
+/** Outstanding asynchronous command */
+struct tp_ata_slot
+{
+  struct sg_io_hdr sg_io;  /** Queued ioctl data structure */
+  unsigned char cdb[16];   /** Command descriptor block */
+  unsigned char sense[32]; /** SCSI sense (error) data */
+  void *user;              /** Caller context */
+  int in_use;              /** Slot currently queued */
+};
+
 /** Linux device handle */
 struct tp_ata_handle
 {
   int fd; /** POSIX file descriptor */
+  tp_ata_trusted_mode_t trusted_mode; /** Trusted Send / Receive protocol */
+  int sg_fd; /** Non-blocking sg node for queued commands, or -1 */
+  struct tp_ata_slot *slots; /** Queued command slots, allocated on demand */
+  void *map; /** sg reserved buffer mapped for zero copy I/O, or NULL */
+  size_t map_len; /** Size of mapping */
+  void *old_map; /** Mapping left behind by abandoned queue, or NULL */
+  size_t old_map_len; /** Size of abandoned mapping */
+  tp_ata_retry_mode_t retry_mode; /** Handling of transient failures */
+  unsigned int retry_tries; /** Attempts at each command */
+  unsigned int retry_delay_us; /** First backoff delay */
+  tp_ata_sense_t sense; /** Decoded status of last synchronous command */
+  unsigned int timeout_ms; /** Override of per-command timeout, or 0 */
 };
 
 /**
@@ -108,6 +142,10 @@ struct tp_ata_handle *tp_ata_open(char const *path)
   /* all done */
   tp_errno = TP_ERR_SUCCESS;
   handle->fd = fd;
+  handle->sg_fd = -1;
+  handle->retry_mode = TP_ATA_RETRY_BACKOFF;
+  handle->retry_tries = TP_ATA_RETRY_TRIES;
+  handle->retry_delay_us = TP_ATA_RETRY_DELAY_US;
   return handle;
   
   cleanup: /* on failure */
@@ -146,82 +184,188 @@ tp_errno_t tp_ata_close(struct tp_ata_handle *handle)
   }
   
   /* cleanup */
+  if (handle->map != NULL)
+  {
+    munmap(handle->map, handle->map_len);
+  }
+  if (handle->old_map != NULL)
+  {
+    munmap(handle->old_map, handle->old_map_len);
+  }
+  if (handle->sg_fd != -1)
+  {
+    close(handle->sg_fd);
+  }
   close(handle->fd);
+  free(handle->slots);
   free(handle);
   return 0;
 }
 
 /**
- * \brief Execute ATA12 Command (OS Specific)
+ * \brief Get Trusted Transfer Mode (OS Specific)
  *
- * OS-agnostic API to execute an ATA12 command
+ * Query which Trusted Send / Receive protocol is in use for device
  *
  * \param[in] handle Device handle
- * \param[in] cmd Pointer to ATA12 command structure
+ * \return Current transfer mode
+ */
+tp_ata_trusted_mode_t tp_ata_get_trusted_mode(struct tp_ata_handle *handle)
+{
+  return handle->trusted_mode;
+}
+
+/**
+ * \brief Set Trusted Transfer Mode (OS Specific)
+ *
+ * Remember which Trusted Send / Receive protocol to use for device
+ *
+ * \param[in] handle Device handle
+ * \param[in] mode New transfer mode
+ */
+void tp_ata_set_trusted_mode(struct tp_ata_handle *handle,
+			     tp_ata_trusted_mode_t mode)
+{
+  handle->trusted_mode = mode;
+}
+
+/**
+ * \brief Set Retry Policy (OS Specific)
+ *
+ * Choose how synchronous commands failing with a transient error (bus
+ * busy, unit attention, interface CRC, etc) are retried. Queued commands
+ * are never retried, their transient failures report TP_ERR_TRANSIENT.
+ * Nor is a Trusted Send after a bus reset or host adapter soft error, as
+ * the device may already have acted on it.
+ *
+ * \param[in] handle Device handle
+ * \param[in] mode Retry policy
+ * \param[in] tries Attempts at command, including the first
+ * \param[in] delay_us First backoff delay in microseconds (backoff only)
+ */
+void tp_ata_set_retry(struct tp_ata_handle *handle, tp_ata_retry_mode_t mode,
+		      unsigned int tries, unsigned int delay_us)
+{
+  handle->retry_mode = mode;
+  handle->retry_tries = (tries == 0 ? 1 : tries);
+  handle->retry_delay_us = delay_us;
+}
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_ata_set_timeout(struct tp_ata_handle *handle, unsigned int timeout_ms)
+{
+  handle->timeout_ms = timeout_ms;
+}
+
+/**
+ * \brief Get Last Sense Data (OS Specific)
+ *
+ * Fetch decoded status of last synchronous command on device
+ *
+ * \param[in] handle Device handle
+ * \param[out] info Decoded sense data
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_get_sense(struct tp_ata_handle *handle,
+			    tp_ata_sense_t *info)
+{
+  /* check for NULL pointers */
+  if ((handle == NULL) || (info == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  memcpy(info, &handle->sense, sizeof(*info));
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Fill SAT Pass Through Request
+ *
+ * Common guts of ATA12 / ATA16 pass through. Caller fills in the command
+ * descriptor block opcode, extend bit, and ATA registers.
+ *
+ * \param[out] sg_io Request to fill in
+ * \param[in,out] cdb Command descriptor block
+ * \param[in] cdb_len Size of command descriptor block
  * \param[in] optype Operation type / direction
  * \param[in,out] data Data buffer for operation
  * \param[in] bcount Count of 512 byte blocks to transfer
- * \param[in] wait Timeout in seconds
+ * \param[in] timeout_ms Timeout in milliseconds
+ * \param[out] sense Buffer for SCSI sense data (32 bytes)
  * \return 0 on success, error code indicating failure
  */
-tp_errno_t tp_ata_exec12(struct tp_ata_handle *handle, tp_ata_cmd12_t const *cmd,
-			 tp_ata_oper_type_t optype, void *data,
-			 uint8_t bcount, int wait)
+static tp_errno_t tp_ata_fill_sat(struct sg_io_hdr *sg_io,
+				  unsigned char *cdb, unsigned char cdb_len,
+				  tp_ata_oper_type_t optype, void *data,
+				  uint16_t bcount, unsigned int timeout_ms,
+				  unsigned char *sense)
 {
-  struct sg_io_hdr sg_io;  // ioctl data structure
-  unsigned char cdb[12];   // Command descriptor block
-  unsigned char sense[32]; // SCSI sense (error) data
-  int rc;
-  
   // Initialize structures
-  memset(&sg_io, 0, sizeof(sg_io));
-  memset(&cdb, 0, sizeof(cdb));
-  memset(&sense, 0, sizeof(sense));
+  memset(sg_io, 0, sizeof(*sg_io));
+  memset(sense, 0, 32);
   
   ////
-  // Fill in ioctl data for ATA12 pass through
+  // Fill in ioctl data for ATA pass through
   //
   
   // Mandatory per interface
-  sg_io.interface_id    = 'S';
+  sg_io->interface_id    = 'S';
   
   // Location, size of command descriptor block (command)
-  sg_io.cmdp            = cdb;
-  sg_io.cmd_len         = sizeof(cdb);
+  sg_io->cmdp            = cdb;
+  sg_io->cmd_len         = cdb_len;
   
   // Command data transfer (optional)
-  sg_io.dxferp          = data;
-  sg_io.dxfer_len       = bcount * TP_ATA_BLOCK_SIZE;
+  sg_io->dxferp          = data;
+  sg_io->dxfer_len       = bcount * TP_ATA_BLOCK_SIZE;
   
   // Sense (error) data
-  sg_io.sbp             = sense;
-  sg_io.mx_sb_len       = sizeof(sense);
+  sg_io->sbp             = sense;
+  sg_io->mx_sb_len       = 32;
   
   // Timeout (ms)
-  sg_io.timeout         = wait * 1000;
+  sg_io->timeout         = timeout_ms;
   
   ////
   // Fill in SCSI command
   //
   
-  // Byte 0: ATA12 pass through
-  cdb[0] = 0xA1;
-  
-  // Byte 1: ATA protocol (read/write/none)
+  // Byte 1: ATA protocol (read/write/none), extend bit left alone
   // Byte 2: Check condition, blocks, size, I/O direction
   // Final direction specific bits
   switch (optype)
   {
     case TP_ATA_OPER_READ:
-      sg_io.dxfer_direction = SG_DXFER_FROM_DEV;
-      cdb[1] = 4 << 1; // ATA PIO-in
-      cdb[2] = 0x2e;   // Check, blocks, size in sector count, read
+      sg_io->dxfer_direction = SG_DXFER_FROM_DEV;
+      cdb[1] |= 4 << 1; // ATA PIO-in
+      cdb[2] = 0x2e;    // Check, blocks, size in sector count, read
       break;
 
     case TP_ATA_OPER_WRITE:
-      sg_io.dxfer_direction = SG_DXFER_TO_DEV;
-      cdb[1] = 5 << 1; // ATA PIO-out
-      cdb[2] = 0x26;   // Check, blocks, size in sector count
+      sg_io->dxfer_direction = SG_DXFER_TO_DEV;
+      cdb[1] |= 5 << 1; // ATA PIO-out
+      cdb[2] = 0x26;    // Check, blocks, size in sector count
+      break;
+
+    case TP_ATA_OPER_READ_DMA:
+      sg_io->dxfer_direction = SG_DXFER_FROM_DEV;
+      cdb[1] |= 6 << 1; // ATA DMA
+      cdb[2] = 0x2e;    // Check, blocks, size in sector count, read
+      break;
+
+    case TP_ATA_OPER_WRITE_DMA:
+      sg_io->dxfer_direction = SG_DXFER_TO_DEV;
+      cdb[1] |= 6 << 1; // ATA DMA
+      cdb[2] = 0x26;    // Check, blocks, size in sector count
       break;
       
     default: // Invalid
@@ -229,58 +373,758 @@ tp_errno_t tp_ata_exec12(struct tp_ata_handle *handle, tp_ata_cmd12_t const *cmd
       break;
   }
   
-  // Rest of ATA12 command get copied here (7 bytes)
-  memcpy(cdb + 3, cmd, 7);
-  
-  ////
-  // Run ioctl
-  //
-  
   // Debug output command
   TP_DEBUG(4)
   {
-    // Command descriptor block
-    printf("ATA Command:\n");
-    tp_debug_dump(cmd, sizeof(*cmd));
-    
     // Command descriptor block
     printf("SCSI CDB:\n");
-    tp_debug_dump(cdb, sizeof(cdb));
+    tp_debug_dump(cdb, cdb_len);
     
     // Data out?
-    if (optype == TP_ATA_OPER_WRITE)
+    if ((optype == TP_ATA_OPER_WRITE) || (optype == TP_ATA_OPER_WRITE_DMA))
     {
       printf("Write Data:\n");
       tp_debug_dump(data, bcount * TP_ATA_BLOCK_SIZE);
     }
   }
   
-  // System call
-  rc = ioctl(handle->fd, SG_IO, &sg_io);
-  if (rc != 0)
-  {
-    return tp_errno = TP_ERR_IOCTL;
-  }
+  return 0;
+}
+
+/**
+ * \brief Check SAT Pass Through Result
+ *
+ * Decode and classify status of a completed request. Failures of the
+ * host adapter (or SCSI status BUSY) are classified without sense data.
+ *
+ * \param[in] sg_io Completed request
+ * \param[out] info Decoded status
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_check_sat(struct sg_io_hdr const *sg_io,
+				   tp_ata_sense_t *info)
+{
   
   // Debug input
-  if (optype == TP_ATA_OPER_READ)
+  if (sg_io->dxfer_direction == SG_DXFER_FROM_DEV)
   { 
     TP_DEBUG(4)
     {
       printf("Read Data:\n");
-      tp_debug_dump(data, bcount * TP_ATA_BLOCK_SIZE);
+      tp_debug_dump(sg_io->dxferp, sg_io->dxfer_len);
+    }
+  }
+  
+  // Host adapter trouble, command likely never reached device
+  switch (sg_io->host_status)
+  {
+    case 0x00: // DID_OK
+      break;
+      
+    case 0x03: // DID_TIME_OUT - device may have acted on it, don't retry
+      memset(info, 0, sizeof(*info));
+      info->cls = TP_ATA_CLASS_FATAL;
+      return tp_errno = TP_ERR_TIMEOUT;
+      
+    case 0x02: // DID_BUS_BUSY
+    case 0x08: // DID_RESET
+    case 0x0b: // DID_SOFT_ERROR
+    case 0x0c: // DID_IMM_RETRY
+    case 0x0d: // DID_REQUEUE
+      memset(info, 0, sizeof(*info));
+      info->cls = TP_ATA_CLASS_TRANSIENT;
+      return tp_errno = TP_ERR_TRANSIENT;
+      
+    default:
+      memset(info, 0, sizeof(*info));
+      info->cls = TP_ATA_CLASS_FATAL;
+      return tp_errno = TP_ERR_IOCTL;
+  }
+  
+  // BUSY / TASK SET FULL
+  if ((sg_io->status == 0x08) || (sg_io->status == 0x28))
+  {
+    memset(info, 0, sizeof(*info));
+    info->cls = TP_ATA_CLASS_TRANSIENT;
+    return tp_errno = TP_ERR_TRANSIENT;
+  }
+  
+  // Check sense data (check condition bit asks for ATA Status Return)
+  switch (tp_ata_decode_sense(info, sg_io->sbp, sg_io->sb_len_wr))
+  {
+    case TP_ATA_CLASS_OK:
+      return tp_errno = TP_ERR_SUCCESS;
+      
+    case TP_ATA_CLASS_TRANSIENT:
+      tp_errno = TP_ERR_TRANSIENT;
+      break;
+      
+    case TP_ATA_CLASS_REJECTED:
+      tp_errno = TP_ERR_ATA_ABORT;
+      break;
+      
+    default:
+      tp_errno = (info->has_ata ? TP_ERR_ATA_ERROR : TP_ERR_SENSE);
+      break;
+  }
+  
+  TP_DEBUG(2) printf("ATA sense key %x, asc %02x/%02x, error %02x, "
+		     "status %02x\n", info->sense_key, info->asc, info->ascq,
+		     info->error, info->status);
+  return tp_errno;
+}
+
+/**
+ * \brief Check SAT Pass Through Is Safe To Repeat
+ *
+ * A bus reset, or a soft error in the host adapter, may strike after the
+ * device took the command, so it is unclear whether it was acted on.
+ * That is harmless for reads, but repeating a Trusted Send could run a
+ * method twice. Other transient failures (BUSY / TASK SET FULL status,
+ * host adapter busy or requeue) mean the command was never accepted, so
+ * it is safe to issue again.
+ *
+ * \param[in] sg_io Completed request, failed with a transient error
+ * \param[in] optype Operation type / direction
+ * \return Nonzero if request may be issued again
+ */
+static int tp_ata_sat_repeatable(struct sg_io_hdr const *sg_io,
+				 tp_ata_oper_type_t optype)
+{
+  if ((optype != TP_ATA_OPER_WRITE) && (optype != TP_ATA_OPER_WRITE_DMA))
+  {
+    return 1;
+  }
+  
+  return ((sg_io->host_status != 0x08) && // DID_RESET
+	  (sg_io->host_status != 0x0b));  // DID_SOFT_ERROR
+}
+
+/**
+ * \brief Execute SAT Pass Through Command
+ *
+ * Run a filled in ATA12 / ATA16 command descriptor block to completion
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] cdb Command descriptor block
+ * \param[in] cdb_len Size of command descriptor block
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_exec_sat(struct tp_ata_handle *handle,
+				  unsigned char *cdb, unsigned char cdb_len,
+				  tp_ata_oper_type_t optype, void *data,
+				  uint16_t bcount, int wait)
+{
+  struct sg_io_hdr sg_io;  // ioctl data structure
+  unsigned char sense[32]; // SCSI sense (error) data
+  struct timespec delay;
+  unsigned int attempt;
+  uint64_t delay_us;
+  
+  for (attempt = 1; ; attempt++)
+  {
+    // No sense from this command yet, don't leave the last one's about
+    memset(&handle->sense, 0, sizeof(handle->sense));
+    handle->sense.cls = TP_ATA_CLASS_FATAL;
+    
+    if (tp_ata_fill_sat(&sg_io, cdb, cdb_len, optype, data, bcount,
+			(handle->timeout_ms ? handle->timeout_ms : wait * 1000),
+			sense))
+    {
+      return tp_errno;
+    }
+    
+    // System call, zero copy requests must go via the sg node
+    if ((data != NULL) && (data == handle->map))
+    {
+      sg_io.flags |= SG_FLAG_MMAP_IO;
+      if (ioctl(handle->sg_fd, SG_IO, &sg_io) != 0)
+      {
+	return tp_errno = TP_ERR_IOCTL;
+      }
+    }
+    else if (ioctl(handle->fd, SG_IO, &sg_io) != 0)
+    {
+      return tp_errno = TP_ERR_IOCTL;
+    }
+    
+    // Only transient failures are worth another go
+    if ((tp_ata_check_sat(&sg_io, &handle->sense) != TP_ERR_TRANSIENT) ||
+	(!tp_ata_sat_repeatable(&sg_io, optype)) ||
+	(handle->retry_mode == TP_ATA_RETRY_FAIL_FAST) ||
+	(attempt >= handle->retry_tries))
+    {
+      return tp_errno;
+    }
+    
+    // Back off, doubling each time
+    TP_DEBUG(1) printf("Transient ATA failure, retry %u\n", attempt);
+    if (handle->retry_mode == TP_ATA_RETRY_BACKOFF)
+    {
+      delay_us = (uint64_t)handle->retry_delay_us << (attempt - 1);
+      delay.tv_sec = delay_us / 1000000;
+      delay.tv_nsec = (delay_us % 1000000) * 1000;
+      nanosleep(&delay, NULL);
+    }
+  }
+}
+
+/**
+ * \brief Build ATA12 Command Descriptor Block
+ *
+ * \param[out] cdb Command descriptor block (12 bytes)
+ * \param[in] cmd Pointer to ATA12 command structure
+ * \return Size of command descriptor block
+ */
+static unsigned char tp_ata_cdb12(unsigned char *cdb, tp_ata_cmd12_t const *cmd)
+{
+  memset(cdb, 0, 12);
+  
+  // Byte 0: ATA12 pass through
+  cdb[0] = 0xA1;
+  
+  // Rest of ATA12 command get copied here (7 bytes)
+  memcpy(cdb + 3, cmd, 7);
+  
+  // Debug output command
+  TP_DEBUG(4)
+  {
+    printf("ATA Command:\n");
+    tp_debug_dump(cmd, sizeof(*cmd));
+  }
+  
+  return 12;
+}
+
+/**
+ * \brief Build ATA16 Command Descriptor Block
+ *
+ * \param[out] cdb Command descriptor block (16 bytes)
+ * \param[in] cmd Pointer to ATA16 command structure
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \return Size of command descriptor block
+ */
+static unsigned char tp_ata_cdb16(unsigned char *cdb, tp_ata_cmd16_t const *cmd,
+				  uint16_t bcount)
+{
+  memset(cdb, 0, 16);
+  
+  // Byte 0: ATA16 pass through
+  cdb[0] = 0x85;
+  
+  // Byte 1: Extend bit, so SAT layer sees the 16 bit sector count
+  if (bcount > 0xff)
+  {
+    cdb[1] = 0x01;
+  }
+  
+  // Rest of ATA16 command get copied here (12 bytes)
+  memcpy(cdb + 3, cmd, 12);
+  
+  // Debug output command
+  TP_DEBUG(4)
+  {
+    printf("ATA Command:\n");
+    tp_debug_dump(cmd, sizeof(*cmd));
+  }
+  
+  return 16;
+}
+
+/**
+ * \brief Execute ATA12 Command (OS Specific)
+ *
+ * OS-agnostic API to execute an ATA12 command
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA12 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_exec12(struct tp_ata_handle *handle, tp_ata_cmd12_t const *cmd,
+			 tp_ata_oper_type_t optype, void *data,
+			 uint8_t bcount, int wait)
+{
+  unsigned char cdb[12];   // Command descriptor block
+  
+  return tp_ata_exec_sat(handle, cdb, tp_ata_cdb12(cdb, cmd), optype,
+			 data, bcount, wait);
+}
+
+/**
+ * \brief Execute ATA16 Command (OS Specific)
+ *
+ * OS-agnostic API to execute an ATA16 command. The extended (16 bit)
+ * sector count is used whenever more than 255 blocks are transferred.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA16 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_exec16(struct tp_ata_handle *handle, tp_ata_cmd16_t const *cmd,
+			 tp_ata_oper_type_t optype, void *data,
+			 uint16_t bcount, int wait)
+{
+  unsigned char cdb[16];   // Command descriptor block
+  
+  return tp_ata_exec_sat(handle, cdb, tp_ata_cdb16(cdb, cmd, bcount), optype,
+			 data, bcount, wait);
+}
+
+/**
+ * \brief Open Queued Command Node
+ *
+ * The sg driver only accepts write() / read() of requests on its own
+ * character nodes, so find the /dev/sgN behind our device via sysfs and
+ * open it non-blocking. Slots for outstanding requests come along with it.
+ *
+ * \param[in,out] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_open_sg(struct tp_ata_handle *handle)
+{
+  char path[PATH_MAX];
+  struct dirent *ent;
+  struct stat st;
+  DIR *dir;
+  
+  /* already done? */
+  if (handle->sg_fd != -1)
+  {
+    return 0;
+  }
+  
+  /* what did we open? */
+  if (fstat(handle->fd, &st) != 0)
+  {
+    return tp_errno = TP_ERR_OPEN;
+  }
+  
+  if (S_ISCHR(st.st_mode))
+  {
+    /* already an sg node, but want a separate non-blocking descriptor */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", handle->fd);
+  }
+  else
+  {
+    /* block device, sysfs lists its generic node */
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device/scsi_generic",
+	     major(st.st_rdev), minor(st.st_rdev));
+    TP_DEBUG(1) printf("Searching %s for sg node\n", path);
+    if ((dir = opendir(path)) == NULL)
+    {
+      return tp_errno = TP_ERR_SYSFS;
+    }
+    while (((ent = readdir(dir)) != NULL) &&
+	   (strncmp(ent->d_name, "sg", 2) != 0))
+    {
+      /* keep looking */
     }
+    if (ent == NULL)
+    {
+      closedir(dir);
+      return tp_errno = TP_ERR_SYSFS;
+    }
+    snprintf(path, sizeof(path), "/dev/%s", ent->d_name);
+    closedir(dir);
+  }
+  
+  /* space for requests in flight */
+  if ((handle->slots == NULL) &&
+      ((handle->slots = calloc(TP_ATA_QUEUE_DEPTH,
+			       sizeof(struct tp_ata_slot))) == NULL))
+  {
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  
+  /* and the node itself */
+  TP_DEBUG(1) printf("Opening %s for queued commands\n", path);
+  if ((handle->sg_fd = open(path, O_RDWR | O_NONBLOCK)) == -1)
+  {
+    return tp_errno = TP_ERR_OPEN;
+  }
+  
+  return 0;
+}
+
+/**
+ * \brief Get Queued Command Descriptor (OS Specific)
+ *
+ * Expose the descriptor which becomes readable when queued commands
+ * complete, for use in an external poll() / select() loop.
+ *
+ * \param[in] handle Device handle
+ * \return File descriptor, or -1 on error
+ */
+int tp_ata_get_queue_fd(struct tp_ata_handle *handle)
+{
+  if ((handle == NULL) || (tp_ata_open_sg(handle) != 0))
+  {
+    return -1;
+  }
+  return handle->sg_fd;
+}
+
+/**
+ * \brief Reserve and Map sg Buffer
+ *
+ * \param[in,out] handle Device handle
+ * \param[in] len Size to map (page multiple)
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_map_reserved(struct tp_ata_handle *handle, size_t len)
+{
+  int size = len;
+  void *map;
+  
+  /* kernel may quietly give us less than asked */
+  if ((ioctl(handle->sg_fd, SG_SET_RESERVED_SIZE, &size) != 0) ||
+      (ioctl(handle->sg_fd, SG_GET_RESERVED_SIZE, &size) != 0) ||
+      ((size_t)size < len))
+  {
+    return tp_errno = TP_ERR_IOCTL;
   }
   
-  // Check sense data
-  if (sense[0] != 0x72 || sense[7] != 0x0e || sense[8] != 0x09
-      || sense[9] != 0x0c || sense[10] != 0x00)
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+	     handle->sg_fd, 0);
+  if (map == MAP_FAILED)
   {
-    //fprintf(stderr, "error  = %02x\n", sense[11]);    // 0x00 means success
-    //fprintf(stderr, "status = %02x\n", sense[21]);    // 0x50 means success
-    return tp_errno = TP_ERR_SENSE;
+    return tp_errno = TP_ERR_ALLOC;
   }
+  handle->map = map;
+  handle->map_len = len;
   
-  // Otherwise ok
   return 0;
 }
+
+/**
+ * \brief Map Zero Copy Buffer (OS Specific)
+ *
+ * Provide a buffer the kernel transfers to / from directly, without
+ * bounce copies. Commands whose data pointer is the start of this buffer
+ * use it automatically. Buffer is owned by the device handle, and remains
+ * valid until it is remapped or the handle is closed. If remapping fails,
+ * any previous buffer is left in place.
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] len Minimum size wanted, actual size on return
+ * \return Pointer to buffer, or NULL on error
+ */
+void *tp_ata_map_buffer(struct tp_ata_handle *handle, size_t *len)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t want = (*len + page - 1) / page * page;
+  size_t old_len = handle->map_len;
+  
+  if (tp_ata_open_sg(handle) != 0)
+  {
+    return NULL;
+  }
+  
+  /* reuse existing mapping if large enough */
+  if ((handle->map != NULL) && (handle->map_len >= want))
+  {
+    *len = handle->map_len;
+    return handle->map;
+  }
+  
+  /* reserved buffer can't be resized while mapped */
+  if (handle->map != NULL)
+  {
+    munmap(handle->map, handle->map_len);
+    handle->map = NULL;
+  }
+  
+  if (tp_ata_map_reserved(handle, want) != 0)
+  {
+    TP_DEBUG(1) printf("Cannot map %zu byte sg buffer\n", want);
+    if (old_len != 0)
+    {
+      tp_ata_map_reserved(handle, old_len);
+    }
+    return NULL;
+  }
+  
+  TP_DEBUG(1) printf("Mapped %zu byte sg buffer\n", want);
+  *len = want;
+  return handle->map;
+}
+
+/**
+ * \brief Find Free Queue Slot
+ *
+ * \param[in] handle Device handle
+ * \return Free slot, or NULL on error
+ */
+static struct tp_ata_slot *tp_ata_get_slot(struct tp_ata_handle *handle)
+{
+  int i;
+  
+  if (tp_ata_open_sg(handle) != 0)
+  {
+    return NULL;
+  }
+  for (i = 0; i < TP_ATA_QUEUE_DEPTH; i++)
+  {
+    if (handle->slots[i].in_use == 0)
+    {
+      return handle->slots + i;
+    }
+  }
+  
+  /* too many in flight */
+  tp_errno = TP_ERR_SPACE;
+  return NULL;
+}
+
+/**
+ * \brief Queue SAT Pass Through Command
+ *
+ * \param[in] handle Device handle
+ * \param[in,out] slot Slot holding command descriptor block
+ * \param[in] cdb_len Size of command descriptor block
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_ata_submit_sat(struct tp_ata_handle *handle,
+				    struct tp_ata_slot *slot,
+				    unsigned char cdb_len,
+				    tp_ata_oper_type_t optype, void *data,
+				    uint16_t bcount, int wait, void *user)
+{
+  if (tp_ata_fill_sat(&slot->sg_io, slot->cdb, cdb_len, optype, data, bcount,
+		      (handle->timeout_ms ? handle->timeout_ms : wait * 1000),
+		      slot->sense))
+  {
+    return tp_errno;
+  }
+  slot->sg_io.usr_ptr = slot;
+  slot->user = user;
+  
+  /* only one zero copy request may be in flight per sg node */
+  if ((data != NULL) && (data == handle->map))
+  {
+    slot->sg_io.flags |= SG_FLAG_MMAP_IO;
+  }
+  
+  /* hand it off, kernel returns as soon as it is queued */
+  if (write(handle->sg_fd, &slot->sg_io, sizeof(slot->sg_io)) < 0)
+  {
+    return tp_errno = ((errno == EAGAIN) || (errno == EDOM) ||
+		       (errno == EBUSY) ?
+		       TP_ERR_SPACE : TP_ERR_SG_QUEUE);
+  }
+  slot->in_use = 1;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Queue ATA12 Command (OS Specific)
+ *
+ * OS-agnostic API to queue an ATA12 command without waiting for it.
+ * Data buffer must remain valid until the command is reaped.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA12 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_submit12(struct tp_ata_handle *handle,
+			   tp_ata_cmd12_t const *cmd,
+			   tp_ata_oper_type_t optype, void *data,
+			   uint8_t bcount, int wait, void *user)
+{
+  struct tp_ata_slot *slot = tp_ata_get_slot(handle);
+  
+  if (slot == NULL)
+  {
+    return tp_errno;
+  }
+  return tp_ata_submit_sat(handle, slot, tp_ata_cdb12(slot->cdb, cmd),
+			   optype, data, bcount, wait, user);
+}
+
+/**
+ * \brief Queue ATA16 Command (OS Specific)
+ *
+ * OS-agnostic API to queue an ATA16 command without waiting for it.
+ * Data buffer must remain valid until the command is reaped.
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to ATA16 command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] bcount Count of 512 byte blocks to transfer
+ * \param[in] wait Timeout in seconds
+ * \param[in] user Caller context, returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_submit16(struct tp_ata_handle *handle,
+			   tp_ata_cmd16_t const *cmd,
+			   tp_ata_oper_type_t optype, void *data,
+			   uint16_t bcount, int wait, void *user)
+{
+  struct tp_ata_slot *slot = tp_ata_get_slot(handle);
+  
+  if (slot == NULL)
+  {
+    return tp_errno;
+  }
+  return tp_ata_submit_sat(handle, slot, tp_ata_cdb16(slot->cdb, cmd, bcount),
+			   optype, data, bcount, wait, user);
+}
+
+/**
+ * \brief Reap Queued Commands (OS Specific)
+ *
+ * Collect whatever queued commands have completed, without blocking.
+ * Status of each command is reported in its event.
+ *
+ * \param[in] handle Device handle
+ * \param[out] events Array to receive completions
+ * \param[in] max Size of events array
+ * \param[out] count Number of completions returned
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_reap(struct tp_ata_handle *handle, tp_ata_event_t *events,
+		       unsigned max, unsigned *count)
+{
+  struct tp_ata_slot *slot;
+  struct sg_io_hdr sg_io;
+  tp_ata_sense_t info;
+  
+  *count = 0;
+  if (tp_ata_open_sg(handle) != 0)
+  {
+    return tp_errno;
+  }
+  
+  while (*count < max)
+  {
+    /* read any completed request */
+    memset(&sg_io, 0, sizeof(sg_io));
+    sg_io.interface_id = 'S';
+    if (read(handle->sg_fd, &sg_io, sizeof(sg_io)) < 0)
+    {
+      if (errno == EAGAIN)
+      {
+	break;
+      }
+      return tp_errno = TP_ERR_SG_QUEUE;
+    }
+    
+    /* back to whoever asked */
+    slot = sg_io.usr_ptr;
+    events[*count].user = slot->user;
+    events[*count].status = tp_ata_check_sat(&sg_io, &info);
+    slot->in_use = 0;
+    (*count)++;
+  }
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Abandon Queued Commands (OS Specific)
+ *
+ * Give up on every command still queued, for when a device stops
+ * answering. The sg node is closed, so the kernel discards their results
+ * rather than copying them into caller buffers, and a fresh node is opened
+ * on next use. A zero copy buffer stays mapped for whoever holds it, but is
+ * no longer used for zero copy transfers.
+ *
+ * \param[in] handle Device handle
+ */
+void tp_ata_abandon(struct tp_ata_handle *handle)
+{
+  if (handle->sg_fd == -1)
+  {
+    return;
+  }
+  
+  /* mapping keeps the old node alive, so only forget it */
+  if (handle->map != NULL)
+  {
+    if (handle->old_map != NULL)
+    {
+      munmap(handle->old_map, handle->old_map_len);
+    }
+    handle->old_map = handle->map;
+    handle->old_map_len = handle->map_len;
+    handle->map = NULL;
+    handle->map_len = 0;
+  }
+  
+  close(handle->sg_fd);
+  handle->sg_fd = -1;
+  memset(handle->slots, 0, TP_ATA_QUEUE_DEPTH * sizeof(struct tp_ata_slot));
+}
+
+/**
+ * \brief Wait on Queued Commands (OS Specific)
+ *
+ * Block until at least one of several devices has queued commands ready
+ * to reap, so one thread can service many devices with a single wait.
+ *
+ * \param[in] handles Array of device handles
+ * \param[out] ready Set nonzero for each device with completions waiting
+ * \param[in] count Number of devices
+ * \param[in] timeout_ms Longest time to wait, in milliseconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_ata_poll(struct tp_ata_handle **handles, int *ready,
+		       unsigned count, int timeout_ms)
+{
+  struct pollfd *fds;
+  unsigned i;
+  int rc;
+  
+  /* one entry per device */
+  if ((fds = calloc(count, sizeof(struct pollfd))) == NULL)
+  {
+    return tp_errno = TP_ERR_ALLOC;
+  }
+  for (i = 0; i < count; i++)
+  {
+    fds[i].fd = tp_ata_get_queue_fd(handles[i]);
+    fds[i].events = POLLIN;
+  }
+  
+  /* and wait */
+  rc = poll(fds, count, timeout_ms);
+  for (i = 0; i < count; i++)
+  {
+    ready[i] = ((rc > 0) && (fds[i].revents & POLLIN) ? 1 : 0);
+  }
+  free(fds);
+  
+  if (rc < 0)
+  {
+    return tp_errno = TP_ERR_SG_QUEUE;
+  }
+  else if (rc == 0)
+  {
+    return tp_errno = TP_ERR_TIMEOUT;
+  }
+  return tp_errno = TP_ERR_SUCCESS;
+}
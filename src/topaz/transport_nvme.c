@@ -0,0 +1,137 @@
+/*
+ * Topaz - NVMe Transport
+ *
+ * This file implements OS abstracted API to implement TCG IF-SEND and IF-RECV
+ * calls via NVMe Security Send / Security Receive admin commands.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/transport_nvme.h>
+
+/**
+ * \brief NVMe Identify Controller
+ *
+ * Implementation of NVMe Identify command to query
+ * controller self-identification data.
+ *
+ * \param[in] handle Device handle
+ * \param[out] data Pointer to 4096 byte buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_get_identify(struct tp_nvme_handle *handle, void *data)
+{
+  /* Admin Command - Identify (0x06), CNS 1 (Controller) */
+  tp_nvme_cmd_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = 0x06;
+  cmd.cdw10  = 1;
+
+  /* Off it goes */
+  TP_DEBUG(1) printf("Probe NVMe Identify\n");
+  return tp_nvme_exec_admin(handle, &cmd, TP_NVME_OPER_READ, data,
+			    TP_NVME_IDENTIFY_SIZE, 1);
+}
+
+/**
+ * \brief Probe NVMe Device for TPM
+ *
+ * Check Identify Controller data read at open for Security Send / Receive
+ * support
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_probe_tpm(struct tp_nvme_handle *handle)
+{
+  /* Optional Admin Command Support (OACS), bit 0 is Security Send/Recv */
+  TP_DEBUG(1) printf("Searching for Security Send/Receive support\n");
+  if ((tp_nvme_get_oacs(handle) & 0x01) == 0)
+  {
+    return tp_errno = TP_ERR_NO_TPM;
+  }
+
+  /* looks ok */
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief NVMe IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send
+ * data to a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_if_send(struct tp_nvme_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len)
+{
+  /* Build Admin Command - Security Send (0x81) */
+  tp_nvme_cmd_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = 0x81;
+  cmd.cdw10  = (proto << 24) | (comid << 8);  /* SECP, SPSP1, SPSP0 */
+  cmd.cdw11  = len;                           /* Transfer length */
+
+  /* Off it goes */
+  return tp_nvme_exec_admin(handle, &cmd, TP_NVME_OPER_WRITE, data, len, 5);
+}
+
+/**
+ * \brief NVMe IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive
+ * data from a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_if_recv(struct tp_nvme_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len)
+{
+  /* Build Admin Command - Security Receive (0x82) */
+  tp_nvme_cmd_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = 0x82;
+  cmd.cdw10  = (proto << 24) | (comid << 8);  /* SECP, SPSP1, SPSP0 */
+  cmd.cdw11  = len;                           /* Allocation length */
+
+  /* Off it goes */
+  return tp_nvme_exec_admin(handle, &cmd, TP_NVME_OPER_READ, data, len, 5);
+}
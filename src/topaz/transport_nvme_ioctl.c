@@ -0,0 +1,295 @@
+/*
+ * Topaz - NVMe Transport (Linux ioctl)
+ *
+ * This file is an implementation of a Linux specific OS API for
+ * basic NVMe admin commands.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/nvme_ioctl.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/transport_nvme.h>
+
+/** Linux device handle */
+struct tp_nvme_handle
+{
+  int fd; /** POSIX file descriptor */
+  unsigned int timeout_ms; /** Override of per-command timeout, or 0 */
+  int is_char; /** Opened via character device */
+  uint16_t oacs; /** Optional Admin Command Support, from Identify */
+};
+
+/**
+ * \brief Open NVMe Device (OS Specific)
+ *
+ * OS-agnostic API to provide an NVMe device handle. Fails if the
+ * target device does not accept NVMe admin commands.
+ *
+ * \param[in] path Path to device (controller or namespace)
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_nvme_handle *tp_nvme_open(char const *path)
+{
+  struct tp_nvme_handle *handle = NULL;
+  uint8_t id_data[TP_NVME_IDENTIFY_SIZE];
+  struct stat st;
+  int rc, fd = -1;
+
+  /* open controller / namespace device */
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+  {
+    rc = TP_ERR_OPEN;
+    goto cleanup;
+  }
+
+  /* allocate some memory for device handle */
+  handle = (struct tp_nvme_handle*)calloc(sizeof(struct tp_nvme_handle), 1);
+  if (handle == NULL)
+  {
+    rc = TP_ERR_ALLOC;
+    goto cleanup;
+  }
+  handle->fd = fd;
+  handle->is_char = ((fstat(fd, &st) == 0) && (S_ISCHR(st.st_mode)));
+
+  /* non-NVMe devices will reject the admin command ioctl outright */
+  if (tp_nvme_get_identify(handle, id_data))
+  {
+    rc = tp_errno;
+    goto cleanup;
+  }
+  
+  /* keep what the TPM probe needs, rather than asking again */
+  handle->oacs = id_data[256] | (id_data[257] << 8);
+
+  /* all done */
+  tp_errno = TP_ERR_SUCCESS;
+  return handle;
+
+  cleanup: /* on failure */
+
+  /* close handle if open */
+  if (fd != -1)
+  {
+    close(fd);
+  }
+
+  /* clear memory if allocated */
+  if (handle != NULL)
+  {
+    free(handle);
+  }
+
+  /* set errno and return */
+  tp_errno = rc;
+  return NULL;
+}
+
+/**
+ * \brief Close NVMe Device (OS Specific)
+ *
+ * Linux specific API to close a NVMe device handle
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_close(struct tp_nvme_handle *handle)
+{
+  /* sanity check */
+  if (handle == NULL)
+  {
+    return -1;
+  }
+
+  /* cleanup */
+  close(handle->fd);
+  free(handle);
+  return 0;
+}
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_nvme_set_timeout(struct tp_nvme_handle *handle, unsigned int timeout_ms)
+{
+  handle->timeout_ms = timeout_ms;
+}
+
+/**
+ * \brief Get NVMe Device Descriptor (OS Specific)
+ *
+ * Expose the underlying OS descriptor, for use by asynchronous engines
+ *
+ * \param[in] handle Device handle
+ * \return File descriptor, or -1 on error
+ */
+int tp_nvme_get_fd(struct tp_nvme_handle *handle)
+{
+  return (handle == NULL ? -1 : handle->fd);
+}
+
+/**
+ * \brief Get Timeout Override (OS Specific)
+ *
+ * \param[in] handle Device handle
+ * \return Timeout in milliseconds, or 0 for per-command default
+ */
+unsigned int tp_nvme_get_timeout(struct tp_nvme_handle *handle)
+{
+  return handle->timeout_ms;
+}
+
+/**
+ * \brief Check for Character Device (OS Specific)
+ *
+ * Asynchronous engines can only pass commands through to the controller
+ * or generic namespace character devices, not block devices
+ *
+ * \param[in] handle Device handle
+ * \return Nonzero if device is a character device
+ */
+int tp_nvme_is_char(struct tp_nvme_handle *handle)
+{
+  return ((handle != NULL) && (handle->is_char));
+}
+
+/**
+ * \brief Get Optional Admin Command Support (OS Specific)
+ *
+ * OACS field of the Identify Controller data read when device was opened
+ *
+ * \param[in] handle Device handle
+ * \return OACS bits
+ */
+uint16_t tp_nvme_get_oacs(struct tp_nvme_handle *handle)
+{
+  return handle->oacs;
+}
+
+/**
+ * \brief Execute NVMe Admin Command (OS Specific)
+ *
+ * OS-agnostic API to execute an NVMe admin command
+ *
+ * \param[in] handle Device handle
+ * \param[in] cmd Pointer to NVMe command structure
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] len Count of bytes to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_nvme_exec_admin(struct tp_nvme_handle *handle,
+			      tp_nvme_cmd_t const *cmd,
+			      tp_nvme_oper_type_t optype, void *data,
+			      uint32_t len, int wait)
+{
+  struct nvme_admin_cmd admin; // ioctl data structure
+  int rc;
+
+  // Initialize structure
+  memset(&admin, 0, sizeof(admin));
+
+  // Direction is implied by opcode, but check it anyway
+  if ((optype != TP_NVME_OPER_READ) && (optype != TP_NVME_OPER_WRITE))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+
+  ////
+  // Fill in ioctl data for admin pass through
+  //
+
+  admin.opcode     = cmd->opcode;
+  admin.nsid       = cmd->nsid;
+  admin.cdw10      = cmd->cdw10;
+  admin.cdw11      = cmd->cdw11;
+
+  // Command data transfer (optional)
+  admin.addr       = (uintptr_t)data;
+  admin.data_len   = len;
+
+  // Timeout (ms)
+  admin.timeout_ms = (handle->timeout_ms ? handle->timeout_ms : wait * 1000);
+
+  ////
+  // Run ioctl
+  //
+
+  // Debug output command
+  TP_DEBUG(4)
+  {
+    printf("NVMe Admin Command:\n");
+    tp_debug_dump(&admin, sizeof(admin));
+
+    // Data out?
+    if (optype == TP_NVME_OPER_WRITE)
+    {
+      printf("Write Data:\n");
+      tp_debug_dump(data, len);
+    }
+  }
+
+  // System call, positive return is NVMe completion status
+  rc = ioctl(handle->fd, NVME_IOCTL_ADMIN_CMD, &admin);
+  if (rc < 0)
+  {
+    return tp_errno = TP_ERR_IOCTL;
+  }
+  else if (rc > 0)
+  {
+    TP_DEBUG(2) printf("NVMe status = %04x\n", rc);
+    return tp_errno = TP_ERR_NVME_STATUS;
+  }
+
+  // Debug input
+  if (optype == TP_NVME_OPER_READ)
+  {
+    TP_DEBUG(4)
+    {
+      printf("Read Data:\n");
+      tp_debug_dump(data, len);
+    }
+  }
+
+  // Otherwise ok
+  return tp_errno = TP_ERR_SUCCESS;
+}
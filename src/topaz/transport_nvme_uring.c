@@ -0,0 +1,537 @@
+/*
+ * Topaz - NVMe Transport (Linux io_uring)
+ *
+ * This file implements an asynchronous engine for NVMe Security Send /
+ * Security Receive, allowing a single thread to keep commands in flight on
+ * many drives at once, and to collect their completions in batches.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/nvme_ioctl.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/transport_nvme.h>
+#include <topaz/transport_nvme_uring.h>
+
+/* SQE128 / CQE32 rings use double sized entries */
+#define TP_URING_SQE_SIZE (2 * sizeof(struct io_uring_sqe))
+#define TP_URING_CQE_SIZE (2 * sizeof(struct io_uring_cqe))
+
+/* Default command timeout, as for synchronous Security Send / Receive */
+#define TP_URING_TIMEOUT_MS 5000
+
+/* Ring index accessors (shared with kernel) */
+#define TP_URING_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TP_URING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/** Book keeping for a command in flight */
+typedef struct
+{
+  tp_handle_t *dev;
+  void *user;
+  int busy;
+  int done;           /** Already completed, without the ring */
+  tp_errno_t status;  /** Result, if done */
+} tp_uring_slot_t;
+
+/** Linux io_uring engine */
+struct tp_uring
+{
+  int fd;                   /** io_uring file descriptor */
+  
+  /* Submission queue */
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_entries;
+  unsigned int sq_pending;  /** Queued, but not yet submitted */
+  uint8_t *sqes;
+  size_t sqes_size;
+  
+  /* Completion queue */
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  uint8_t *cqes;
+  
+  /* Commands in flight */
+  tp_uring_slot_t *slots;
+  unsigned int slot_count;
+  unsigned int slot_next;
+  unsigned int done_count;  /** Completed without the ring, not yet reaped */
+};
+
+/**
+ * \brief Open io_uring Engine
+ *
+ * Set up a submission / completion ring for NVMe pass through commands.
+ * Drives attached via their NVMe character device (/dev/nvmeX or
+ * /dev/ngXnY) are driven asynchronously. Block devices do not accept
+ * uring commands, so theirs run synchronously when queued, and complete
+ * like any other. No options are defined yet, as polled (IOPOLL) rings
+ * don't take admin pass through commands.
+ *
+ * \param[in] depth Number of submission queue entries
+ * \param[in] flags Engine options (must be zero)
+ * \return Pointer to new engine, or NULL on error
+ */
+struct tp_uring *tp_uring_open(unsigned int depth, unsigned int flags)
+{
+  struct tp_uring *ring = NULL;
+  struct io_uring_params params;
+  uint8_t *sq, *cq;
+  int rc;
+  
+  /* nothing optional yet */
+  if (flags != 0)
+  {
+    tp_errno = TP_ERR_INVALID;
+    return NULL;
+  }
+  
+  /* allocate some memory for engine */
+  ring = (struct tp_uring*)calloc(sizeof(struct tp_uring), 1);
+  if (ring == NULL)
+  {
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  ring->fd = -1;
+  
+  /* NVMe pass through needs the big entries */
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+  
+  /* create ring */
+  TP_DEBUG(1) printf("Setup io_uring (%u entries)\n", depth);
+  ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring->fd < 0)
+  {
+    rc = TP_ERR_URING;
+    goto cleanup;
+  }
+  
+  /* map rings, possibly as one region */
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * TP_URING_CQE_SIZE;
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+    {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = 0;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+  {
+    ring->sq_ring = NULL;
+    rc = TP_ERR_URING;
+    goto cleanup;
+  }
+  if (ring->cq_ring_size == 0)
+  {
+    ring->cq_ring = ring->sq_ring;
+  }
+  else
+  {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+    {
+      ring->cq_ring = NULL;
+      rc = TP_ERR_URING;
+      goto cleanup;
+    }
+  }
+  
+  /* map submission entries */
+  ring->sqes_size = params.sq_entries * TP_URING_SQE_SIZE;
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    ring->sqes = NULL;
+    rc = TP_ERR_URING;
+    goto cleanup;
+  }
+  
+  /* locate ring indices */
+  sq = (uint8_t*)ring->sq_ring;
+  cq = (uint8_t*)ring->cq_ring;
+  ring->sq_head    = (unsigned int*)(sq + params.sq_off.head);
+  ring->sq_tail    = (unsigned int*)(sq + params.sq_off.tail);
+  ring->sq_mask    = (unsigned int*)(sq + params.sq_off.ring_mask);
+  ring->sq_array   = (unsigned int*)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head    = (unsigned int*)(cq + params.cq_off.head);
+  ring->cq_tail    = (unsigned int*)(cq + params.cq_off.tail);
+  ring->cq_mask    = (unsigned int*)(cq + params.cq_off.ring_mask);
+  ring->cqes       = cq + params.cq_off.cqes;
+  
+  /* one slot per possible completion */
+  ring->slot_count = params.cq_entries;
+  ring->slots = (tp_uring_slot_t*)calloc(sizeof(tp_uring_slot_t),
+					 ring->slot_count);
+  if (ring->slots == NULL)
+  {
+    rc = TP_ERR_ALLOC;
+    goto cleanup;
+  }
+  
+  /* all done */
+  tp_errno = TP_ERR_SUCCESS;
+  return ring;
+  
+  cleanup: /* on failure */
+  
+  tp_uring_close(ring);
+  tp_errno = rc;
+  return NULL;
+}
+
+/**
+ * \brief Close io_uring Engine
+ *
+ * Tear down ring. Any commands still in flight are abandoned.
+ *
+ * \param[in] ring Target engine
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_close(struct tp_uring *ring)
+{
+  /* sanity check */
+  if (ring == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* unmap shared memory */
+  if (ring->sqes != NULL)
+  {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if ((ring->cq_ring != NULL) && (ring->cq_ring != ring->sq_ring))
+  {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL)
+  {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  
+  /* cleanup */
+  if (ring->fd != -1)
+  {
+    close(ring->fd);
+  }
+  free(ring->slots);
+  free(ring);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Queue NVMe Admin Command
+ *
+ * Fill in next submission entry with an NVMe admin pass through command
+ *
+ * \param[in] ring Target engine
+ * \param[in] dev Target drive (NVMe transport)
+ * \param[in] opcode Admin command opcode
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in,out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \param[in] user Caller cookie returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+static tp_errno_t tp_uring_queue(struct tp_uring *ring, tp_handle_t *dev,
+				 uint8_t opcode, uint8_t proto, uint16_t comid,
+				 void *data, uint32_t len, void *user)
+{
+  struct io_uring_sqe *sqe;
+  struct nvme_uring_cmd *cmd;
+  unsigned int tail, index, slot, i;
+  int fd;
+  
+  /* check for NULL pointers */
+  if ((ring == NULL) || (dev == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* only makes sense for NVMe drives */
+  if ((dev->trans_type != TP_TRANS_NVME) ||
+      ((fd = tp_nvme_get_fd(dev->nvme)) == -1))
+  {
+    return tp_errno = TP_ERR_INVALID;
+  }
+  
+  /* room in submission queue? */
+  tail = *ring->sq_tail;
+  if (tail - TP_URING_LOAD(ring->sq_head) >= ring->sq_entries)
+  {
+    return tp_errno = TP_ERR_SPACE;
+  }
+  
+  /* find a free slot to track the command */
+  for (i = 0; i < ring->slot_count; i++)
+  {
+    slot = (ring->slot_next + i) % ring->slot_count;
+    if (ring->slots[slot].busy == 0)
+    {
+      break;
+    }
+  }
+  if (i == ring->slot_count)
+  {
+    return tp_errno = TP_ERR_SPACE;
+  }
+  ring->slot_next = slot + 1;
+  ring->slots[slot].dev  = dev;
+  ring->slots[slot].user = user;
+  ring->slots[slot].busy = 1;
+  
+  /* block devices won't take it, so do it the slow way */
+  if (!tp_nvme_is_char(dev->nvme))
+  {
+    ring->slots[slot].status =
+      (opcode == 0x81 ? tp_nvme_if_send(dev->nvme, proto, comid, data, len) :
+       tp_nvme_if_recv(dev->nvme, proto, comid, data, len));
+    ring->slots[slot].done = 1;
+    ring->done_count++;
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* fill in submission entry */
+  index = tail & *ring->sq_mask;
+  sqe = (struct io_uring_sqe*)(ring->sqes + index * TP_URING_SQE_SIZE);
+  memset(sqe, 0, TP_URING_SQE_SIZE);
+  sqe->opcode    = IORING_OP_URING_CMD;
+  sqe->fd        = fd;
+  sqe->cmd_op    = NVME_URING_CMD_ADMIN;
+  sqe->user_data = slot;
+  
+  /* NVMe command lives in the back half of the entry */
+  cmd = (struct nvme_uring_cmd*)sqe->cmd;
+  cmd->opcode     = opcode;
+  cmd->cdw10      = (proto << 24) | (comid << 8);  /* SECP, SPSP1, SPSP0 */
+  cmd->cdw11      = len;
+  cmd->addr       = (uintptr_t)data;
+  cmd->data_len   = len;
+  cmd->timeout_ms = (tp_nvme_get_timeout(dev->nvme) ?
+		     tp_nvme_get_timeout(dev->nvme) : TP_URING_TIMEOUT_MS);
+  
+  /* publish */
+  ring->sq_array[index] = index;
+  TP_URING_STORE(ring->sq_tail, tail + 1);
+  ring->sq_pending++;
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Queue Asynchronous IF-SEND
+ *
+ * Queue a Security Send to target drive. The command is not issued until
+ * tp_uring_submit() is called, and data must remain valid until reaped.
+ *
+ * \param[in] ring Target engine
+ * \param[in] dev Target drive (NVMe transport)
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \param[in] user Caller cookie returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_if_send(struct tp_uring *ring, tp_handle_t *dev,
+			    uint8_t proto, uint16_t comid, void *data,
+			    uint32_t len, void *user)
+{
+  /* Security Send (0x81) */
+  return tp_uring_queue(ring, dev, 0x81, proto, comid, data, len, user);
+}
+
+/**
+ * \brief Queue Asynchronous IF-RECV
+ *
+ * Queue a Security Receive from target drive. The command is not issued
+ * until tp_uring_submit() is called, and data must remain valid until reaped.
+ *
+ * \param[in] ring Target engine
+ * \param[in] dev Target drive (NVMe transport)
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \param[in] user Caller cookie returned on completion
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_if_recv(struct tp_uring *ring, tp_handle_t *dev,
+			    uint8_t proto, uint16_t comid, void *data,
+			    uint32_t len, void *user)
+{
+  /* Security Receive (0x82) */
+  return tp_uring_queue(ring, dev, 0x82, proto, comid, data, len, user);
+}
+
+/**
+ * \brief Submit Queued Commands
+ *
+ * Issue all queued commands with a single system call, optionally
+ * waiting until a number of completions are available.
+ *
+ * \param[in] ring Target engine
+ * \param[in] wait_nr Completions to wait for (0 to return immediately)
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_submit(struct tp_uring *ring, unsigned int wait_nr)
+{
+  int rc;
+  
+  /* sanity check */
+  if (ring == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  /* some may have finished already */
+  wait_nr = (wait_nr > ring->done_count ? wait_nr - ring->done_count : 0);
+  
+  /* nothing to do? */
+  if ((ring->sq_pending == 0) && (wait_nr == 0))
+  {
+    return tp_errno = TP_ERR_SUCCESS;
+  }
+  
+  /* off they go */
+  rc = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_nr,
+	       (wait_nr ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+  if (rc < 0)
+  {
+    return tp_errno = TP_ERR_URING;
+  }
+  ring->sq_pending -= rc;
+  
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Reap Completions
+ *
+ * Collect any finished commands, without blocking.
+ *
+ * \param[in] ring Target engine
+ * \param[out] events Array to receive completions
+ * \param[in] max Size of events array
+ * \param[out] count Number of completions returned
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_uring_reap(struct tp_uring *ring, tp_uring_event_t *events,
+			 unsigned int max, unsigned int *count)
+{
+  struct io_uring_cqe *cqe;
+  tp_uring_slot_t *slot;
+  unsigned int head, tail, i;
+  
+  /* check for NULL pointers */
+  if ((ring == NULL) || (events == NULL) || (count == NULL))
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  *count = 0;
+  
+  /* those that never went near the ring */
+  for (i = 0; (ring->done_count != 0) && (i < ring->slot_count) &&
+	 (*count < max); i++)
+  {
+    slot = ring->slots + i;
+    if (slot->done)
+    {
+      events[*count].dev    = slot->dev;
+      events[*count].user   = slot->user;
+      events[*count].status = slot->status;
+      (*count)++;
+      slot->done = 0;
+      slot->busy = 0;
+      ring->done_count--;
+    }
+  }
+  
+  /* harvest whatever is ready */
+  head = *ring->cq_head;
+  tail = TP_URING_LOAD(ring->cq_tail);
+  while ((head != tail) && (*count < max))
+  {
+    cqe = (struct io_uring_cqe*)(ring->cqes +
+				 (head & *ring->cq_mask) * TP_URING_CQE_SIZE);
+    head++;
+    
+    /* ignore anything we don't know about */
+    if (cqe->user_data >= ring->slot_count)
+    {
+      continue;
+    }
+    slot = ring->slots + cqe->user_data;
+    
+    /* negative is errno, positive is NVMe status */
+    events[*count].dev  = slot->dev;
+    events[*count].user = slot->user;
+    if (cqe->res < 0)
+    {
+      events[*count].status = TP_ERR_IOCTL;
+    }
+    else if (cqe->res > 0)
+    {
+      TP_DEBUG(2) printf("NVMe status = %04x\n", cqe->res);
+      events[*count].status = TP_ERR_NVME_STATUS;
+    }
+    else
+    {
+      events[*count].status = TP_ERR_SUCCESS;
+    }
+    (*count)++;
+    
+    /* release slot */
+    slot->busy = 0;
+  }
+  
+  /* hand entries back to kernel */
+  TP_URING_STORE(ring->cq_head, head);
+  return tp_errno = TP_ERR_SUCCESS;
+}
@@ -0,0 +1,359 @@
+/*
+ * Topaz - Replay Transport
+ *
+ * This file implements a transport which plays back a recorded trace of
+ * IF-SEND / IF-RECV traffic in place of a real drive.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/trace.h>
+
+/** Replay handle */
+struct tp_replay_handle
+{
+  uint8_t const *map; /** Mapped trace file */
+  size_t map_len;     /** Size of mapping */
+  size_t cursor;      /** Offset of next record */
+  uint64_t poll_start; /** When host started polling current run, or 0 */
+};
+
+/**
+ * \brief Open Replay Transport
+ *
+ * Map a recorded trace for playback
+ *
+ * \param[in] path Path to trace file
+ * \return Pointer to new replay handle, or NULL on error
+ */
+struct tp_replay_handle *tp_replay_open(char const *path)
+{
+  struct tp_replay_handle *handle = NULL;
+  tp_trace_file_t const *header;
+  struct stat st;
+  void *map;
+  int fd;
+  
+  /* map the whole trace */
+  TP_DEBUG(1) printf("Replaying trace from %s\n", path);
+  if ((fd = open(path, O_RDONLY)) == -1)
+  {
+    tp_errno = TP_ERR_OPEN;
+    return NULL;
+  }
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(tp_trace_file_t)))
+  {
+    close(fd);
+    tp_errno = TP_ERR_TRACE;
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  
+  /* make sure it's one of ours */
+  header = map;
+  if ((memcmp(header->magic, TP_TRACE_MAGIC, sizeof(TP_TRACE_MAGIC)) != 0) ||
+      (header->version != TP_TRACE_VERSION))
+  {
+    munmap(map, st.st_size);
+    tp_errno = TP_ERR_TRACE;
+    return NULL;
+  }
+  
+  /* allocate some memory for handle */
+  if ((handle = calloc(1, sizeof(struct tp_replay_handle))) == NULL)
+  {
+    munmap(map, st.st_size);
+    tp_errno = TP_ERR_ALLOC;
+    return NULL;
+  }
+  handle->map = map;
+  handle->map_len = st.st_size;
+  handle->cursor = sizeof(tp_trace_file_t);
+  
+  tp_errno = TP_ERR_SUCCESS;
+  return handle;
+}
+
+/**
+ * \brief Close Replay Transport
+ *
+ * \param[in] handle Replay handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_close(struct tp_replay_handle *handle)
+{
+  /* sanity check */
+  if (handle == NULL)
+  {
+    return tp_errno = TP_ERR_NULL;
+  }
+  
+  munmap((void*)handle->map, handle->map_len);
+  free(handle);
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Fetch Record
+ *
+ * \param[in] handle Replay handle
+ * \param[in] offset Offset of record in trace
+ * \param[out] next Offset of following record (optional)
+ * \return Pointer to record, or NULL if past end of trace
+ */
+static tp_trace_rec_t const *tp_replay_rec(struct tp_replay_handle *handle,
+					   size_t offset, size_t *next)
+{
+  tp_trace_rec_t const *rec;
+  size_t end;
+  
+  if (offset + sizeof(tp_trace_rec_t) > handle->map_len)
+  {
+    return NULL;
+  }
+  rec = (tp_trace_rec_t const*)(handle->map + offset);
+  
+  /* payload must fit, too */
+  end = offset + sizeof(tp_trace_rec_t) + ((rec->stored + 7) & ~(size_t)7);
+  if ((rec->stored > rec->length) || (end > handle->map_len))
+  {
+    return NULL;
+  }
+  if (next != NULL)
+  {
+    *next = end;
+  }
+  return rec;
+}
+
+/**
+ * \brief Wait Out Recorded Latency
+ *
+ * \param[in] ns Nanoseconds recorded
+ */
+static void tp_replay_delay(uint64_t ns)
+{
+  struct timespec wait;
+  
+  if (tp_trace_speedup == 0)
+  {
+    return;
+  }
+  ns /= tp_trace_speedup;
+  wait.tv_sec = ns / 1000000000;
+  wait.tv_nsec = ns % 1000000000;
+  nanosleep(&wait, NULL);
+}
+
+/**
+ * \brief Check Record Against Request
+ *
+ * \param[in] rec Recorded transfer
+ * \param[in] dir Direction of transfer
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on match, error code indicating failure
+ */
+static tp_errno_t tp_replay_match(tp_trace_rec_t const *rec, tp_trace_dir_t dir,
+				  uint8_t proto, uint16_t comid, size_t len)
+{
+  if ((rec == NULL) || (rec->dir != dir) || (rec->proto != proto) ||
+      (rec->comid != comid) || (rec->length != len))
+  {
+    TP_DEBUG(1) printf("Trace mismatch (proto %u, comid %u, len %zu)\n",
+		       proto, comid, len);
+    return tp_errno = TP_ERR_TRACE;
+  }
+  return 0;
+}
+
+/**
+ * \brief Replay IF-SEND
+ *
+ * Check outbound data against next recorded IF-SEND, and return its
+ * recorded status after its recorded (scaled) latency.
+ *
+ * \param[in] handle Replay handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_if_send(struct tp_replay_handle *handle, uint8_t proto,
+			     uint16_t comid, void const *data, size_t len)
+{
+  tp_trace_rec_t const *rec;
+  uint8_t const *bytes = data;
+  size_t i, next;
+  
+  rec = tp_replay_rec(handle, handle->cursor, &next);
+  if (tp_replay_match(rec, TP_TRACE_SEND, proto, comid, len))
+  {
+    return tp_errno;
+  }
+  
+  /* host must say exactly what it said before */
+  if (memcmp(rec + 1, data, rec->stored) != 0)
+  {
+    TP_DEBUG(1) printf("Trace mismatch (IF-SEND payload)\n");
+    return tp_errno = TP_ERR_TRACE;
+  }
+  for (i = rec->stored; i < len; i++)
+  {
+    if (bytes[i] != 0)
+    {
+      TP_DEBUG(1) printf("Trace mismatch (IF-SEND payload)\n");
+      return tp_errno = TP_ERR_TRACE;
+    }
+  }
+  
+  handle->cursor = next;
+  handle->poll_start = 0;
+  tp_replay_delay(rec->duration);
+  return tp_errno = rec->status;
+}
+
+/**
+ * \brief Check for Empty ComPacket
+ *
+ * A TPer still working on a method answers IF-RECV with a ComPacket
+ * header of zero length, which the host keeps polling on. A zero length
+ * ComPacket with data outstanding is not that, but a response too large
+ * for the transfer, to be asked for again with a larger one.
+ *
+ * \param[in] rec Recorded transfer
+ * \return Nonzero if record is a "no data yet" response
+ */
+static int tp_replay_is_empty(tp_trace_rec_t const *rec)
+{
+  uint8_t const *bytes = (uint8_t const*)(rec + 1);
+  size_t i;
+  
+  if ((rec->proto != 1) || (rec->dir != TP_TRACE_RECV))
+  {
+    return 0;
+  }
+  
+  /* OutstandingData lives in bytes 8 - 11, ComPacket length in 16 - 19
+   * (anything past what was stored is zero) */
+  for (i = 8; (i < 20) && (i < rec->stored); i++)
+  {
+    if (((i < 12) || (i >= 16)) && (bytes[i] != 0))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * \brief Replay IF-RECV
+ *
+ * Return data of next recorded IF-RECV after its recorded (scaled)
+ * latency. Runs of empty ComPackets (a drive answering "no data yet") are
+ * played back by elapsed time rather than count, so hosts polling at a
+ * different rate than when recorded still line up.
+ *
+ * \param[in] handle Replay handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_replay_if_recv(struct tp_replay_handle *handle, uint8_t proto,
+			     uint16_t comid, void *data, size_t len)
+{
+  tp_trace_rec_t const *rec, *answer;
+  size_t next, answer_next;
+  uint64_t now;
+  
+  rec = tp_replay_rec(handle, handle->cursor, &next);
+  if (tp_replay_match(rec, TP_TRACE_RECV, proto, comid, len))
+  {
+    return tp_errno;
+  }
+  
+  /* drive was busy, find out when it actually answered */
+  if (tp_replay_is_empty(rec))
+  {
+    answer = tp_replay_rec(handle, next, &answer_next);
+    while ((answer != NULL) && (tp_replay_is_empty(answer)) &&
+	   (tp_replay_match(answer, TP_TRACE_RECV, proto, comid, len) == 0))
+    {
+      next = answer_next;
+      answer = tp_replay_rec(handle, next, &answer_next);
+    }
+    
+    if ((answer != NULL) &&
+	(tp_replay_match(answer, TP_TRACE_RECV, proto, comid, len) == 0))
+    {
+      /* keep saying "not yet" until it would have been ready */
+      now = tp_trace_now();
+      if (handle->poll_start == 0)
+      {
+	handle->poll_start = now;
+      }
+      if ((tp_trace_speedup != 0) &&
+	  ((now - handle->poll_start) * tp_trace_speedup <
+	   answer->timestamp - rec->timestamp))
+      {
+	tp_replay_delay(rec->duration);
+	memset(data, 0, len);
+	memcpy(data, rec + 1, rec->stored);
+	return tp_errno = rec->status;
+      }
+      
+      /* otherwise it's ready */
+      rec = answer;
+      next = answer_next;
+    }
+  }
+  
+  handle->cursor = next;
+  handle->poll_start = 0;
+  tp_replay_delay(rec->duration);
+  memset(data, 0, len);
+  memcpy(data, rec + 1, rec->stored);
+  return tp_errno = rec->status;
+}
@@ -0,0 +1,195 @@
+/*
+ * Topaz - SCSI Transport
+ *
+ * This file implements OS abstracted API to implement TCG IF-SEND and IF-RECV
+ * calls via SCSI SECURITY PROTOCOL IN / OUT, as used by SAS and other native
+ * SCSI drives.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/transport_scsi.h>
+
+/**
+ * \brief SCSI Inquiry
+ *
+ * Implementation of SCSI INQUIRY command, for either standard
+ * inquiry data or a vital product data (VPD) page.
+ *
+ * \param[in] handle Device handle
+ * \param[in] evpd Non-zero to request a VPD page
+ * \param[in] page VPD page code
+ * \param[out] data Inquiry data buffer
+ * \param[in] len Size of inquiry data buffer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_get_inquiry(struct tp_scsi_handle *handle, int evpd,
+			       uint8_t page, void *data, uint16_t len)
+{
+  /* SCSI Command - INQUIRY (0x12) */
+  uint8_t cdb[6];
+  memset(cdb, 0, sizeof(cdb));
+  cdb[0] = 0x12;
+  cdb[1] = (evpd ? 0x01 : 0x00);
+  cdb[2] = page;
+  cdb[3] = len >> 8;
+  cdb[4] = len & 0xff;
+  
+  /* Off it goes */
+  memset(data, 0, len);
+  return tp_scsi_exec(handle, cdb, sizeof(cdb), TP_SCSI_OPER_READ,
+		      data, len, 1);
+}
+
+/**
+ * \brief Check for ATA Device
+ *
+ * Determine whether SCSI device is really an ATA device behind a SCSI /
+ * ATA Translation (SAT) layer, by looking for the ATA Information VPD page
+ *
+ * \param[in] handle Device handle
+ * \return Non-zero if ATA device (or type unknown), 0 otherwise
+ */
+int tp_scsi_is_ata(struct tp_scsi_handle *handle)
+{
+  uint8_t pages[256];
+  unsigned int count, i;
+  
+  /* Supported VPD pages (0x00) */
+  TP_DEBUG(1) printf("Probe SCSI VPD pages\n");
+  if (tp_scsi_get_inquiry(handle, 1, 0x00, pages, sizeof(pages)))
+  {
+    /* mandatory for real SCSI devices, so assume ATA */
+    return 1;
+  }
+  
+  /* Look for ATA Information (0x89) */
+  count = (pages[2] << 8) + pages[3];
+  for (i = 0; (i < count) && (i + 4 < sizeof(pages)); i++)
+  {
+    if (pages[i + 4] == 0x89)
+    {
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+/**
+ * \brief Probe SCSI Device for TPM
+ *
+ * Check that device accepts SECURITY PROTOCOL IN
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_probe_tpm(struct tp_scsi_handle *handle)
+{
+  uint8_t data[512];
+  
+  /* Security protocol information is mandatory if supported at all */
+  TP_DEBUG(1) printf("Probe SCSI Security Protocol support\n");
+  if (tp_scsi_if_recv(handle, 0, 0, data, sizeof(data)))
+  {
+    return tp_errno = TP_ERR_NO_TPM;
+  }
+  
+  /* looks ok */
+  return tp_errno = TP_ERR_SUCCESS;
+}
+
+/**
+ * \brief SCSI IF-SEND
+ *
+ * Implementation of TCG SWG IF-SEND method to send
+ * data to a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[in] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_if_send(struct tp_scsi_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len)
+{
+  /* SCSI Command - SECURITY PROTOCOL OUT (0xb5) */
+  uint8_t cdb[12];
+  memset(cdb, 0, sizeof(cdb));
+  cdb[0] = 0xb5;
+  cdb[1] = proto;
+  cdb[2] = comid >> 8;   /* Protocol specific */
+  cdb[3] = comid & 0xff;
+  cdb[4] = 0x00;         /* INC_512 clear, length in bytes */
+  cdb[6] = len >> 24;    /* Transfer length */
+  cdb[7] = len >> 16;
+  cdb[8] = len >> 8;
+  cdb[9] = len & 0xff;
+  
+  /* Off it goes */
+  return tp_scsi_exec(handle, cdb, sizeof(cdb), TP_SCSI_OPER_WRITE,
+		      data, len, 5);
+}
+
+/**
+ * \brief SCSI IF-RECV
+ *
+ * Implementation of TCG SWG IF-RECV method to receive
+ * data from a particular Communication ID via a specified
+ * security protocol.
+ *
+ * \param[in] handle Device handle
+ * \param[in] proto Security protocol
+ * \param[in] comid Communication ID
+ * \param[out] data I/O data buffer
+ * \param[in] len Count of bytes to transfer
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_if_recv(struct tp_scsi_handle *handle, uint8_t proto,
+			   uint16_t comid, void *data, uint32_t len)
+{
+  /* SCSI Command - SECURITY PROTOCOL IN (0xa2) */
+  uint8_t cdb[12];
+  memset(cdb, 0, sizeof(cdb));
+  cdb[0] = 0xa2;
+  cdb[1] = proto;
+  cdb[2] = comid >> 8;   /* Protocol specific */
+  cdb[3] = comid & 0xff;
+  cdb[4] = 0x00;         /* INC_512 clear, length in bytes */
+  cdb[6] = len >> 24;    /* Allocation length */
+  cdb[7] = len >> 16;
+  cdb[8] = len >> 8;
+  cdb[9] = len & 0xff;
+  
+  /* Off it goes */
+  return tp_scsi_exec(handle, cdb, sizeof(cdb), TP_SCSI_OPER_READ,
+		      data, len, 5);
+}
@@ -0,0 +1,245 @@
+/*
+ * Topaz - SCSI Transport (Linux SGIO)
+ *
+ * This file is an implementation of a Linux specific OS API for
+ * basic SCSI commands.
+ *
+ * Copyright (c) 2016, T Parys
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+#include <topaz/debug.h>
+#include <topaz/errno.h>
+#include <topaz/transport_scsi.h>
+
+/** Linux device handle */
+struct tp_scsi_handle
+{
+  int fd; /** POSIX file descriptor */
+  unsigned int timeout_ms; /** Override of per-command timeout, or 0 */
+};
+
+/**
+ * \brief Open SCSI Device (OS Specific)
+ *
+ * OS-agnostic API to provide a SCSI device handle
+ *
+ * \param[in] path Path to device
+ * \return Pointer to new device, or NULL on error
+ */
+struct tp_scsi_handle *tp_scsi_open(char const *path)
+{
+  struct tp_scsi_handle *handle = NULL;
+  int rc, fd = -1;
+  
+  /* open block / generic device */
+  fd = open(path, O_RDWR);
+  if (fd == -1)
+  {
+    rc = TP_ERR_OPEN;
+    goto cleanup;
+  }
+  
+  /* allocate some memory for device handle */
+  handle = (struct tp_scsi_handle*)calloc(sizeof(struct tp_scsi_handle), 1);
+  if (handle == NULL)
+  {
+    rc = TP_ERR_ALLOC;
+    goto cleanup;
+  }
+  
+  /* all done */
+  tp_errno = TP_ERR_SUCCESS;
+  handle->fd = fd;
+  return handle;
+  
+  cleanup: /* on failure */
+  
+  /* close handle if open */
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  
+  /* set errno and return */
+  tp_errno = rc;
+  return NULL;
+}
+
+/**
+ * \brief Close SCSI Device (OS Specific)
+ *
+ * Linux specific API to close a SCSI device handle
+ *
+ * \param[in] handle Device handle
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_close(struct tp_scsi_handle *handle)
+{
+  /* sanity check */
+  if (handle == NULL)
+  {
+    return -1;
+  }
+  
+  /* cleanup */
+  close(handle->fd);
+  free(handle);
+  return 0;
+}
+
+/**
+ * \brief Set Timeout Override (OS Specific)
+ *
+ * Replace the timeout of each command on device, e.g. to fit within the
+ * deadline of a method call in progress
+ *
+ * \param[in] handle Device handle
+ * \param[in] timeout_ms Timeout in milliseconds, or 0 for per-command default
+ */
+void tp_scsi_set_timeout(struct tp_scsi_handle *handle, unsigned int timeout_ms)
+{
+  handle->timeout_ms = timeout_ms;
+}
+
+/**
+ * \brief Execute SCSI Command (OS Specific)
+ *
+ * OS-agnostic API to execute a SCSI command descriptor block
+ *
+ * \param[in] handle Device handle
+ * \param[in] cdb Command descriptor block
+ * \param[in] cdb_len Size of command descriptor block
+ * \param[in] optype Operation type / direction
+ * \param[in,out] data Data buffer for operation
+ * \param[in] len Count of bytes to transfer
+ * \param[in] wait Timeout in seconds
+ * \return 0 on success, error code indicating failure
+ */
+tp_errno_t tp_scsi_exec(struct tp_scsi_handle *handle, uint8_t const *cdb,
+			uint8_t cdb_len, tp_scsi_oper_type_t optype,
+			void *data, uint32_t len, int wait)
+{
+  struct sg_io_hdr sg_io;  // ioctl data structure
+  unsigned char sense[32]; // SCSI sense (error) data
+  int rc;
+  
+  // Initialize structures
+  memset(&sg_io, 0, sizeof(sg_io));
+  memset(&sense, 0, sizeof(sense));
+  
+  ////
+  // Fill in ioctl data
+  //
+  
+  // Mandatory per interface
+  sg_io.interface_id    = 'S';
+  
+  // Location, size of command descriptor block (command)
+  sg_io.cmdp            = (unsigned char*)cdb;
+  sg_io.cmd_len         = cdb_len;
+  
+  // Command data transfer (optional)
+  sg_io.dxferp          = data;
+  sg_io.dxfer_len       = len;
+  
+  // Sense (error) data
+  sg_io.sbp             = sense;
+  sg_io.mx_sb_len       = sizeof(sense);
+  
+  // Timeout (ms)
+  sg_io.timeout         = (handle->timeout_ms ? handle->timeout_ms :
+			   wait * 1000);
+  
+  // Direction
+  switch (optype)
+  {
+    case TP_SCSI_OPER_READ:
+      sg_io.dxfer_direction = SG_DXFER_FROM_DEV;
+      break;
+      
+    case TP_SCSI_OPER_WRITE:
+      sg_io.dxfer_direction = SG_DXFER_TO_DEV;
+      break;
+      
+    default: // Invalid
+      return tp_errno = TP_ERR_INVALID;
+      break;
+  }
+  
+  ////
+  // Run ioctl
+  //
+  
+  // Debug output command
+  TP_DEBUG(4)
+  {
+    // Command descriptor block
+    printf("SCSI CDB:\n");
+    tp_debug_dump(cdb, cdb_len);
+    
+    // Data out?
+    if (optype == TP_SCSI_OPER_WRITE)
+    {
+      printf("Write Data:\n");
+      tp_debug_dump(data, len);
+    }
+  }
+  
+  // System call
+  rc = ioctl(handle->fd, SG_IO, &sg_io);
+  if (rc != 0)
+  {
+    return tp_errno = TP_ERR_IOCTL;
+  }
+  
+  // Debug input
+  if (optype == TP_SCSI_OPER_READ)
+  {
+    TP_DEBUG(4)
+    {
+      printf("Read Data:\n");
+      tp_debug_dump(data, len);
+    }
+  }
+  
+  // Check status (CHECK CONDITION, transport errors, etc)
+  if ((sg_io.info & SG_INFO_OK_MASK) != SG_INFO_OK)
+  {
+    TP_DEBUG(2) printf("SCSI status = %02x, sense key = %x\n",
+		       sg_io.status, sense[sense[0] >= 0x72 ? 1 : 2] & 0x0f);
+    return tp_errno = TP_ERR_SENSE;
+  }
+  
+  // Otherwise ok
+  return tp_errno = TP_ERR_SUCCESS;
+}